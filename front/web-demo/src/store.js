@@ -1,28 +1,20 @@
 import Vue from 'vue'
 import Vuex from 'vuex'
-import axios from 'axios'
 
 Vue.use(Vuex)
 
+const CHART_POINTS = 100
+
 export default new Vuex.Store({
   state: {
     chart_value: [8, 2, 5, 9, 5, 11, 3, 5, 10, 0, 1, 8, 2, 9, 0, 13, 10, 7, 16],
   },
   mutations: {
-    update_chart_value(state, new_value) {
-      state.chart_value.push(new_value);
-      state.chart_value.shift();
+    push_chart_values(state, values) {
+      const merged = state.chart_value.concat(values);
+      state.chart_value = merged.slice(Math.max(0, merged.length - CHART_POINTS));
     }
   },
   actions: {
-    update_chart_value({ commit }) {
-      axios.get("/api/v1/temp/raw")
-        .then(data => {
-          commit("update_chart_value", data.data.raw);
-        })
-        .catch(error => {
-          console.log(error);
-        });
-    }
   }
 })
@@ -0,0 +1,391 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * In-process esp_http_server stand-in for the host build. It keeps the URI handler table and the match
+ * function of httpd_start(), and runs requests from httpd_shim_request() straight through the handlers.
+ * Responses are captured into the caller's buffer instead of a socket, so what a benchmark of the API
+ * measures is the handlers, not the transport. WebSocket sessions are not simulated.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_http_server.h"
+#include "httpd_shim.h"
+
+typedef struct {
+    httpd_config_t config;
+    httpd_uri_t *handlers;
+    size_t handler_count;
+    SemaphoreHandle_t lock;     // one request at a time
+    SemaphoreHandle_t done;     // given when an async handler completes
+} httpd_shim_server_t;
+
+/* Request as the handlers see it, the private part follows the public httpd_req_t */
+typedef struct {
+    httpd_req_t req;
+    const char *headers;
+    const char *body;
+    size_t body_len;
+    size_t body_pos;
+    httpd_shim_response_t *resp;
+    bool async;
+} httpd_shim_req_t;
+
+static httpd_shim_server_t *s_server;
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    if (s_server) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    httpd_shim_server_t *server = calloc(1, sizeof(*server));
+    if (!server) {
+        return ESP_ERR_NO_MEM;
+    }
+    server->config = *config;
+    server->handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+    server->lock = xSemaphoreCreateMutex();
+    server->done = xSemaphoreCreateBinary();
+    if (!server->handlers || !server->lock || !server->done) {
+        free(server->handlers);
+        free(server);
+        return ESP_ERR_NO_MEM;
+    }
+    s_server = server;
+    *handle = server;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    httpd_shim_server_t *server = handle;
+    if (!server || !uri_handler) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (server->handler_count == server->config.max_uri_handlers) {
+        return ESP_ERR_NO_MEM;
+    }
+    server->handlers[server->handler_count++] = *uri_handler;
+    return ESP_OK;
+}
+
+bool httpd_uri_match_wildcard(const char *uri_template, const char *uri_to_match, size_t match_upto)
+{
+    size_t tpl_len = strlen(uri_template);
+    bool asterisk = tpl_len && uri_template[tpl_len - 1] == '*';
+    if (asterisk) {
+        tpl_len--;
+    }
+    bool quest = tpl_len && uri_template[tpl_len - 1] == '?';
+    if (quest) {
+        tpl_len--;  // the character before '?' is optional
+    }
+    if (quest && match_upto == tpl_len - 1 && strncmp(uri_template, uri_to_match, match_upto) == 0) {
+        return true;
+    }
+    if (match_upto < tpl_len || strncmp(uri_template, uri_to_match, tpl_len) != 0) {
+        return false;
+    }
+    return asterisk || match_upto == tpl_len;
+}
+
+static bool uri_matches(const httpd_shim_server_t *server, const char *tpl, const char *uri, size_t len)
+{
+    if (server->config.uri_match_fn) {
+        return server->config.uri_match_fn(tpl, uri, len);
+    }
+    return strlen(tpl) == len && strncmp(tpl, uri, len) == 0;
+}
+
+static void capture(httpd_shim_req_t *sr, const char *buf, size_t len)
+{
+    httpd_shim_response_t *resp = sr->resp;
+    if (resp->body && resp->body_len < resp->body_size) {
+        size_t room = resp->body_size - resp->body_len;
+        memcpy(resp->body + resp->body_len, buf, len < room ? len : room);
+    }
+    resp->body_len += len;
+}
+
+esp_err_t httpd_shim_request(httpd_method_t method, const char *uri, const char *body, size_t body_len,
+                             httpd_shim_response_t *resp)
+{
+    return httpd_shim_request_ex(method, uri, NULL, body, body_len, body_len, resp);
+}
+
+esp_err_t httpd_shim_request_ex(httpd_method_t method, const char *uri, const char *headers, const char *body,
+                                size_t body_len, size_t content_len, httpd_shim_response_t *resp)
+{
+    httpd_shim_server_t *server = s_server;
+    if (!server || strlen(uri) > HTTPD_MAX_URI_LEN) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    resp->status = 200;
+    resp->content_type[0] = '\0';
+    resp->body_len = 0;
+    resp->handler_ret = ESP_OK;
+
+    const char *query = strchr(uri, '?');
+    size_t path_len = query ? (size_t)(query - uri) : strlen(uri);
+    const httpd_uri_t *handler = NULL;
+    bool path_known = false;
+    for (size_t i = 0; i < server->handler_count && !handler; i++) {
+        if (uri_matches(server, server->handlers[i].uri, uri, path_len)) {
+            path_known = true;
+            if (server->handlers[i].method == method) {
+                handler = &server->handlers[i];
+            }
+        }
+    }
+    if (!handler) {
+        resp->status = path_known ? 405 : 404;
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    httpd_shim_req_t sr = {
+        .req = {
+            .handle = server,
+            .method = method,
+            .content_len = content_len,
+            .user_ctx = handler->user_ctx,
+        },
+        .headers = headers,
+        .body = body,
+        .body_len = body_len < content_len ? body_len : content_len,
+        .resp = resp,
+    };
+    strcpy((char *)sr.req.uri, uri);
+
+    xSemaphoreTake(server->lock, portMAX_DELAY);
+    resp->handler_ret = handler->handler(&sr.req);
+    if (sr.async) {
+        xSemaphoreTake(server->done, portMAX_DELAY);
+    }
+    xSemaphoreGive(server->lock);
+    return ESP_OK;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    httpd_shim_req_t *sr = (httpd_shim_req_t *)r;
+    size_t n = sr->body_len - sr->body_pos;
+    if (n > buf_len) {
+        n = buf_len;
+    }
+    if (!n && buf_len) {
+        return 0;   // connection closed, whatever Content-Length promised
+    }
+    memcpy(buf, sr->body + sr->body_pos, n);
+    sr->body_pos += n;
+    return n;
+}
+
+/* Value of a header line, matched case-insensitively as the server does, NULL when not sent */
+static const char *find_hdr(httpd_req_t *r, const char *field, size_t *len)
+{
+    const char *line = ((httpd_shim_req_t *)r)->headers;
+    size_t field_len = strlen(field);
+    while (line && *line) {
+        const char *end = strstr(line, "\r\n");
+        size_t line_len = end ? (size_t)(end - line) : strlen(line);
+        if (line_len > field_len && strncasecmp(line, field, field_len) == 0 && line[field_len] == ':') {
+            const char *value = line + field_len + 1;
+            while (*value == ' ') {
+                value++;
+            }
+            *len = line + line_len - value;
+            return value;
+        }
+        line = end ? end + 2 : NULL;
+    }
+    return NULL;
+}
+
+size_t httpd_req_get_hdr_value_len(httpd_req_t *r, const char *field)
+{
+    size_t len = 0;
+    find_hdr(r, field, &len);
+    return len;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    size_t len;
+    const char *value = find_hdr(r, field, &len);
+    if (!value) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (len >= val_size) {
+        return ESP_ERR_HTTPD_RESULT_TRUNC;
+    }
+    memcpy(val, value, len);
+    val[len] = '\0';
+    return ESP_OK;
+}
+
+size_t httpd_req_get_url_query_len(httpd_req_t *r)
+{
+    const char *query = strchr(r->uri, '?');
+    return query ? strlen(query + 1) : 0;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    const char *query = strchr(r->uri, '?');
+    if (!query) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (strlen(query + 1) >= buf_len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    strcpy(buf, query + 1);
+    return ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t key_len = strlen(key);
+    const char *p = qry;
+    while (p && *p) {
+        const char *end = strchr(p, '&');
+        size_t pair_len = end ? (size_t)(end - p) : strlen(p);
+        if (pair_len > key_len && strncmp(p, key, key_len) == 0 && p[key_len] == '=') {
+            size_t value_len = pair_len - key_len - 1;
+            if (value_len >= val_size) {
+                return ESP_ERR_INVALID_SIZE;
+            }
+            memcpy(val, p + key_len + 1, value_len);
+            val[value_len] = '\0';
+            return ESP_OK;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r)
+{
+    return 3;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    ((httpd_shim_req_t *)r)->resp->status = atoi(status);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    httpd_shim_response_t *resp = ((httpd_shim_req_t *)r)->resp;
+    strlcpy(resp->content_type, type, sizeof(resp->content_type));
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    if (buf && buf_len == HTTPD_RESP_USE_STRLEN) {
+        buf_len = strlen(buf);
+    }
+    if (buf && buf_len > 0) {
+        capture((httpd_shim_req_t *)r, buf, buf_len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    return httpd_resp_send(r, buf, buf_len);
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str)
+{
+    return httpd_resp_send(r, str, str ? HTTPD_RESP_USE_STRLEN : 0);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *req, httpd_err_code_t error, const char *msg)
+{
+    static const int codes[HTTPD_ERR_CODE_MAX] = {
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = 500,
+        [HTTPD_501_METHOD_NOT_IMPLEMENTED] = 501,
+        [HTTPD_505_VERSION_NOT_SUPPORTED] = 505,
+        [HTTPD_400_BAD_REQUEST] = 400,
+        [HTTPD_401_UNAUTHORIZED] = 401,
+        [HTTPD_403_FORBIDDEN] = 403,
+        [HTTPD_404_NOT_FOUND] = 404,
+        [HTTPD_405_METHOD_NOT_ALLOWED] = 405,
+        [HTTPD_408_REQ_TIMEOUT] = 408,
+        [HTTPD_411_LENGTH_REQUIRED] = 411,
+        [HTTPD_414_URI_TOO_LONG] = 414,
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = 431,
+    };
+    httpd_shim_response_t *resp = ((httpd_shim_req_t *)req)->resp;
+    resp->status = error < HTTPD_ERR_CODE_MAX ? codes[error] : 500;
+    strlcpy(resp->content_type, HTTPD_TYPE_TEXT, sizeof(resp->content_type));
+    return httpd_resp_sendstr(req, msg);
+}
+
+int httpd_send(httpd_req_t *r, const char *buf, size_t buf_len)
+{
+    capture((httpd_shim_req_t *)r, buf, buf_len);
+    return buf_len;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out)
+{
+    httpd_shim_req_t *sr = (httpd_shim_req_t *)r;
+    httpd_shim_req_t *copy = malloc(sizeof(*copy));
+    if (!copy) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, sr, sizeof(*copy));
+    sr->async = true;
+    *out = &copy->req;
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r)
+{
+    httpd_shim_server_t *server = r->handle;
+    free(r);
+    xSemaphoreGive(server->done);
+    return ESP_OK;
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work, void *arg)
+{
+    work(arg);
+    return ESP_OK;
+}
+
+esp_err_t httpd_sess_trigger_close(httpd_handle_t handle, int sockfd)
+{
+    return ESP_OK;
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt, size_t max_len)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd, httpd_ws_frame_t *frame)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+httpd_ws_client_info_t httpd_ws_get_fd_info(httpd_handle_t hd, int fd)
+{
+    return HTTPD_WS_CLIENT_INVALID;
+}
@@ -0,0 +1,46 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+ * Client side of the esp_http_server stand-in. There are no sockets: httpd_shim_request() looks up the
+ * handler registered for a method and URI, the same way the server does with its uri_match_fn, and calls it
+ * on the calling task with the body as the request data. Handlers that go async are waited for until they
+ * call httpd_req_async_handler_complete(). One request runs at a time.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include "esp_http_server.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    int status;                 // from httpd_resp_set_status() or httpd_resp_send_err(), 200 otherwise
+    char content_type[48];
+    char *body;                 // caller's buffer, may be NULL to only count the bytes
+    size_t body_size;
+    size_t body_len;            // bytes sent, including any that did not fit into body
+    esp_err_t handler_ret;
+} httpd_shim_response_t;
+
+/* Run one request, ESP_ERR_NOT_FOUND when no handler matches (status is 404 or 405 then) */
+esp_err_t httpd_shim_request(httpd_method_t method, const char *uri, const char *body, size_t body_len,
+                             httpd_shim_response_t *resp);
+
+/*
+ * Same with request headers, "Name: value\r\n" lines or NULL, and a Content-Length that may be larger than
+ * body_len: httpd_req_recv() then reports the connection closed after body_len bytes, like a client that
+ * went away in the middle of an upload
+ */
+esp_err_t httpd_shim_request_ex(httpd_method_t method, const char *uri, const char *headers, const char *body,
+                                size_t body_len, size_t content_len, httpd_shim_response_t *resp);
+
+#ifdef __cplusplus
+}
+#endif
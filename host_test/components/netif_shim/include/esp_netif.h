@@ -0,0 +1,66 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the esp_netif API used by the example, see netif_shim.h */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_event.h"
+#include "esp_netif_ip_addr.h"
+
+typedef struct esp_netif_obj esp_netif_t;
+
+typedef struct {
+    esp_ip4_addr_t ip;
+    esp_ip4_addr_t netmask;
+    esp_ip4_addr_t gw;
+} esp_netif_ip_info_t;
+
+typedef enum {
+    ESP_NETIF_DHCP_CLIENT = 1 << 0,
+    ESP_NETIF_DHCP_SERVER = 1 << 1,
+    ESP_NETIF_FLAG_AUTOUP = 1 << 2,
+} esp_netif_flags_t;
+
+typedef struct {
+    esp_netif_flags_t flags;
+    uint8_t mac[6];
+    const esp_netif_ip_info_t *ip_info;
+    uint32_t get_ip_event;
+    uint32_t lost_ip_event;
+    const char *if_key;
+    const char *if_desc;
+    int route_prio;
+} esp_netif_inherent_config_t;
+
+typedef void *esp_netif_iodriver_handle;
+
+typedef struct {
+    esp_netif_iodriver_handle handle;
+    esp_err_t (*transmit)(void *h, void *buffer, size_t len);
+    esp_err_t (*transmit_wrap)(void *h, void *buffer, size_t len, void *netstack_buffer);
+    void (*driver_free_rx_buffer)(void *h, void *buffer);
+} esp_netif_driver_ifconfig_t;
+
+typedef struct esp_netif_netstack_config esp_netif_netstack_config_t;
+
+typedef struct {
+    const esp_netif_inherent_config_t *base;
+    const esp_netif_driver_ifconfig_t *driver;
+    const esp_netif_netstack_config_t *stack;
+} esp_netif_config_t;
+
+typedef esp_err_t esp_netif_recv_ret_t;
+
+esp_err_t esp_netif_init(void);
+esp_netif_t *esp_netif_new(const esp_netif_config_t *esp_netif_config);
+esp_err_t esp_netif_set_mac(esp_netif_t *esp_netif, uint8_t mac[]);
+void esp_netif_action_start(void *esp_netif, esp_event_base_t base, int32_t event_id, void *data);
+esp_err_t esp_netif_receive(esp_netif_t *esp_netif, void *buffer, size_t len, void *eb);
@@ -0,0 +1,14 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the netstack buffer references, see netif_shim.h */
+
+#pragma once
+
+#include "esp_netif.h"
+
+void esp_netif_netstack_buf_ref(void *netstack_buf);
+void esp_netif_netstack_buf_free(void *netstack_buf);
@@ -0,0 +1,27 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the lwIP side of esp_netif: the Ethernet netif glue and address parsing */
+
+#pragma once
+
+#include <stdint.h>
+#include "esp_netif.h"
+#include "esp_netif_net_stack.h"
+
+struct netif;
+typedef int8_t err_t;
+
+struct esp_netif_netstack_config {
+    struct {
+        err_t (*init_fn)(struct netif *);
+        esp_netif_recv_ret_t (*input_fn)(void *netif, void *buffer, size_t len, void *eb);
+    } lwip;
+};
+
+err_t ethernetif_init(struct netif *netif);
+esp_netif_recv_ret_t ethernetif_input(void *h, void *buffer, size_t len, void *l2_buff);
+uint32_t ipaddr_addr(const char *cp);
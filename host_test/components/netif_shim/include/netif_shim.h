@@ -0,0 +1,58 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+ * Stack side of the esp_netif stand-in. esp_netif_new() keeps the configuration it is given and wires it up
+ * the way esp_netif does with lwIP: esp_netif_receive() goes through the stack's input_fn, and frames that
+ * reach ethernetif_input() are handed to an input hook, or released with the driver's free callback right
+ * away as if lwIP had consumed them. The host test sends frames "from lwIP" with netif_shim_output().
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_netif.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called for every frame that reaches ethernetif_input(), the hook owns it until netif_shim_free_rx() */
+typedef void (*netif_shim_input_t)(esp_netif_t *netif, void *buffer, size_t len, void *arg);
+
+typedef struct {
+    uint32_t rx_frames;         // frames passed to ethernetif_input()
+    uint32_t rx_bytes;
+    uint32_t rx_freed;          // frames given back through driver_free_rx_buffer
+    uint32_t tx_frames;         // frames the driver accepted from netif_shim_output()
+    uint32_t tx_refused;
+    uint32_t bufs_live;         // netstack buffers not freed yet
+} netif_shim_stats_t;
+
+/* The netif created with the given if_key, NULL if there is none */
+esp_netif_t *netif_shim_find(const char *if_key);
+
+/* What the netif was configured with */
+const esp_netif_inherent_config_t *netif_shim_base_config(esp_netif_t *netif);
+const esp_netif_ip_info_t *netif_shim_ip_info(esp_netif_t *netif);
+const esp_netif_driver_ifconfig_t *netif_shim_driver_config(esp_netif_t *netif);
+
+void netif_shim_set_input(netif_shim_input_t input, void *arg);
+void netif_shim_free_rx(esp_netif_t *netif, void *buffer);
+
+/* Reference counted netstack buffer, created with one reference held by the caller */
+void *netif_shim_buf_alloc(const void *payload, size_t len);
+void *netif_shim_buf_payload(void *netstack_buf);
+
+/* Send a netstack buffer through the driver's transmit_wrap, or transmit when there is none */
+esp_err_t netif_shim_output(esp_netif_t *netif, void *netstack_buf, size_t len);
+
+void netif_shim_get_stats(netif_shim_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
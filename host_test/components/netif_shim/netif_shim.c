@@ -0,0 +1,266 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * esp_netif stand-in for the host build, without a TCP/IP stack behind it. It keeps what the example passes
+ * to esp_netif_new() so the host test can check the configuration and call the driver callbacks, and it
+ * follows the real call chain on receive: esp_netif_receive() -> the stack's input_fn -> ethernetif_input(),
+ * where lwIP would take over the frame. Netstack buffers are reference counted like pbufs.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_netif.h"
+#include "lwip/esp_netif_net_stack.h"
+#include "netif_shim.h"
+
+static const char *TAG = "NETIF_SHIM";
+
+#define NETIF_SHIM_MAX_NETIFS   4
+
+struct esp_netif_obj {
+    esp_netif_inherent_config_t base;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_driver_ifconfig_t driver;
+    struct esp_netif_netstack_config stack;
+    uint8_t mac[6];
+    bool started;
+};
+
+typedef struct {
+    _Atomic uint32_t refs;
+    size_t len;
+    uint8_t payload[];
+} netif_shim_buf_t;
+
+static const uint8_t s_base_mac[6] = { 0x02, 0x00, 0x00, 0x12, 0x34, 0x56 };
+
+static struct {
+    esp_netif_t *netifs[NETIF_SHIM_MAX_NETIFS];
+    netif_shim_input_t input;
+    void *input_arg;
+    _Atomic uint32_t rx_frames;
+    _Atomic uint32_t rx_bytes;
+    _Atomic uint32_t rx_freed;
+    _Atomic uint32_t tx_frames;
+    _Atomic uint32_t tx_refused;
+    _Atomic uint32_t bufs_live;
+} s_shim;
+
+esp_err_t esp_event_loop_create_default(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register(esp_event_base_t event_base, int32_t event_id,
+                                     esp_event_handler_t event_handler, void *event_handler_arg)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_base_mac_addr_get(uint8_t *mac)
+{
+    memcpy(mac, s_base_mac, sizeof(s_base_mac));
+    return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    // Same layout as the universal MAC addresses on the chip: base, base + 1, ... per interface type
+    memcpy(mac, s_base_mac, sizeof(s_base_mac));
+    mac[5] += type;
+    return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void)
+{
+    return ESP_OK;
+}
+
+esp_netif_t *esp_netif_new(const esp_netif_config_t *esp_netif_config)
+{
+    if (!esp_netif_config || !esp_netif_config->base || !esp_netif_config->driver || !esp_netif_config->stack) {
+        return NULL;
+    }
+    int slot = 0;
+    while (slot < NETIF_SHIM_MAX_NETIFS && s_shim.netifs[slot]) {
+        slot++;
+    }
+    esp_netif_t *netif = calloc(1, sizeof(*netif));
+    if (slot == NETIF_SHIM_MAX_NETIFS || !netif) {
+        free(netif);
+        return NULL;
+    }
+    netif->base = *esp_netif_config->base;
+    if (netif->base.ip_info) {
+        netif->ip_info = *netif->base.ip_info;
+        netif->base.ip_info = &netif->ip_info;
+    }
+    netif->driver = *esp_netif_config->driver;
+    netif->stack = *esp_netif_config->stack;
+    if (netif->stack.lwip.init_fn && netif->stack.lwip.init_fn((struct netif *)netif) != 0) {
+        free(netif);
+        return NULL;
+    }
+    s_shim.netifs[slot] = netif;
+    return netif;
+}
+
+esp_err_t esp_netif_set_mac(esp_netif_t *esp_netif, uint8_t mac[])
+{
+    memcpy(esp_netif->mac, mac, sizeof(esp_netif->mac));
+    return ESP_OK;
+}
+
+void esp_netif_action_start(void *esp_netif, esp_event_base_t base, int32_t event_id, void *data)
+{
+    ((esp_netif_t *)esp_netif)->started = true;
+}
+
+esp_err_t esp_netif_receive(esp_netif_t *esp_netif, void *buffer, size_t len, void *eb)
+{
+    if (!esp_netif->stack.lwip.input_fn) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return esp_netif->stack.lwip.input_fn(esp_netif, buffer, len, eb);
+}
+
+err_t ethernetif_init(struct netif *netif)
+{
+    return 0;
+}
+
+esp_netif_recv_ret_t ethernetif_input(void *h, void *buffer, size_t len, void *l2_buff)
+{
+    esp_netif_t *netif = h;
+    if (!netif->started) {
+        netif_shim_free_rx(netif, buffer);
+        return ESP_FAIL;
+    }
+    atomic_fetch_add(&s_shim.rx_frames, 1);
+    atomic_fetch_add(&s_shim.rx_bytes, len);
+    if (s_shim.input) {
+        s_shim.input(netif, buffer, len, s_shim.input_arg);
+    } else {
+        netif_shim_free_rx(netif, buffer);
+    }
+    return ESP_OK;
+}
+
+uint32_t ipaddr_addr(const char *cp)
+{
+    return inet_addr(cp);
+}
+
+esp_netif_t *netif_shim_find(const char *if_key)
+{
+    for (int i = 0; i < NETIF_SHIM_MAX_NETIFS; i++) {
+        esp_netif_t *netif = s_shim.netifs[i];
+        if (netif && netif->base.if_key && strcmp(netif->base.if_key, if_key) == 0) {
+            return netif;
+        }
+    }
+    return NULL;
+}
+
+const esp_netif_inherent_config_t *netif_shim_base_config(esp_netif_t *netif)
+{
+    return &netif->base;
+}
+
+const esp_netif_ip_info_t *netif_shim_ip_info(esp_netif_t *netif)
+{
+    return &netif->ip_info;
+}
+
+const esp_netif_driver_ifconfig_t *netif_shim_driver_config(esp_netif_t *netif)
+{
+    return &netif->driver;
+}
+
+void netif_shim_set_input(netif_shim_input_t input, void *arg)
+{
+    s_shim.input_arg = arg;
+    s_shim.input = input;
+}
+
+void netif_shim_free_rx(esp_netif_t *netif, void *buffer)
+{
+    if (netif->driver.driver_free_rx_buffer) {
+        netif->driver.driver_free_rx_buffer(netif->driver.handle, buffer);
+    }
+    atomic_fetch_add(&s_shim.rx_freed, 1);
+}
+
+void *netif_shim_buf_alloc(const void *payload, size_t len)
+{
+    netif_shim_buf_t *buf = malloc(sizeof(*buf) + len);
+    if (!buf) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    if (payload) {
+        memcpy(buf->payload, payload, len);
+    }
+    atomic_fetch_add(&s_shim.bufs_live, 1);
+    return buf;
+}
+
+void *netif_shim_buf_payload(void *netstack_buf)
+{
+    return ((netif_shim_buf_t *)netstack_buf)->payload;
+}
+
+void esp_netif_netstack_buf_ref(void *netstack_buf)
+{
+    atomic_fetch_add(&((netif_shim_buf_t *)netstack_buf)->refs, 1);
+}
+
+void esp_netif_netstack_buf_free(void *netstack_buf)
+{
+    netif_shim_buf_t *buf = netstack_buf;
+    if (atomic_fetch_sub(&buf->refs, 1) == 1) {
+        atomic_fetch_sub(&s_shim.bufs_live, 1);
+        free(buf);
+    }
+}
+
+esp_err_t netif_shim_output(esp_netif_t *netif, void *netstack_buf, size_t len)
+{
+    netif_shim_buf_t *buf = netstack_buf;
+    if (len > buf->len) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t ret;
+    if (netif->driver.transmit_wrap) {
+        ret = netif->driver.transmit_wrap(netif->driver.handle, buf->payload, len, buf);
+    } else {
+        ret = netif->driver.transmit(netif->driver.handle, buf->payload, len);
+    }
+    if (ret == ESP_OK) {
+        atomic_fetch_add(&s_shim.tx_frames, 1);
+    } else {
+        atomic_fetch_add(&s_shim.tx_refused, 1);
+        ESP_LOGD(TAG, "Driver refused a frame (%s)", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+void netif_shim_get_stats(netif_shim_stats_t *stats)
+{
+    stats->rx_frames = atomic_load(&s_shim.rx_frames);
+    stats->rx_bytes = atomic_load(&s_shim.rx_bytes);
+    stats->rx_freed = atomic_load(&s_shim.rx_freed);
+    stats->tx_frames = atomic_load(&s_shim.tx_frames);
+    stats->tx_refused = atomic_load(&s_shim.tx_refused);
+    stats->bufs_live = atomic_load(&s_shim.bufs_live);
+}
@@ -0,0 +1,13 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the VFS limits, paths go to the host filesystem as they are */
+
+#pragma once
+
+#include <unistd.h>
+
+#define ESP_VFS_PATH_MAX 15
@@ -0,0 +1,30 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the esp_tinyusb driver API used by the example, see usb_shim.h */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "tusb.h"
+
+typedef enum {
+    TINYUSB_USBDEV_0,
+} tinyusb_usbdev_t;
+
+typedef struct {
+    const void *device_descriptor;
+    const char **string_descriptor;
+    int string_descriptor_count;
+    bool external_phy;
+    const uint8_t *configuration_descriptor;
+    bool self_powered;
+    int vbus_monitor_io;
+} tinyusb_config_t;
+
+esp_err_t tinyusb_driver_install(const tinyusb_config_t *config);
@@ -0,0 +1,26 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the esp_tinyusb NCM API, see usb_shim.h */
+
+#pragma once
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "tinyusb.h"
+
+typedef esp_err_t (*tusb_net_rx_cb_t)(void *buffer, uint16_t len, void *ctx);
+typedef void (*tusb_net_free_tx_cb_t)(void *buffer, void *ctx);
+
+typedef struct {
+    uint8_t mac_addr[6];
+    tusb_net_rx_cb_t on_recv_callback;
+    tusb_net_free_tx_cb_t free_tx_buffer;
+    void *user_context;
+} tinyusb_net_config_t;
+
+esp_err_t tinyusb_net_init(tinyusb_usbdev_t usb_dev, const tinyusb_net_config_t *cfg);
+esp_err_t tinyusb_net_send_sync(void *buffer, uint16_t len, void *buff_free_arg, TickType_t timeout);
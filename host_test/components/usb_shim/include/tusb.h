@@ -0,0 +1,14 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* Host build stand-in for the TinyUSB device stack state, see usb_shim.h */
+
+#pragma once
+
+#include <stdbool.h>
+
+/* True once the simulated host has configured the device */
+bool tud_ready(void);
@@ -0,0 +1,68 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+ * Host side of the simulated USB bus. The example talks to the tinyusb*.h stand-ins as it would to
+ * esp_tinyusb; the host test plays the USB host through the functions below: it hands OUT frames and CDC-ACM
+ * data to the callbacks the example registered, and gets every IN frame and CDC-ACM write through a sink.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the CDC-ACM OUT FIFO and the most tinyusb_cdcacm_write_queue() takes at once, as in TinyUSB */
+#define USB_SHIM_CDC_FIFO_SIZE  512
+
+/* Bulk transfer limits of the two bus speeds: packet size and packets per millisecond (19 per FS frame,
+ * 13 per HS microframe), i.e. 9.7 and 426 Mbit/s of payload when nothing else uses the bus */
+#define USB_SHIM_LINK_FS        { .max_packet_size = 64, .packets_per_ms = 19 }
+#define USB_SHIM_LINK_HS        { .max_packet_size = 512, .packets_per_ms = 104 }
+
+typedef struct {
+    uint16_t max_packet_size;
+    uint16_t packets_per_ms;
+    uint8_t in_ntb_n;       // NCM IN NTBs the device can fill ahead of the host, 0 for CFG_TUD_NCM_IN_NTB_N
+} usb_shim_link_t;
+
+typedef void (*usb_shim_ncm_sink_t)(const void *frame, uint16_t len, void *arg);
+typedef void (*usb_shim_cdc_sink_t)(int itf, const uint8_t *data, size_t len, void *arg);
+
+/*
+ * Pace NCM frames like a USB link instead of passing them on right away. Both directions share the bus:
+ * each frame takes its packets' worth of bus time, NTB headers and the short packet included. IN frames
+ * wait in one of in_ntb_n NTBs until the bus has carried them, and tinyusb_net_send_sync() blocks while
+ * all NTBs are in use. Call once, before the driver is installed.
+ */
+esp_err_t usb_shim_set_link(const usb_shim_link_t *link);
+
+/* Attach or detach the simulated host, tud_ready() follows it (attached once the driver is installed) */
+void usb_shim_set_attached(bool attached);
+
+/* Deliver one NCM OUT frame to the RX callback given to tinyusb_net_init(), returns what the callback did.
+ * With a link set, the call first waits until the bus has carried the frame. */
+esp_err_t usb_shim_ncm_receive(const void *frame, uint16_t len);
+
+/* Called with every frame passed to tinyusb_net_send_sync(), from the sending task, or from the link task
+ * once the frame is due when a link is set */
+void usb_shim_set_ncm_sink(usb_shim_ncm_sink_t sink, void *arg);
+
+/* Queue CDC-ACM OUT data and run the RX callback, returns how much fitted into the OUT FIFO */
+size_t usb_shim_cdc_receive(int itf, const void *data, size_t len);
+
+/* Called with everything queued by tinyusb_cdcacm_write_queue(), from the writing task */
+void usb_shim_set_cdc_sink(usb_shim_cdc_sink_t sink, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,301 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Simulated USB bus for the host build. NCM IN frames and CDC-ACM writes go straight to the sinks the host
+ * test installed, so they cost what a copy into an NTB or the TX FIFO would and nothing more. CDC-ACM OUT
+ * data waits in a FIFO of TinyUSB's size until the example reads it, and the RX callback fires once per
+ * delivery, from the task of whoever delivered it, as it would from the TinyUSB task on the device.
+ *
+ * usb_shim_set_link() turns the NCM side into a paced link. Both directions book time on one bus timeline,
+ * a whole number of packets per frame, so small frames cost what their short packets cost on a real bus.
+ * The timeline is kept in nanoseconds and the waits are whole ticks: a frame can arrive up to a tick early,
+ * the average rate stays that of the bus. Each IN frame gets an NTB of its own, which is the worst case of
+ * TinyUSB's packing; the OUT side hands frames over one at a time.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
+#include "tinyusb.h"
+#include "tinyusb_net.h"
+#include "tusb_cdc_acm.h"
+#include "usb_shim.h"
+
+#ifndef CFG_TUD_NCM_IN_NTB_N
+#define CFG_TUD_NCM_IN_NTB_N    1
+#endif
+
+#define USB_SHIM_NTB_HEADERS    28      // NTH16 and an NDP16 with one datagram and its terminator
+#define USB_SHIM_NTB_FRAME_MAX  1536
+#define USB_SHIM_LINK_STACK     4096
+#define USB_SHIM_LINK_PRIO      (configMAX_PRIORITIES - 2)
+#define NS_PER_TICK             ((int64_t)portTICK_PERIOD_MS * 1000000)
+
+typedef struct {
+    uint16_t len;
+    uint8_t frame[USB_SHIM_NTB_FRAME_MAX];
+} usb_shim_ntb_t;
+
+typedef struct {
+    tinyusb_config_cdcacm_t cfg;
+    tusb_cdcacm_callback_t line_state_cb;
+    uint8_t out[USB_SHIM_CDC_FIFO_SIZE];
+    size_t out_len;
+} usb_shim_cdc_t;
+
+static struct {
+    atomic_bool installed;
+    atomic_bool attached;
+    tinyusb_net_config_t net;
+    usb_shim_ncm_sink_t ncm_sink;
+    void *ncm_sink_arg;
+    usb_shim_cdc_t cdc[TINYUSB_CDC_ACM_MAX];
+    usb_shim_cdc_sink_t cdc_sink;
+    void *cdc_sink_arg;
+    portMUX_TYPE lock;
+} s_usb = {
+    .attached = true,
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static struct {
+    bool enabled;
+    uint16_t max_packet_size;
+    int64_t packet_ns;
+    int64_t bus_free_ns;            // end of the last transfer booked on the bus
+    usb_shim_ntb_t *ntbs;
+    QueueHandle_t free_ntbs;        // indices of NTBs the device can fill
+    QueueHandle_t filled_ntbs;      // indices of NTBs waiting for the bus, in order
+} s_link;
+
+/* Book a frame on the bus, returns when its last packet is through */
+static int64_t link_book(uint16_t len)
+{
+    // The transfer ends with a short packet, a zero-length one if the NTB fills the last packet exactly
+    int64_t packets = (len + USB_SHIM_NTB_HEADERS) / s_link.max_packet_size + 1;
+    int64_t now = esp_timer_get_time() * 1000;
+    portENTER_CRITICAL(&s_usb.lock);
+    int64_t start = MAX(now, s_link.bus_free_ns);
+    s_link.bus_free_ns = start + packets * s_link.packet_ns;
+    int64_t done = s_link.bus_free_ns;
+    portEXIT_CRITICAL(&s_usb.lock);
+    return done;
+}
+
+static void link_wait(int64_t done_ns)
+{
+    int64_t ahead;
+    while ((ahead = done_ns - esp_timer_get_time() * 1000) >= NS_PER_TICK) {
+        vTaskDelay(ahead / NS_PER_TICK);
+    }
+}
+
+/* The host polling the IN endpoint: one NTB at a time, each when the bus has carried it */
+static void link_in_task(void *arg)
+{
+    uint8_t idx;
+    while (1) {
+        if (xQueueReceive(s_link.filled_ntbs, &idx, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        usb_shim_ntb_t *ntb = &s_link.ntbs[idx];
+        link_wait(link_book(ntb->len));
+        if (s_usb.ncm_sink) {
+            s_usb.ncm_sink(ntb->frame, ntb->len, s_usb.ncm_sink_arg);
+        }
+        xQueueSend(s_link.free_ntbs, &idx, 0);
+    }
+}
+
+esp_err_t usb_shim_set_link(const usb_shim_link_t *link)
+{
+    if (!link || !link->max_packet_size || !link->packets_per_ms) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_link.enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    uint8_t ntb_n = link->in_ntb_n ? link->in_ntb_n : CFG_TUD_NCM_IN_NTB_N;
+    s_link.ntbs = calloc(ntb_n, sizeof(usb_shim_ntb_t));
+    s_link.free_ntbs = xQueueCreate(ntb_n, sizeof(uint8_t));
+    s_link.filled_ntbs = xQueueCreate(ntb_n, sizeof(uint8_t));
+    if (!s_link.ntbs || !s_link.free_ntbs || !s_link.filled_ntbs) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (uint8_t i = 0; i < ntb_n; i++) {
+        xQueueSend(s_link.free_ntbs, &i, 0);
+    }
+    s_link.max_packet_size = link->max_packet_size;
+    s_link.packet_ns = 1000000 / link->packets_per_ms;
+    if (xTaskCreate(link_in_task, "usb_link_in", USB_SHIM_LINK_STACK, NULL, USB_SHIM_LINK_PRIO, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_link.enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t tinyusb_driver_install(const tinyusb_config_t *config)
+{
+    atomic_store(&s_usb.installed, true);
+    return ESP_OK;
+}
+
+bool tud_ready(void)
+{
+    return atomic_load(&s_usb.installed) && atomic_load(&s_usb.attached);
+}
+
+void usb_shim_set_attached(bool attached)
+{
+    atomic_store(&s_usb.attached, attached);
+}
+
+esp_err_t tinyusb_net_init(tinyusb_usbdev_t usb_dev, const tinyusb_net_config_t *cfg)
+{
+    if (!cfg) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_usb.net = *cfg;
+    return ESP_OK;
+}
+
+esp_err_t tinyusb_net_send_sync(void *buffer, uint16_t len, void *buff_free_arg, TickType_t timeout)
+{
+    if (!tud_ready()) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_link.enabled) {
+        // Copied into a free NTB, the link task sends it on when the bus gets to it
+        uint8_t idx;
+        if (len > USB_SHIM_NTB_FRAME_MAX) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        if (xQueueReceive(s_link.free_ntbs, &idx, timeout) != pdTRUE) {
+            return ESP_ERR_TIMEOUT;
+        }
+        memcpy(s_link.ntbs[idx].frame, buffer, len);
+        s_link.ntbs[idx].len = len;
+        xQueueSend(s_link.filled_ntbs, &idx, 0);
+    } else if (s_usb.ncm_sink) {
+        s_usb.ncm_sink(buffer, len, s_usb.ncm_sink_arg);
+    }
+    if (s_usb.net.free_tx_buffer) {
+        s_usb.net.free_tx_buffer(buff_free_arg, s_usb.net.user_context);
+    }
+    return ESP_OK;
+}
+
+esp_err_t usb_shim_ncm_receive(const void *frame, uint16_t len)
+{
+    if (!tud_ready() || !s_usb.net.on_recv_callback) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (s_link.enabled) {
+        link_wait(link_book(len));
+    }
+    return s_usb.net.on_recv_callback((void *)frame, len, s_usb.net.user_context);
+}
+
+void usb_shim_set_ncm_sink(usb_shim_ncm_sink_t sink, void *arg)
+{
+    s_usb.ncm_sink_arg = arg;
+    s_usb.ncm_sink = sink;
+}
+
+esp_err_t tusb_cdc_acm_init(const tinyusb_config_cdcacm_t *cfg)
+{
+    if (!cfg || cfg->cdc_port >= TINYUSB_CDC_ACM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    s_usb.cdc[cfg->cdc_port].cfg = *cfg;
+    return ESP_OK;
+}
+
+esp_err_t tinyusb_cdcacm_register_callback(tinyusb_cdcacm_itf_t itf, cdcacm_event_type_t event_type,
+                                           tusb_cdcacm_callback_t callback)
+{
+    if (itf >= TINYUSB_CDC_ACM_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    switch (event_type) {
+    case CDC_EVENT_RX:
+        s_usb.cdc[itf].cfg.callback_rx = callback;
+        return ESP_OK;
+    case CDC_EVENT_LINE_STATE_CHANGED:
+        s_usb.cdc[itf].line_state_cb = callback;
+        return ESP_OK;
+    default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+}
+
+esp_err_t tinyusb_cdcacm_read(tinyusb_cdcacm_itf_t itf, uint8_t *out_buf, size_t out_buf_sz, size_t *rx_data_size)
+{
+    if (itf >= TINYUSB_CDC_ACM_MAX || !rx_data_size) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    usb_shim_cdc_t *c = &s_usb.cdc[itf];
+    portENTER_CRITICAL(&s_usb.lock);
+    size_t n = MIN(out_buf_sz, c->out_len);
+    memcpy(out_buf, c->out, n);
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+    portEXIT_CRITICAL(&s_usb.lock);
+    *rx_data_size = n;
+    return ESP_OK;
+}
+
+size_t usb_shim_cdc_receive(int itf, const void *data, size_t len)
+{
+    if (itf < 0 || itf >= TINYUSB_CDC_ACM_MAX || !tud_ready()) {
+        return 0;
+    }
+    usb_shim_cdc_t *c = &s_usb.cdc[itf];
+    portENTER_CRITICAL(&s_usb.lock);
+    size_t n = MIN(len, sizeof(c->out) - c->out_len);
+    memcpy(c->out + c->out_len, data, n);
+    c->out_len += n;
+    portEXIT_CRITICAL(&s_usb.lock);
+
+    if (n && c->cfg.callback_rx) {
+        cdcacm_event_t event = {
+            .type = CDC_EVENT_RX,
+        };
+        c->cfg.callback_rx(itf, &event);
+    }
+    return n;
+}
+
+size_t tinyusb_cdcacm_write_queue(tinyusb_cdcacm_itf_t itf, const uint8_t *in_buf, size_t in_size)
+{
+    if (itf >= TINYUSB_CDC_ACM_MAX || !tud_ready()) {
+        return 0;
+    }
+    // Flushed right away, so the whole TX FIFO is free on every call
+    size_t n = MIN(in_size, USB_SHIM_CDC_FIFO_SIZE);
+    if (s_usb.cdc_sink) {
+        s_usb.cdc_sink(itf, in_buf, n, s_usb.cdc_sink_arg);
+    }
+    return n;
+}
+
+esp_err_t tinyusb_cdcacm_write_flush(tinyusb_cdcacm_itf_t itf, uint32_t timeout_ticks)
+{
+    return itf < TINYUSB_CDC_ACM_MAX ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void usb_shim_set_cdc_sink(usb_shim_cdc_sink_t sink, void *arg)
+{
+    s_usb.cdc_sink_arg = arg;
+    s_usb.cdc_sink = sink;
+}
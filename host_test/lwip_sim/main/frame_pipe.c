@@ -0,0 +1,125 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Frame pipe between the two processes of the simulator, a FIFO per direction. Each frame is written as its
+ * length and its bytes in one write(), which the kernel keeps in one piece below PIPE_BUF, so frames never
+ * interleave. The pipe task reads whatever has arrived once per tick and hands it over frame by frame; the
+ * pacing is done by the USB link on the device side, the pipe only has to keep up with it. A frame that finds
+ * the FIFO full is dropped, as on a congested link.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "sim.h"
+
+static const char *TAG = "FRAME_PIPE";
+
+#define PIPE_FRAME_MAX      1536
+#define PIPE_TASK_STACK     4096
+#define PIPE_TASK_PRIO      (configMAX_PRIORITIES - 3)
+
+_Static_assert(sizeof(uint16_t) + PIPE_FRAME_MAX <= PIPE_BUF, "frames must be written atomically");
+
+static struct {
+    int rx_fd;
+    int tx_fd;
+    frame_pipe_rx_t rx;
+    void *rx_arg;
+    uint32_t dropped;
+    size_t len;
+    uint8_t buf[16 * PIPE_BUF];
+} s_pipe = {
+    .rx_fd = -1,
+    .tx_fd = -1,
+};
+
+static int open_fifo(const char *direction)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "%s.%s", CONFIG_SIM_PIPE_PATH, direction);
+    if (mkfifo(path, 0600) != 0 && errno != EEXIST) {
+        ESP_LOGE(TAG, "Cannot create %s (%s)", path, strerror(errno));
+        return -1;
+    }
+    // Read-write, so neither side waits for the other to open it, and writes never find it closed
+    int fd = open(path, O_RDWR | O_NONBLOCK);
+    if (fd < 0) {
+        ESP_LOGE(TAG, "Cannot open %s (%s)", path, strerror(errno));
+    }
+    return fd;
+}
+
+static void frame_pipe_task(void *arg)
+{
+    while (1) {
+        ssize_t n = read(s_pipe.rx_fd, s_pipe.buf + s_pipe.len, sizeof(s_pipe.buf) - s_pipe.len);
+        if (n <= 0) {
+            vTaskDelay(1);
+            continue;
+        }
+        s_pipe.len += n;
+        size_t pos = 0;
+        while (s_pipe.len - pos >= sizeof(uint16_t)) {
+            uint16_t len;
+            memcpy(&len, s_pipe.buf + pos, sizeof(len));
+            if (len > PIPE_FRAME_MAX) {
+                ESP_LOGE(TAG, "Bad frame length %u, resynchronising", len);
+                pos = s_pipe.len;
+                break;
+            }
+            if (s_pipe.len - pos - sizeof(len) < len) {
+                break;  // the rest of it is still in the FIFO
+            }
+            s_pipe.rx(s_pipe.buf + pos + sizeof(len), len, s_pipe.rx_arg);
+            pos += sizeof(len) + len;
+        }
+        memmove(s_pipe.buf, s_pipe.buf + pos, s_pipe.len - pos);
+        s_pipe.len -= pos;
+    }
+}
+
+esp_err_t frame_pipe_open(bool device, frame_pipe_rx_t rx, void *arg)
+{
+    s_pipe.rx = rx;
+    s_pipe.rx_arg = arg;
+    s_pipe.rx_fd = open_fifo(device ? "h2d" : "d2h");
+    s_pipe.tx_fd = open_fifo(device ? "d2h" : "h2d");
+    if (s_pipe.rx_fd < 0 || s_pipe.tx_fd < 0) {
+        return ESP_FAIL;
+    }
+    if (xTaskCreate(frame_pipe_task, "frame_pipe", PIPE_TASK_STACK, NULL, PIPE_TASK_PRIO, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t frame_pipe_send(const void *frame, uint16_t len)
+{
+    uint8_t record[sizeof(len) + PIPE_FRAME_MAX];
+    if (len > PIPE_FRAME_MAX) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(record, &len, sizeof(len));
+    memcpy(record + sizeof(len), frame, len);
+    if (write(s_pipe.tx_fd, record, sizeof(len) + len) != (ssize_t)(sizeof(len) + len)) {
+        if (++s_pipe.dropped % 100 == 1) {
+            ESP_LOGW(TAG, "Pipe full, %lu frames dropped", (unsigned long)s_pipe.dropped);
+        }
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
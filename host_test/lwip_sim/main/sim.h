@@ -0,0 +1,32 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sdkconfig.h"
+
+#if CONFIG_SIM_USB_SPEED_HS
+#define SIM_LINK_NAME   "hs"
+#else
+#define SIM_LINK_NAME   "fs"
+#endif
+
+/* The example's app_main(), renamed for the simulator */
+void example_app_main(void);
+
+typedef void (*frame_pipe_rx_t)(const void *frame, uint16_t len, void *arg);
+
+/* Open the frame pipe to the other process; rx is called from the pipe task with every frame that arrives */
+esp_err_t frame_pipe_open(bool device, frame_pipe_rx_t rx, void *arg);
+
+/* Send one frame to the other process, ESP_FAIL if the pipe is full and the frame was dropped */
+esp_err_t frame_pipe_send(const void *frame, uint16_t len);
+
+/* Play the USB host: bring up its netif, then run the traffic against the device; returns the failed runs */
+int sim_peer_run(void);
@@ -0,0 +1,73 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Throughput simulator for the ESP-IDF Linux target. Two processes of this build stand in for a board on a
+ * USB port: the device runs the example through its own app_main(), so its netif comes from
+ * create_virtual_net_if() with the DHCP server, the ethernetif wiring and the route priority of the device;
+ * with NCM_SIM_PEER set in the environment, the process plays the USB host instead, with a second lwIP
+ * instance (see sim_peer.c). The frames between the two cross the frame pipe and are paced by the simulated
+ * USB link on the device side, at the speed and with the NTB count the simulator is built with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_mac.h"
+#include "usb_shim.h"
+#include "sim.h"
+
+static const char *TAG = "SIM";
+
+static const uint8_t s_base_mac[6] = { 0x02, 0x00, 0x00, 0x12, 0x34, 0x56 };
+
+/* The Linux target has no eFuse MAC, the device gets a locally administered one */
+esp_err_t esp_base_mac_addr_get(uint8_t *mac)
+{
+    memcpy(mac, s_base_mac, sizeof(s_base_mac));
+    return ESP_OK;
+}
+
+esp_err_t esp_read_mac(uint8_t *mac, esp_mac_type_t type)
+{
+    memcpy(mac, s_base_mac, sizeof(s_base_mac));
+    mac[5] += type;
+    return ESP_OK;
+}
+
+static void usb_to_pipe(const void *frame, uint16_t len, void *arg)
+{
+    frame_pipe_send(frame, len);
+}
+
+static void pipe_to_usb(const void *frame, uint16_t len, void *arg)
+{
+    // Refused frames are lost as on the device, TCP recovers them
+    usb_shim_ncm_receive(frame, len);
+}
+
+void app_main(void)
+{
+    if (getenv("NCM_SIM_PEER")) {
+        int failed = sim_peer_run();
+        fflush(stdout);
+        exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+#if CONFIG_SIM_USB_SPEED_HS
+    usb_shim_link_t link = USB_SHIM_LINK_HS;
+#else
+    usb_shim_link_t link = USB_SHIM_LINK_FS;
+#endif
+    link.in_ntb_n = CFG_TUD_NCM_IN_NTB_N;
+    ESP_ERROR_CHECK(usb_shim_set_link(&link));
+    usb_shim_set_ncm_sink(usb_to_pipe, NULL);
+    ESP_ERROR_CHECK(frame_pipe_open(true, pipe_to_usb, NULL));
+    ESP_LOGI(TAG, "Device on a USB %s link with %d IN NTBs", SIM_LINK_NAME, CFG_TUD_NCM_IN_NTB_N);
+
+    example_app_main();
+}
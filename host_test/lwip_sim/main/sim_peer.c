@@ -0,0 +1,421 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * USB host side of the simulator, with an lwIP instance of its own. Its netif is an Ethernet netif with a DHCP
+ * client, like the one a PC brings up for an NCM device, and its frames cross the frame pipe. Once the device
+ * has given it a lease, it runs the traffic one kind after the other against the example's throughput
+ * endpoints and web server, and prints each result as a JSON line prefixed with "SIM":
+ *
+ *     dhcp        time from link up to the lease
+ *     tcp_up      TCP to the throughput sink, host -> device
+ *     tcp_down    TCP from the throughput source, device -> host
+ *     udp_up      iperf2 style UDP at CONFIG_SIM_UDP_RATE_KBPS, with the loss the device counted
+ *     http        fetches of a web UI page and of an API endpoint, each on a new connection
+ *
+ * Failures are printed as "SIM error" lines, and the run ends with "SIM done".
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "lwip/esp_netif_net_stack.h"
+#include "sim.h"
+
+static const char *TAG = "SIM_PEER";
+
+#define DEVICE_IP           "192.168.4.1"
+#define SINK_PORT           CONFIG_EXAMPLE_PERF_SERVER_PORT
+#define SOURCE_PORT         (CONFIG_EXAMPLE_PERF_SERVER_PORT + 1)
+#define HTTP_PORT           80
+#define RUN_US              (CONFIG_SIM_RUN_SECONDS * 1000000LL)
+#define LEASE_TIMEOUT_MS    10000
+#define IO_TIMEOUT_MS       2000
+#define TCP_CHUNK           (4 * 1460)
+#define UDP_PAYLOAD         1470
+#define UDP_FIN_REPEATS     10
+#define HTTP_RESP_MAX       32768
+#define HTTP_CHUNKED_END    "\r\n0\r\n\r\n"
+#define NS_PER_TICK         ((int64_t)portTICK_PERIOD_MS * 1000000)
+
+static int s_failed;
+
+static void report(const char *name, const char *fmt, ...)
+{
+    va_list args;
+    printf("SIM {\"case\":\"%s\",\"link\":\"%s\",\"in_ntb\":%d,", name, SIM_LINK_NAME, CFG_TUD_NCM_IN_NTB_N);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("}\n");
+}
+
+static void fail(const char *name, const char *fmt, ...)
+{
+    va_list args;
+    printf("SIM error %s: ", name);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    s_failed++;
+}
+
+static esp_err_t peer_transmit(void *h, void *buffer, size_t len)
+{
+    // A frame dropped on a full pipe is lost on the wire as far as lwIP can tell
+    frame_pipe_send(buffer, len);
+    return ESP_OK;
+}
+
+static void peer_free_rx(void *h, void *buffer)
+{
+    free(buffer);
+}
+
+static void pipe_to_netif(const void *frame, uint16_t len, void *arg)
+{
+    // lwIP holds on to the frame until peer_free_rx(), the pipe reuses its buffer right away
+    void *copy = malloc(len);
+    if (copy) {
+        memcpy(copy, frame, len);
+        esp_netif_receive(arg, copy, len, NULL);
+    }
+}
+
+static esp_netif_t *peer_netif_start(void)
+{
+    esp_netif_inherent_config_t base_cfg = ESP_NETIF_INHERENT_DEFAULT_ETH();
+    base_cfg.if_key = "usb_host";
+    base_cfg.if_desc = "simulated USB host";
+    esp_netif_driver_ifconfig_t driver_cfg = {
+        .handle = (void *)1,
+        .transmit = peer_transmit,
+        .driver_free_rx_buffer = peer_free_rx,
+    };
+    struct esp_netif_netstack_config stack_cfg = {
+        .lwip = {
+            .init_fn = ethernetif_init,
+            .input_fn = ethernetif_input,
+        }
+    };
+    esp_netif_config_t cfg = {
+        .base = &base_cfg,
+        .driver = &driver_cfg,
+        .stack = &stack_cfg,
+    };
+    esp_netif_t *netif = esp_netif_new(&cfg);
+    if (!netif) {
+        return NULL;
+    }
+    uint8_t mac[6] = { 0x02, 0x00, 0x00, 0x4e, 0x43, 0x4d };
+    esp_netif_set_mac(netif, mac);
+    if (frame_pipe_open(false, pipe_to_netif, netif) != ESP_OK) {
+        return NULL;
+    }
+    // The cable is in: bring the interface up and start the DHCP client
+    esp_netif_action_start(netif, 0, 0, NULL);
+    esp_netif_action_connected(netif, 0, 0, NULL);
+    return netif;
+}
+
+static bool wait_for_lease(esp_netif_t *netif)
+{
+    int64_t start = esp_timer_get_time();
+    esp_netif_ip_info_t ip_info;
+    while (esp_timer_get_time() - start < LEASE_TIMEOUT_MS * 1000LL) {
+        if (esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.ip.addr) {
+            report("dhcp", "\"ms\":%.1f,\"ip\":\"" IPSTR "\"", (esp_timer_get_time() - start) / 1e3,
+                   IP2STR(&ip_info.ip));
+            return true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    fail("dhcp", "no lease from the device in %d ms", LEASE_TIMEOUT_MS);
+    return false;
+}
+
+static int connect_to_device(int type, uint16_t port)
+{
+    int fd = socket(AF_INET, type, type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+    if (fd < 0) {
+        return -1;
+    }
+    struct timeval timeout = {
+        .tv_sec = IO_TIMEOUT_MS / 1000,
+        .tv_usec = (IO_TIMEOUT_MS % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr(DEVICE_IP),
+    };
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * GET uri on a new connection. The start of the response, headers included, is kept in resp and the total
+ * size goes to *total. Returns the HTTP status, or -1 if the response did not arrive in full.
+ */
+static int http_get(const char *uri, char *resp, size_t resp_size, size_t *total)
+{
+    int fd = connect_to_device(SOCK_STREAM, HTTP_PORT);
+    if (fd < 0) {
+        return -1;
+    }
+    int n = snprintf(resp, resp_size, "GET %s HTTP/1.1\r\nHost: " DEVICE_IP "\r\n\r\n", uri);
+    if (send(fd, resp, n, 0) != n) {
+        close(fd);
+        return -1;
+    }
+
+    char chunk[1460];
+    char tail[sizeof(HTTP_CHUNKED_END) - 1] = { 0 };
+    size_t len = 0;
+    size_t header_len = 0;
+    size_t body_len = SIZE_MAX;     // unknown until the headers are in, then SIZE_MAX for chunked
+    int status = -1;
+    resp[0] = '\0';
+    while (1) {
+        int r = recv(fd, chunk, sizeof(chunk), 0);
+        if (r <= 0) {
+            status = -1;    // the server keeps the connection open, so an end here is a failure
+            break;
+        }
+        size_t kept = MIN(len, resp_size - 1);
+        memcpy(resp + kept, chunk, MIN((size_t)r, resp_size - 1 - kept));
+        resp[MIN(len + r, resp_size - 1)] = '\0';
+        len += r;
+        if ((size_t)r >= sizeof(tail)) {
+            memcpy(tail, chunk + r - sizeof(tail), sizeof(tail));
+        } else {
+            memmove(tail, tail + r, sizeof(tail) - r);
+            memcpy(tail + sizeof(tail) - r, chunk, r);
+        }
+
+        if (!header_len) {
+            char *end = strstr(resp, "\r\n\r\n");
+            if (!end) {
+                continue;
+            }
+            header_len = end + 4 - resp;
+            if (sscanf(resp, "HTTP/1.%*d %d", &status) != 1) {
+                break;
+            }
+            const char *length = strstr(resp, "Content-Length: ");
+            if (length && length < end) {
+                body_len = strtoul(length + strlen("Content-Length: "), NULL, 10);
+            }
+        }
+        if (body_len != SIZE_MAX ? len - header_len >= body_len :
+                memcmp(tail, HTTP_CHUNKED_END, sizeof(tail)) == 0) {
+            break;
+        }
+    }
+    close(fd);
+    *total = len;
+    return status;
+}
+
+static uint64_t metric_value(const char *metrics, const char *name)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\nespnetkit_%s ", name);
+    const char *line = strstr(metrics, key);
+    return line ? strtoull(line + strlen(key), NULL, 10) : 0;
+}
+
+/* The throughput counters the device exports on /api/v1/metrics */
+static bool read_perf_counters(uint64_t *rx_bytes, uint64_t *udp_lost)
+{
+    static char resp[HTTP_RESP_MAX];
+    size_t len;
+    if (http_get("/api/v1/metrics", resp, sizeof(resp), &len) != 200) {
+        return false;
+    }
+    *rx_bytes = metric_value(resp, "perf_rx_bytes_total");
+    *udp_lost = metric_value(resp, "perf_udp_lost_total");
+    return true;
+}
+
+static void run_tcp_up(void)
+{
+    static uint8_t buf[TCP_CHUNK];
+    memset(buf, 'u', sizeof(buf));
+    int fd = connect_to_device(SOCK_STREAM, SINK_PORT);
+    if (fd < 0) {
+        fail("tcp_up", "cannot connect to port %d", SINK_PORT);
+        return;
+    }
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    while (esp_timer_get_time() - start < RUN_US) {
+        int n = send(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        bytes += n;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    close(fd);
+    if (elapsed < RUN_US) {
+        fail("tcp_up", "send failed after %llu bytes", (unsigned long long)bytes);
+        return;
+    }
+    report("tcp_up", "\"seconds\":%.2f,\"bytes\":%llu,\"mbit_s\":%.2f", elapsed / 1e6, (unsigned long long)bytes,
+           bytes * 8.0 / elapsed);
+}
+
+static void run_tcp_down(void)
+{
+    static uint8_t buf[TCP_CHUNK];
+    int fd = connect_to_device(SOCK_STREAM, SOURCE_PORT);
+    if (fd < 0) {
+        fail("tcp_down", "cannot connect to port %d", SOURCE_PORT);
+        return;
+    }
+    uint64_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    while (esp_timer_get_time() - start < RUN_US) {
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            break;
+        }
+        bytes += n;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    close(fd);
+    if (elapsed < RUN_US) {
+        fail("tcp_down", "receive failed after %llu bytes", (unsigned long long)bytes);
+        return;
+    }
+    report("tcp_down", "\"seconds\":%.2f,\"bytes\":%llu,\"mbit_s\":%.2f", elapsed / 1e6, (unsigned long long)bytes,
+           bytes * 8.0 / elapsed);
+}
+
+static void put_udp_header(uint8_t *buf, int32_t id, int64_t now_us)
+{
+    // iperf2 datagram header: id, then the send time, all in network order
+    uint32_t hdr[3] = { htonl(id), htonl(now_us / 1000000), htonl(now_us % 1000000) };
+    memcpy(buf, hdr, sizeof(hdr));
+}
+
+static void run_udp_up(void)
+{
+    static uint8_t buf[UDP_PAYLOAD];
+    uint64_t rx_before, lost_before, rx_after, lost_after;
+    if (!read_perf_counters(&rx_before, &lost_before)) {
+        fail("udp_up", "cannot read the device counters");
+        return;
+    }
+    int fd = connect_to_device(SOCK_DGRAM, SINK_PORT);
+    if (fd < 0) {
+        fail("udp_up", "cannot open a UDP socket");
+        return;
+    }
+    memset(buf, 'd', sizeof(buf));
+    const int64_t interval_ns = UDP_PAYLOAD * 8 * 1000000LL / CONFIG_SIM_UDP_RATE_KBPS;
+    int32_t id = 0;
+    uint32_t send_errors = 0;
+    int64_t next_ns = 0;
+    int64_t start = esp_timer_get_time();
+    while (1) {
+        int64_t now_ns = (esp_timer_get_time() - start) * 1000;
+        if (now_ns >= RUN_US * 1000) {
+            break;
+        }
+        if (next_ns - now_ns >= NS_PER_TICK) {
+            vTaskDelay((next_ns - now_ns) / NS_PER_TICK);
+            continue;
+        }
+        put_udp_header(buf, id++, esp_timer_get_time());
+        if (send(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+            send_errors++;  // out of lwIP buffers, the device counts the gap as lost
+        }
+        next_ns += interval_ns;
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    // iperf2 ends the stream with the negated id, and repeats it until the server answers
+    for (int i = 0; i < UDP_FIN_REPEATS; i++) {
+        put_udp_header(buf, -id, esp_timer_get_time());
+        send(fd, buf, sizeof(buf), 0);
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    close(fd);
+
+    if (!read_perf_counters(&rx_after, &lost_after)) {
+        fail("udp_up", "cannot read the device counters");
+        return;
+    }
+    uint64_t received = rx_after - rx_before;
+    report("udp_up", "\"seconds\":%.2f,\"offered_kbps\":%d,\"sent\":%ld,\"send_errors\":%lu,\"lost\":%llu,"
+           "\"mbit_s\":%.2f", elapsed / 1e6, CONFIG_SIM_UDP_RATE_KBPS, (long)id, (unsigned long)send_errors,
+           (unsigned long long)(lost_after - lost_before), received * 8.0 / elapsed);
+}
+
+static void run_http(const char *uri)
+{
+    static char resp[HTTP_RESP_MAX];
+    uint64_t bytes = 0;
+    int64_t total_us = 0;
+    int64_t max_us = 0;
+    int status = -1;
+    for (int i = 0; i < CONFIG_SIM_HTTP_FETCHES; i++) {
+        size_t len;
+        int64_t start = esp_timer_get_time();
+        status = http_get(uri, resp, sizeof(resp), &len);
+        int64_t us = esp_timer_get_time() - start;
+        if (status < 0) {
+            fail("http", "%s: no complete response to fetch %d", uri, i);
+            return;
+        }
+        if (status != 200) {
+            fail("http", "%s: fetch %d answered with status %d", uri, i, status);
+            return;
+        }
+        bytes += len;
+        total_us += us;
+        max_us = MAX(max_us, us);
+    }
+    report("http", "\"uri\":\"%s\",\"status\":%d,\"fetches\":%d,\"bytes\":%llu,\"avg_ms\":%.2f,\"max_ms\":%.2f",
+           uri, status, CONFIG_SIM_HTTP_FETCHES, (unsigned long long)bytes,
+           total_us / 1e3 / CONFIG_SIM_HTTP_FETCHES, max_us / 1e3);
+}
+
+int sim_peer_run(void)
+{
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    esp_netif_t *netif = peer_netif_start();
+    if (!netif) {
+        fail("setup", "cannot bring up the host netif");
+    } else if (wait_for_lease(netif)) {
+        ESP_LOGI(TAG, "Running %d s throughput runs on a USB %s link", CONFIG_SIM_RUN_SECONDS, SIM_LINK_NAME);
+        run_tcp_up();
+        run_tcp_down();
+        run_udp_up();
+        run_http("/");
+        run_http("/api/v1/system/info");
+    }
+    printf("SIM done\n");
+    return s_failed;
+}
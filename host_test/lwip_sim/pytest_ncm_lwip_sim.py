@@ -0,0 +1,37 @@
+# SPDX-FileCopyrightText: 2022-2024 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: CC0-1.0
+import json
+import os
+import subprocess
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+def test_ncm_lwip_sim(dut: Dut) -> None:
+    # The DUT is the device, a second process of the same build plays the USB host
+    dut.expect_exact('Throughput sink on TCP/UDP port', timeout=30)
+    env = dict(os.environ, NCM_SIM_PEER='1')
+    peer = subprocess.run([dut.app.elf_file], env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          timeout=300, check=False)
+    output = peer.stdout.decode('utf-8', errors='replace')
+    with open(os.path.join(dut.logdir, 'peer.log'), 'w') as f:
+        f.write(output)
+
+    results = []
+    errors = []
+    for line in output.splitlines():
+        if line.startswith('SIM {'):
+            results.append(json.loads(line[len('SIM '):]))
+        elif line.startswith('SIM error '):
+            errors.append(line[len('SIM error '):])
+    with open(os.path.join(dut.logdir, 'simulation.json'), 'w') as f:
+        json.dump({'target': 'linux', 'results': results}, f, indent=2)
+    for r in results:
+        print(json.dumps(r))
+    if errors or 'SIM done' not in output:
+        raise AssertionError('Simulation failed:\n' + '\n'.join(errors))
+    if peer.returncode != 0:
+        raise AssertionError('Peer exited with {}'.format(peer.returncode))
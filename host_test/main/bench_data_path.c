@@ -0,0 +1,264 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Data path microbenchmarks of the host build. The example runs unchanged on the TinyUSB, esp_netif and
+ * esp_http_server stand-ins, and each case plays the USB host or lwIP on one path:
+ *
+ *     ncm_rx      OUT frame -> tinyusb_netif_recv_cb() -> esp_netif_receive() -> ethernetif_input()
+ *     ncm_tx      transmit_wrap -> TX queue -> TX task -> tinyusb_net_send_sync()
+ *     cdc_ring    one chunk written to the CDC-ACM RX ring and drained again
+ *     cdc_echo    CDC-ACM RX callback -> RX ring -> handler task -> write back to the host
+ *     <uri>       one request through its handler, without sockets
+ *
+ * Results use the case harness of the on-device benchmark.c (bench_common.h), one "BENCH {...}" line per
+ * case, and cdc_ring is the shared case itself. Allocations are counted by
+ * wrapping malloc(), calloc() and realloc() at link time and cover every task during a case. ncm_tx and
+ * cdc_echo include the FreeRTOS task switches of the Linux simulator, so only compare them between runs of
+ * this build. Each case checks that everything it sent came out the other end and reports a failure as
+ * "BENCH error ...".
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_netif_net_stack.h"
+#include "tusb_cdc_acm.h"
+#include "byte_ring.h"
+#include "bench_common.h"
+#include "tusb_ncm_demo.h"
+#include "usb_shim.h"
+#include "netif_shim.h"
+#include "httpd_shim.h"
+#include "host_test.h"
+
+static const char *TAG = "BENCH";
+
+#define BENCH_FRAME_ITERATIONS  20000
+#define BENCH_TX_ITERATIONS     5000
+#define BENCH_ECHO_ITERATIONS   2000
+#define BENCH_API_ITERATIONS    1000
+#define BENCH_RING_SIZE         4096
+#define BENCH_RESP_BUFSIZE      4096
+#define BENCH_WAIT_TICKS        pdMS_TO_TICKS(5000)
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    bench_count_alloc();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    bench_count_alloc();
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    bench_count_alloc();
+    return __real_realloc(ptr, size);
+}
+
+/* Everything the example sends to the host ends up here */
+static struct {
+    SemaphoreHandle_t done;
+    _Atomic uint64_t ncm_frames;
+    _Atomic uint64_t ncm_target;
+    _Atomic uint64_t cdc_bytes;
+    _Atomic uint64_t cdc_target;
+} s_host;
+
+static void reached(_Atomic uint64_t *target, uint64_t value)
+{
+    uint64_t expected = atomic_load(target);
+    if (value >= expected && atomic_compare_exchange_strong(target, &expected, UINT64_MAX)) {
+        xSemaphoreGive(s_host.done);
+    }
+}
+
+static void ncm_sink(const void *frame, uint16_t len, void *arg)
+{
+    reached(&s_host.ncm_target, atomic_fetch_add(&s_host.ncm_frames, 1) + 1);
+}
+
+static void cdc_sink(int itf, const uint8_t *data, size_t len, void *arg)
+{
+    reached(&s_host.cdc_target, atomic_fetch_add(&s_host.cdc_bytes, len) + len);
+}
+
+static void bench_ncm_rx(const uint8_t *frame, size_t len)
+{
+    netif_shim_stats_t before, after;
+    uint32_t refused = 0;
+    bench_case_t c;
+
+    netif_shim_get_stats(&before);
+    bench_case_begin(&c, "ncm_rx", len, BENCH_FRAME_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_FRAME_ITERATIONS; i++) {
+        if (usb_shim_ncm_receive(frame, len) != ESP_OK) {
+            refused++;
+        }
+    }
+    bench_case_stop(&c);
+    netif_shim_get_stats(&after);
+
+    uint32_t delivered = after.rx_frames - before.rx_frames;
+    uint32_t freed = after.rx_freed - before.rx_freed;
+    bench_case_check(&c, !refused && delivered == BENCH_FRAME_ITERATIONS && freed == delivered,
+                     "%lu refused, %lu delivered, %lu given back to the pool", (unsigned long)refused,
+                     (unsigned long)delivered, (unsigned long)freed);
+    bench_case_end(&c);
+}
+
+static void bench_ncm_tx(esp_netif_t *netif, const uint8_t *frame, size_t len)
+{
+    netif_shim_stats_t before, after;
+    uint32_t failed = 0;
+    uint32_t retries = 0;
+    bench_case_t c;
+
+    void *buf = netif_shim_buf_alloc(frame, len);
+    netif_shim_get_stats(&before);
+    atomic_store(&s_host.ncm_target, atomic_load(&s_host.ncm_frames) + BENCH_TX_ITERATIONS);
+    bench_case_begin(&c, "ncm_tx", len, BENCH_TX_ITERATIONS);
+    if (!bench_case_check(&c, buf != NULL, "no memory for a TX buffer")) {
+        return;
+    }
+    for (uint32_t i = 0; i < BENCH_TX_ITERATIONS; i++) {
+        esp_err_t err;
+        // A full queue is ERR_MEM for lwIP, which retries later; do the same
+        while ((err = netif_shim_output(netif, buf, len)) == ESP_ERR_NO_MEM) {
+            retries++;
+            vTaskDelay(1);
+        }
+        if (err != ESP_OK) {
+            failed++;
+        }
+    }
+    bool sent = !failed && xSemaphoreTake(s_host.done, BENCH_WAIT_TICKS) == pdTRUE;
+    bench_case_stop(&c);
+    atomic_store(&s_host.ncm_target, UINT64_MAX);
+    esp_netif_netstack_buf_free(buf);
+    // The sink sees the last frame just before the USB side lets go of its reference
+    TickType_t start = xTaskGetTickCount();
+    netif_shim_get_stats(&after);
+    while (after.bufs_live != before.bufs_live - 1 && xTaskGetTickCount() - start < BENCH_WAIT_TICKS) {
+        vTaskDelay(1);
+        netif_shim_get_stats(&after);
+    }
+
+    bench_case_check(&c, sent, "%lu frames refused, not all frames reached the host", (unsigned long)failed);
+    bench_case_check(&c, after.bufs_live == before.bufs_live - 1, "%ld netstack buffer references leaked",
+                     (long)(after.bufs_live - before.bufs_live + 1));
+    bench_case_end(&c);
+    if (retries) {
+        ESP_LOGI(TAG, "ncm_tx/%u: the TX queue was full %lu times", (unsigned)len, (unsigned long)retries);
+    }
+}
+
+static void bench_cdc_echo(const uint8_t *data, size_t len)
+{
+    bench_case_t c;
+    bench_case_begin(&c, "cdc_echo", len, BENCH_ECHO_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_ECHO_ITERATIONS; i++) {
+        // One chunk in flight at a time: the case is the round trip, not how much the ring can buffer
+        atomic_store(&s_host.cdc_target, atomic_load(&s_host.cdc_bytes) + len);
+        size_t accepted = usb_shim_cdc_receive(TINYUSB_CDC_ACM_0, data, len);
+        if (accepted != len || xSemaphoreTake(s_host.done, BENCH_WAIT_TICKS) != pdTRUE) {
+            atomic_store(&s_host.cdc_target, UINT64_MAX);
+            bench_case_check(&c, false, "chunk %lu: %u bytes accepted, echo incomplete", (unsigned long)i,
+                             (unsigned)accepted);
+            return;
+        }
+    }
+    bench_case_end(&c);
+}
+
+static void bench_api(httpd_method_t method, const char *uri, const char *body)
+{
+    size_t body_len = body ? strlen(body) : 0;
+    httpd_shim_response_t resp = {
+        .body = malloc(BENCH_RESP_BUFSIZE),
+        .body_size = BENCH_RESP_BUFSIZE,
+    };
+    bench_case_t c;
+    bench_case_begin(&c, uri, body_len, BENCH_API_ITERATIONS);
+    if (!bench_case_check(&c, resp.body != NULL, "no memory for the response")) {
+        return;
+    }
+    for (uint32_t i = 0; i < BENCH_API_ITERATIONS; i++) {
+        if (httpd_shim_request(method, uri, body, body_len, &resp) != ESP_OK || resp.status != 200 ||
+                resp.handler_ret != ESP_OK) {
+            bench_case_check(&c, false, "request %lu: status %d, handler returned %s", (unsigned long)i,
+                             resp.status, esp_err_to_name(resp.handler_ret));
+            goto out;
+        }
+    }
+    bench_case_end(&c);
+
+out:
+    free(resp.body);
+}
+
+void bench_data_path_run(void)
+{
+    static const size_t frame_sizes[] = { 64, 512, 1514 };
+    static const size_t chunk_sizes[] = { 16, 64, 512 };
+
+    esp_netif_t *netif = netif_shim_find("wired");
+    uint8_t *data = malloc(1514);
+    uint8_t *ring_storage = malloc(BENCH_RING_SIZE);
+    s_host.done = xSemaphoreCreateBinary();
+    bench_case_t setup;
+    bench_case_begin(&setup, "setup", 0, 1);
+    if (!bench_case_check(&setup, netif && data && ring_storage && s_host.done,
+                          "the example did not come up, or no memory for the benchmarks")) {
+        goto out;
+    }
+    for (int i = 0; i < 1514; i++) {
+        data[i] = i;
+    }
+    atomic_store(&s_host.ncm_target, UINT64_MAX);
+    atomic_store(&s_host.cdc_target, UINT64_MAX);
+    usb_shim_set_ncm_sink(ncm_sink, NULL);
+    usb_shim_set_cdc_sink(cdc_sink, NULL);
+    ESP_LOGI(TAG, "Running microbenchmarks");
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+        bench_ncm_rx(data, frame_sizes[i]);
+        bench_ncm_tx(netif, data, frame_sizes[i]);
+    }
+    byte_ring_t ring;
+    byte_ring_init(&ring, ring_storage, BENCH_RING_SIZE);
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+        bench_cdc_ring(&ring, data, chunk_sizes[i]);
+        bench_cdc_echo(data, chunk_sizes[i]);
+    }
+    bench_api(HTTP_GET, "/api/v1/system/info", NULL);
+    bench_api(HTTP_GET, "/api/v1/temp/raw", NULL);
+    bench_api(HTTP_GET, "/api/v1/metrics", NULL);
+    bench_api(HTTP_GET, "/api/v1/cdc", NULL);
+    bench_api(HTTP_POST, "/api/v1/light/brightness", "{\"red\":255,\"green\":128,\"blue\":0}");
+    bench_api(HTTP_POST, "/api/v1/batch", "[{\"op\":\"light.set\",\"args\":{\"red\":1,\"green\":2,\"blue\":3}},"
+              "{\"op\":\"light.get\"},{\"op\":\"system.info\"},{\"op\":\"temp.read\"}]");
+
+out:
+    usb_shim_set_ncm_sink(NULL, NULL);
+    usb_shim_set_cdc_sink(NULL, NULL);
+    free(ring_storage);
+    free(data);
+}
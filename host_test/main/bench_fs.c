@@ -0,0 +1,481 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Web asset store benchmarks of the host build: the open, write and read cases of bench_common.c on SPIFFS
+ * and on LittleFS, and the per-request work of a static file on every store, in the same run. On the Linux
+ * target esp_partition emulates the flash with a file, so each store sits on a partition of partitions.csv as
+ * on the device, the filesystems formatted on first use:
+ *
+ *     spiffs          the spiffs component through its esp_partition glue (spiffs_api.c), as esp_spiffs.c
+ *                     mounts it
+ *     littlefs        the littlefs core of esp_littlefs with a block device on esp_partition
+ *     flash_image     www_image.c on the www partition, holding the image CMakeLists.txt packs from
+ *                     front/web-demo/public with tools/www_prepare.py
+ *
+ * <store>_asset serves index.html of the image as the matching send_*_asset() of resetful_server.c does: an
+ * open, reads in EXAMPLE_HTTPD_SEND_CHUNK_SIZE chunks and a close on a filesystem, a lookup on the image whose
+ * bytes are sent in place. static_get then fetches it through rest_common_get_handler from the store this
+ * build serves, as the on-device case of the same name does. The emulated flash costs no time, so the numbers
+ * show the stores' own work per request: compare them with each other and between runs of this build, the
+ * on-device benchmark adds the flash itself.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "spiffs.h"
+#include "spiffs_nucleus.h"
+#include "spiffs_api.h"
+#include "lfs.h"
+#include "httpd_shim.h"
+#include "bench_common.h"
+#include "tusb_ncm_demo.h"
+#include "host_test.h"
+
+static const char *TAG = "BENCH";
+
+#define BENCH_FS_SECTOR         4096
+#define BENCH_FS_MAX_FILES      2
+#define BENCH_FS_ASSET          "/index.html"
+#define BENCH_FS_SCRATCH        "/bench.tmp"
+#define BENCH_FS_WWW            "www"
+#define BENCH_FS_CHUNK          CONFIG_EXAMPLE_HTTPD_SEND_CHUNK_SIZE
+#define BENCH_ASSET_ITERATIONS  200
+#define BENCH_GET_HEAD_MAX      1024
+
+extern const uint8_t www_bin_start[] asm("_binary_www_bin_start");
+extern const uint8_t www_bin_end[] asm("_binary_www_bin_end");
+
+/* What esp_spiffs.c sets up for a mount, with the buffers in place */
+static struct {
+    spiffs fs;
+    spiffs_config cfg;
+    esp_spiffs_t efs;
+    uint8_t work[2 * CONFIG_SPIFFS_PAGE_SIZE];
+    uint8_t fds[BENCH_FS_MAX_FILES * sizeof(spiffs_fd)];
+#if CONFIG_SPIFFS_CACHE
+    uint8_t cache[sizeof(spiffs_cache) + BENCH_FS_MAX_FILES * (sizeof(spiffs_cache_page) + CONFIG_SPIFFS_PAGE_SIZE)];
+#endif
+} s_spiffs;
+
+static esp_err_t spiffs_bench_mount(const esp_partition_t *part)
+{
+    s_spiffs.efs.fs = &s_spiffs.fs;
+    s_spiffs.efs.partition = part;
+    s_spiffs.efs.lock = xSemaphoreCreateMutex();
+    s_spiffs.fs.user_data = &s_spiffs.efs;
+    if (!s_spiffs.efs.lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    s_spiffs.cfg = (spiffs_config) {
+        .hal_read_f = spiffs_api_read,
+        .hal_write_f = spiffs_api_write,
+        .hal_erase_f = spiffs_api_erase,
+        .phys_size = part->size,
+        .phys_addr = 0,
+        .phys_erase_block = BENCH_FS_SECTOR,
+        .log_block_size = BENCH_FS_SECTOR,
+        .log_page_size = CONFIG_SPIFFS_PAGE_SIZE,
+    };
+#if CONFIG_SPIFFS_CACHE
+    void *cache = s_spiffs.cache;
+    uint32_t cache_size = sizeof(s_spiffs.cache);
+#else
+    void *cache = NULL;
+    uint32_t cache_size = 0;
+#endif
+
+    s32_t res = SPIFFS_mount(&s_spiffs.fs, &s_spiffs.cfg, s_spiffs.work, s_spiffs.fds, sizeof(s_spiffs.fds),
+                             cache, cache_size, spiffs_api_check);
+    if (res == SPIFFS_ERR_NOT_A_FS || res == SPIFFS_ERR_MAGIC_NOT_FOUND) {
+        // The emulated flash starts erased, format it like format_if_mount_failed does
+        SPIFFS_unmount(&s_spiffs.fs);
+        res = SPIFFS_format(&s_spiffs.fs);
+        if (res == SPIFFS_OK) {
+            res = SPIFFS_mount(&s_spiffs.fs, &s_spiffs.cfg, s_spiffs.work, s_spiffs.fds, sizeof(s_spiffs.fds),
+                               cache, cache_size, spiffs_api_check);
+        }
+    }
+    if (res != SPIFFS_OK) {
+        ESP_LOGE(TAG, "SPIFFS mount failed (%d)", (int)res);
+        vSemaphoreDelete(s_spiffs.efs.lock);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void spiffs_bench_unmount(void)
+{
+    SPIFFS_unmount(&s_spiffs.fs);
+    vSemaphoreDelete(s_spiffs.efs.lock);
+}
+
+static int spiffs_bench_open(void *ctx, const char *path, bool write)
+{
+    spiffs_flags flags = write ? SPIFFS_O_WRONLY | SPIFFS_O_CREAT | SPIFFS_O_TRUNC : SPIFFS_O_RDONLY;
+    return SPIFFS_open(&s_spiffs.fs, path, flags, 0);
+}
+
+static int spiffs_bench_read(void *ctx, int fd, void *buf, size_t len)
+{
+    s32_t n = SPIFFS_read(&s_spiffs.fs, fd, buf, len);
+    return n == SPIFFS_ERR_END_OF_OBJECT ? 0 : n;
+}
+
+static int spiffs_bench_write(void *ctx, int fd, const void *buf, size_t len)
+{
+    return SPIFFS_write(&s_spiffs.fs, fd, (void *)buf, len);
+}
+
+static void spiffs_bench_close(void *ctx, int fd)
+{
+    SPIFFS_close(&s_spiffs.fs, fd);
+}
+
+static void spiffs_bench_remove(void *ctx, const char *path)
+{
+    SPIFFS_remove(&s_spiffs.fs, path);
+}
+
+static const bench_fs_t s_spiffs_ops = {
+    .name = "spiffs",
+    .open = spiffs_bench_open,
+    .read = spiffs_bench_read,
+    .write = spiffs_bench_write,
+    .close = spiffs_bench_close,
+    .remove = spiffs_bench_remove,
+};
+
+/* LittleFS with the geometry and cache sizes esp_littlefs uses by default */
+static struct {
+    lfs_t lfs;
+    struct lfs_config cfg;
+    lfs_file_t files[BENCH_FS_MAX_FILES];
+    bool open[BENCH_FS_MAX_FILES];
+} s_lfs;
+
+static int lfs_part_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer,
+                         lfs_size_t size)
+{
+    esp_err_t err = esp_partition_read(c->context, block * c->block_size + off, buffer, size);
+    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_part_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer,
+                         lfs_size_t size)
+{
+    esp_err_t err = esp_partition_write(c->context, block * c->block_size + off, buffer, size);
+    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_part_erase(const struct lfs_config *c, lfs_block_t block)
+{
+    esp_err_t err = esp_partition_erase_range(c->context, block * c->block_size, c->block_size);
+    return err == ESP_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_part_sync(const struct lfs_config *c)
+{
+    return LFS_ERR_OK;
+}
+
+static esp_err_t lfs_bench_mount(const esp_partition_t *part)
+{
+    s_lfs.cfg = (struct lfs_config) {
+        .context = (void *)part,
+        .read = lfs_part_read,
+        .prog = lfs_part_prog,
+        .erase = lfs_part_erase,
+        .sync = lfs_part_sync,
+        .read_size = 128,
+        .prog_size = 128,
+        .block_size = BENCH_FS_SECTOR,
+        .block_count = part->size / BENCH_FS_SECTOR,
+        .block_cycles = 512,
+        .cache_size = 512,
+        .lookahead_size = 128,
+    };
+    int res = lfs_mount(&s_lfs.lfs, &s_lfs.cfg);
+    if (res != LFS_ERR_OK) {
+        // The emulated flash starts erased, format it like format_if_mount_failed does
+        res = lfs_format(&s_lfs.lfs, &s_lfs.cfg);
+        if (res == LFS_ERR_OK) {
+            res = lfs_mount(&s_lfs.lfs, &s_lfs.cfg);
+        }
+    }
+    if (res != LFS_ERR_OK) {
+        ESP_LOGE(TAG, "LittleFS mount failed (%d)", res);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void lfs_bench_unmount(void)
+{
+    lfs_unmount(&s_lfs.lfs);
+}
+
+static int lfs_bench_open(void *ctx, const char *path, bool write)
+{
+    int fd = 0;
+    while (fd < BENCH_FS_MAX_FILES && s_lfs.open[fd]) {
+        fd++;
+    }
+    if (fd == BENCH_FS_MAX_FILES) {
+        return -1;
+    }
+    int flags = write ? LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC : LFS_O_RDONLY;
+    if (lfs_file_open(&s_lfs.lfs, &s_lfs.files[fd], path, flags) != LFS_ERR_OK) {
+        return -1;
+    }
+    s_lfs.open[fd] = true;
+    return fd;
+}
+
+static int lfs_bench_read(void *ctx, int fd, void *buf, size_t len)
+{
+    return lfs_file_read(&s_lfs.lfs, &s_lfs.files[fd], buf, len);
+}
+
+static int lfs_bench_write(void *ctx, int fd, const void *buf, size_t len)
+{
+    return lfs_file_write(&s_lfs.lfs, &s_lfs.files[fd], buf, len);
+}
+
+static void lfs_bench_close(void *ctx, int fd)
+{
+    lfs_file_close(&s_lfs.lfs, &s_lfs.files[fd]);
+    s_lfs.open[fd] = false;
+}
+
+static void lfs_bench_remove(void *ctx, const char *path)
+{
+    lfs_remove(&s_lfs.lfs, path);
+}
+
+static const bench_fs_t s_lfs_ops = {
+    .name = "littlefs",
+    .open = lfs_bench_open,
+    .read = lfs_bench_read,
+    .write = lfs_bench_write,
+    .close = lfs_bench_close,
+    .remove = lfs_bench_remove,
+};
+
+/* index.html of the image, the asset every store serves */
+static bool put_asset(const bench_fs_t *fs, const uint8_t *data, size_t len)
+{
+    int fd = fs->open(fs->ctx, BENCH_FS_ASSET, true);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fs->write(fs->ctx, fd, data, len) == (int)len;
+    fs->close(fs->ctx, fd);
+    return ok;
+}
+
+/* What send_file_asset() does per request: open the asset, read it chunk by chunk, close it */
+static void fs_asset_case(const bench_fs_t *fs, const uint8_t *data, size_t len, uint8_t *chunk)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%s_asset", fs->name);
+    bench_case_t c;
+    bench_case_begin(&c, name, len, BENCH_ASSET_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_ASSET_ITERATIONS; i++) {
+        int fd = fs->open(fs->ctx, BENCH_FS_ASSET, false);
+        size_t total = 0;
+        bool same = true;
+        while (fd >= 0) {
+            // The bytes still expected are cleared, so they only match if the filesystem filled them
+            size_t left = len - total < BENCH_FS_CHUNK ? len - total : BENCH_FS_CHUNK;
+            memset(chunk, 0, left);
+            int n = fs->read(fs->ctx, fd, chunk, BENCH_FS_CHUNK);
+            if (n <= 0) {
+                break;
+            }
+            same = same && (size_t)n <= left && memcmp(chunk, data + total, n) == 0;
+            total += n;
+        }
+        if (fd >= 0) {
+            fs->close(fs->ctx, fd);
+        }
+        if (!bench_case_check(&c, total == len && same, "read %u of %u bytes of %s%s", (unsigned)total,
+                              (unsigned)len, BENCH_FS_ASSET, same ? "" : ", not the bytes written")) {
+            return;
+        }
+    }
+    bench_case_end(&c);
+}
+
+/* What send_image_asset() does per request: look the asset up, its bytes are sent from where they are */
+static void image_asset_case(const uint8_t *data, size_t len)
+{
+    bench_case_t c;
+    bench_case_begin(&c, "flash_image_asset", len, BENCH_ASSET_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_ASSET_ITERATIONS; i++) {
+        www_image_asset_t asset;
+        bool found = www_image_find(BENCH_FS_ASSET, &asset);
+        if (!bench_case_check(&c, found && asset.len == len && memcmp(asset.data, data, len) == 0,
+                              "%s " BENCH_FS_ASSET " of %u bytes", found ? "wrong" : "no", (unsigned)len)) {
+            return;
+        }
+    }
+    bench_case_end(&c);
+}
+
+static void run_fs(const bench_fs_t *fs, const char *label, esp_err_t (*mount)(const esp_partition_t *),
+                   void (*unmount)(void), const uint8_t *data, size_t len, uint8_t *chunk)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                           label);
+    bench_case_t setup;
+    bench_case_begin(&setup, label, 0, 1);
+    if (!bench_case_check(&setup, part != NULL, "no %s partition in partitions.csv", label) ||
+            !bench_case_check(&setup, mount(part) == ESP_OK, "cannot mount %s", label)) {
+        return;
+    }
+    if (bench_case_check(&setup, put_asset(fs, data, len), "cannot write " BENCH_FS_ASSET)) {
+        fs_asset_case(fs, data, len, chunk);
+        bench_fs_cases(fs, BENCH_FS_ASSET, BENCH_FS_SCRATCH);
+    }
+    unmount();
+}
+
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+/* The web root is a host directory (see esp_spiffs.h), a front-end staged there keeps its own index.html */
+static uint8_t *web_root_asset(const uint8_t *data, size_t len, size_t *file_len)
+{
+    const char *path = CONFIG_EXAMPLE_WEB_MOUNT_POINT BENCH_FS_ASSET;
+    FILE *fp = fopen(path, "rb");
+    if (!fp && (fp = fopen(path, "wb")) != NULL) {
+        bool ok = fwrite(data, 1, len, fp) == len;
+        fclose(fp);
+        fp = ok ? fopen(path, "rb") : NULL;
+    }
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *buf = malloc(size > 0 ? size : 1);
+    if (buf) {
+        *file_len = fread(buf, 1, size, fp);
+    }
+    fclose(fp);
+    return buf;
+}
+#endif
+
+/* Body of a response captured by the shim, which holds the head send_head() wrote; NULL unless a 200 */
+static const char *response_body(const httpd_shim_response_t *resp, size_t *body_len)
+{
+    size_t captured = resp->body_len < resp->body_size ? resp->body_len : resp->body_size - 1;
+    resp->body[captured] = '\0';
+    const char *body = strstr(resp->body, "\r\n\r\n");
+    if (resp->status != 200 || resp->handler_ret != ESP_OK || strncmp(resp->body, "HTTP/1.1 200 ", 13) != 0 ||
+            !body) {
+        return NULL;
+    }
+    body += 4;
+    *body_len = resp->body_len - (body - resp->body);
+    return body;
+}
+
+/* GET / through rest_common_get_handler from the store this build serves, static_get on the device */
+static void static_get_case(const uint8_t *data, size_t len)
+{
+    const uint8_t *expected = data;
+    size_t expected_len = len;
+    uint8_t *file = NULL;
+    bench_case_t c;
+    bench_case_begin(&c, "static_get", 0, 1);
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    expected = file = web_root_asset(data, len, &expected_len);
+    if (!bench_case_check(&c, file != NULL, "cannot read " CONFIG_EXAMPLE_WEB_MOUNT_POINT BENCH_FS_ASSET)) {
+        return;
+    }
+#endif
+    httpd_shim_response_t resp = {
+        .body = malloc(expected_len + BENCH_GET_HEAD_MAX),
+        .body_size = expected_len + BENCH_GET_HEAD_MAX,
+    };
+    if (!bench_case_check(&c, resp.body != NULL, "no memory for the response")) {
+        goto out;
+    }
+
+    // The first response is checked byte for byte, the timed ones by their length
+    size_t body_len = 0;
+    const char *body = httpd_shim_request(HTTP_GET, "/", NULL, 0, &resp) == ESP_OK ?
+                       response_body(&resp, &body_len) : NULL;
+    if (!bench_case_check(&c, body && body_len == expected_len && memcmp(body, expected, expected_len) == 0,
+                          "GET /: status %d, %u bytes of %u%s", resp.status, (unsigned)body_len,
+                          (unsigned)expected_len, body ? "" : ", no response head")) {
+        goto out;
+    }
+    size_t resp_len = resp.body_len;
+
+    bench_case_begin(&c, "static_get", expected_len, BENCH_ASSET_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_ASSET_ITERATIONS; i++) {
+        if (httpd_shim_request(HTTP_GET, "/", NULL, 0, &resp) != ESP_OK || resp.status != 200 ||
+                resp.body_len != resp_len) {
+            bench_case_check(&c, false, "failed after %lu requests", (unsigned long)i);
+            goto out;
+        }
+    }
+    bench_case_end(&c);
+
+out:
+    free(resp.body);
+    free(file);
+}
+
+void bench_fs_stage_www(void)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                           BENCH_FS_WWW);
+    size_t len = www_bin_end - www_bin_start;
+    size_t erase_len = (len + BENCH_FS_SECTOR - 1) & ~(BENCH_FS_SECTOR - 1);
+    if (!part || erase_len > part->size || esp_partition_erase_range(part, 0, erase_len) != ESP_OK ||
+            esp_partition_write(part, 0, www_bin_start, len) != ESP_OK) {
+        // The flash_image cases report it
+        ESP_LOGE(TAG, "Cannot write the web asset image to the " BENCH_FS_WWW " partition");
+    }
+}
+
+void bench_fs_run(void)
+{
+    ESP_LOGI(TAG, "Running web asset store benchmarks on the emulated flash");
+    bench_case_t setup;
+    bench_case_begin(&setup, "flash_image", 0, 1);
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    // The example maps the image itself only when it serves from it
+    www_image_init(BENCH_FS_WWW);
+#endif
+    www_image_asset_t asset;
+    if (!bench_case_check(&setup, www_image_find(BENCH_FS_ASSET, &asset), "no " BENCH_FS_ASSET " in the image")) {
+        return;
+    }
+    // A copy, so every store is checked against bytes that none of them holds
+    uint8_t *data = malloc(asset.len);
+    uint8_t *chunk = malloc(BENCH_FS_CHUNK);
+    if (bench_case_check(&setup, data && chunk, "no memory for the asset")) {
+        memcpy(data, asset.data, asset.len);
+        image_asset_case(data, asset.len);
+        run_fs(&s_spiffs_ops, "spiffs", spiffs_bench_mount, spiffs_bench_unmount, data, asset.len, chunk);
+        run_fs(&s_lfs_ops, "littlefs", lfs_bench_mount, lfs_bench_unmount, data, asset.len, chunk);
+        static_get_case(data, asset.len);
+    }
+    free(chunk);
+    free(data);
+}
@@ -0,0 +1,32 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Host build of the example for the ESP-IDF Linux target. The example starts as on the device, through its
+ * own app_main(), with TinyUSB, esp_netif and esp_http_server replaced by the stand-ins in components/. The
+ * firmware upload and light engine tests and the benchmarks then run against it, and the process exits with
+ * their result, so it can run in CI on a plain Linux machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench_common.h"
+#include "host_test.h"
+
+void app_main(void)
+{
+    bench_fs_stage_www();
+    example_app_main();
+
+    test_ota_update_run();
+    test_light_engine_run();
+    printf("TEST done\n");
+    bench_data_path_run();
+    bench_fs_run();
+    printf("BENCH done\n");
+    fflush(stdout);
+    exit(bench_case_failures() ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,25 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#pragma once
+
+/* The example's app_main(), renamed for the host build */
+void example_app_main(void);
+
+/* Data path microbenchmarks, failed cases count towards bench_case_failures() */
+void bench_data_path_run(void);
+
+/* Writes the web asset image into the www partition, before the example maps or mounts its asset store */
+void bench_fs_stage_www(void);
+
+/* Web asset store benchmarks on SPIFFS, LittleFS and the image over the emulated flash, failures as above */
+void bench_fs_run(void);
+
+/* Firmware upload tests against the file-backed OTA slots, failed cases count towards bench_case_failures() */
+void test_ota_update_run(void);
+
+/* Light engine tests against the simulated output, failed cases count towards bench_case_failures() */
+void test_light_engine_run(void);
@@ -0,0 +1,32 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Memory budget for the host build. mem_budget.c reads the ESP heap capabilities, which the Linux target
+ * does not have, so buffers come from malloc() here and GET /api/v1/system/memory is not served.
+ */
+
+#include <stdlib.h>
+#include "tusb_ncm_demo.h"
+
+void mem_budget_add_static(mem_subsystem_t sub, size_t bytes)
+{
+}
+
+void *mem_budget_alloc(mem_subsystem_t sub, size_t size, mem_place_t place)
+{
+    return malloc(size);
+}
+
+void mem_budget_free(mem_subsystem_t sub, void *ptr)
+{
+    free(ptr);
+}
+
+esp_err_t mem_budget_register_handlers(httpd_handle_t server)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
@@ -0,0 +1,248 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Light engine tests of the host build, against the simulated output of light_engine.c. Each case posts a
+ * burst of colours faster than one per frame, waits until the engine has taken all of them, then reads the
+ * state and the applied sequence back through light.get:
+ *
+ *     brightness      one POST /api/v1/light/brightness per colour
+ *     batch           one POST /api/v1/batch with a light.set op per colour
+ *
+ * Every post is either coalesced or applied, so the counts add up. The applied sequence holds at most one
+ * fade per frame, each of EXAMPLE_LIGHT_FADE_MS, and ends with the last colour posted.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "httpd_shim.h"
+#include "bench_common.h"
+#include "host_test.h"
+
+static const char *TAG = "TEST";
+
+#define LIGHT_TEST_COLOURS      40
+#define LIGHT_TEST_HISTORY      16          // LIGHT_SIM_HISTORY of light_engine.c
+#define LIGHT_TEST_FRAME_US     (CONFIG_EXAMPLE_LIGHT_FRAME_MS * 1000)
+#define LIGHT_TEST_TICK_US      (portTICK_PERIOD_MS * 1000)
+#define LIGHT_TEST_WAIT_US      (1000 * 1000)
+#define LIGHT_TEST_RESP_BUFSIZE 4096
+#define LIGHT_TEST_BODY_SIZE    (LIGHT_TEST_COLOURS * 64 + 32)
+
+typedef struct {
+    uint32_t us;
+    uint32_t rgb;                           // 0x00RRGGBB
+    uint32_t fade_ms;
+} light_fade_t;
+
+typedef struct {
+    uint32_t posted;
+    uint32_t coalesced;
+    uint32_t applied;
+    uint32_t driver_errors;
+    uint32_t target;                        // 0x00RRGGBB
+    uint32_t history_len;
+    light_fade_t history[LIGHT_TEST_HISTORY];   // oldest first
+} light_state_t;
+
+/* Colour i of a burst, each one differs from the one before */
+static void colour(int i, int *red, int *green, int *blue)
+{
+    *red = i;
+    *green = 255 - i;
+    *blue = (i * 7) & 0xff;
+}
+
+/* Value of the first "key": at or after pos, 0 if it is not there */
+static uint32_t json_uint(const char *pos, const char *key, const char **end)
+{
+    char pattern[24];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *p = strstr(pos, pattern);
+    if (!p) {
+        return 0;
+    }
+    char *num_end;
+    uint32_t v = strtoul(p + strlen(pattern), &num_end, 10);
+    if (end) {
+        *end = num_end;
+    }
+    return v;
+}
+
+/* light.get through the batch endpoint, false if it did not answer */
+static bool light_get(httpd_shim_response_t *resp, light_state_t *state)
+{
+    static const char body[] = "[{\"op\":\"light.get\"}]";
+    resp->body_len = 0;
+    if (httpd_shim_request(HTTP_POST, "/api/v1/batch", body, sizeof(body) - 1, resp) != ESP_OK ||
+            resp->status != 200 || resp->body_len >= resp->body_size) {
+        return false;
+    }
+    resp->body[resp->body_len] = '\0';
+
+    const char *p = resp->body;
+    memset(state, 0, sizeof(*state));
+    state->target = json_uint(p, "red", NULL) << 16 | json_uint(p, "green", NULL) << 8 |
+                    json_uint(p, "blue", NULL);
+    state->posted = json_uint(p, "posted", NULL);
+    state->coalesced = json_uint(p, "coalesced", NULL);
+    state->applied = json_uint(p, "applied", NULL);
+    state->driver_errors = json_uint(p, "driver_errors", NULL);
+    p = strstr(p, "\"history\":");
+    while (p && state->history_len < LIGHT_TEST_HISTORY && (p = strstr(p, "{\"us\":")) != NULL) {
+        light_fade_t *e = &state->history[state->history_len++];
+        e->us = json_uint(p, "us", NULL);
+        e->rgb = json_uint(p, "red", NULL) << 16 | json_uint(p, "green", NULL) << 8 | json_uint(p, "blue", NULL);
+        e->fade_ms = json_uint(p, "fade_ms", &p);
+    }
+    return true;
+}
+
+/* Waits until the engine has taken every post since before, returns the state then */
+static bool light_settle(httpd_shim_response_t *resp, const light_state_t *before, light_state_t *after)
+{
+    int64_t start_us = esp_timer_get_time();
+    while (light_get(resp, after)) {
+        uint32_t taken = (after->coalesced - before->coalesced) + (after->applied - before->applied) +
+                         (after->driver_errors - before->driver_errors);
+        if (taken >= after->posted - before->posted || esp_timer_get_time() - start_us > LIGHT_TEST_WAIT_US) {
+            return true;
+        }
+        vTaskDelay(pdMS_TO_TICKS(CONFIG_EXAMPLE_LIGHT_FRAME_MS));
+    }
+    return false;
+}
+
+static void check_burst(bench_case_t *c, const light_state_t *before, const light_state_t *after,
+                        int64_t elapsed_us)
+{
+    uint32_t posted = after->posted - before->posted;
+    uint32_t coalesced = after->coalesced - before->coalesced;
+    uint32_t applied = after->applied - before->applied;
+    uint32_t errors = after->driver_errors - before->driver_errors;
+    int red, green, blue;
+    colour(LIGHT_TEST_COLOURS - 1, &red, &green, &blue);
+    uint32_t last = (uint32_t)red << 16 | green << 8 | blue;
+
+    bench_case_check(c, posted == LIGHT_TEST_COLOURS, "%lu of %d colours posted", (unsigned long)posted,
+                     LIGHT_TEST_COLOURS);
+    bench_case_check(c, !errors, "%lu driver errors", (unsigned long)errors);
+    bench_case_check(c, coalesced + applied + errors == posted, "%lu posted, %lu coalesced + %lu applied",
+                     (unsigned long)posted, (unsigned long)coalesced, (unsigned long)applied);
+    // One frame may already have been running when the burst started
+    uint32_t frames = elapsed_us / LIGHT_TEST_FRAME_US + 1;
+    bench_case_check(c, applied >= 1 && applied <= frames, "%lu colours applied in %lu frames",
+                     (unsigned long)applied, (unsigned long)frames);
+    bench_case_check(c, after->target == last, "light.get reports %06lx, last posted %06lx",
+                     (unsigned long)after->target, (unsigned long)last);
+    if (c->failed || applied > after->history_len) {
+        return;
+    }
+
+    // The last `applied` entries of the history are this burst
+    uint32_t first = after->history_len - applied;
+    for (uint32_t i = first; i < after->history_len; i++) {
+        bench_case_check(c, after->history[i].fade_ms == CONFIG_EXAMPLE_LIGHT_FADE_MS, "history %lu: fade of %lu ms",
+                         (unsigned long)i, (unsigned long)after->history[i].fade_ms);
+        // Frames are counted in ticks, so two fades may be up to a tick closer than a frame
+        if (i > 0) {
+            uint32_t gap_us = after->history[i].us - after->history[i - 1].us;
+            bench_case_check(c, gap_us + LIGHT_TEST_TICK_US >= LIGHT_TEST_FRAME_US,
+                             "history %lu: %lu us after the previous fade, frames are %d us", (unsigned long)i,
+                             (unsigned long)gap_us, LIGHT_TEST_FRAME_US);
+        }
+    }
+    bench_case_check(c, after->history[after->history_len - 1].rgb == last, "last fade to %06lx, not %06lx",
+                     (unsigned long)after->history[after->history_len - 1].rgb, (unsigned long)last);
+}
+
+static void test_brightness(httpd_shim_response_t *resp)
+{
+    bench_case_t c;
+    test_case_begin(&c, "light/brightness");
+    light_state_t before, after;
+    if (!bench_case_check(&c, light_get(resp, &before), "light.get failed")) {
+        return;
+    }
+
+    int64_t start_us = esp_timer_get_time();
+    for (int i = 0; i < LIGHT_TEST_COLOURS; i++) {
+        int red, green, blue;
+        colour(i, &red, &green, &blue);
+        char body[64];
+        int len = snprintf(body, sizeof(body), "{\"red\":%d,\"green\":%d,\"blue\":%d}", red, green, blue);
+        resp->body_len = 0;
+        if (httpd_shim_request(HTTP_POST, "/api/v1/light/brightness", body, len, resp) != ESP_OK ||
+                resp->status != 200) {
+            bench_case_check(&c, false, "post %d: status %d", i, resp->status);
+            return;
+        }
+    }
+    if (!bench_case_check(&c, light_settle(resp, &before, &after), "light.get failed")) {
+        return;
+    }
+    check_burst(&c, &before, &after, esp_timer_get_time() - start_us);
+    bench_case_end(&c);
+}
+
+static void test_batch(httpd_shim_response_t *resp, char *body)
+{
+    bench_case_t c;
+    test_case_begin(&c, "light/batch");
+    light_state_t before, after;
+    if (!bench_case_check(&c, light_get(resp, &before), "light.get failed")) {
+        return;
+    }
+
+    size_t len = 0;
+    body[len++] = '[';
+    for (int i = 0; i < LIGHT_TEST_COLOURS; i++) {
+        int red, green, blue;
+        colour(i, &red, &green, &blue);
+        len += snprintf(body + len, LIGHT_TEST_BODY_SIZE - len,
+                        "%s{\"op\":\"light.set\",\"args\":{\"red\":%d,\"green\":%d,\"blue\":%d}}", i ? "," : "",
+                        red, green, blue);
+    }
+    body[len++] = ']';
+
+    int64_t start_us = esp_timer_get_time();
+    resp->body_len = 0;
+    if (httpd_shim_request(HTTP_POST, "/api/v1/batch", body, len, resp) != ESP_OK || resp->status != 200) {
+        bench_case_check(&c, false, "status %d", resp->status);
+        return;
+    }
+    if (!bench_case_check(&c, light_settle(resp, &before, &after), "light.get failed")) {
+        return;
+    }
+    check_burst(&c, &before, &after, esp_timer_get_time() - start_us);
+    bench_case_end(&c);
+}
+
+void test_light_engine_run(void)
+{
+    char *body = malloc(LIGHT_TEST_BODY_SIZE);
+    httpd_shim_response_t resp = {
+        .body = malloc(LIGHT_TEST_RESP_BUFSIZE),
+        .body_size = LIGHT_TEST_RESP_BUFSIZE,
+    };
+    bench_case_t setup;
+    test_case_begin(&setup, "light/setup");
+    if (bench_case_check(&setup, body && resp.body, "no memory for the light tests")) {
+        ESP_LOGI(TAG, "Running light engine tests");
+        test_brightness(&resp);
+        test_batch(&resp, body);
+    }
+    free(resp.body);
+    free(body);
+}
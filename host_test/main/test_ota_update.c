@@ -0,0 +1,201 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Firmware upload tests of the host build. POST /api/v1/ota runs unchanged through ota_update.c, whose slots
+ * are files on the Linux target, so each case can check byte for byte what would have reached the flash:
+ *
+ *     handoff         an image of several OTA buffers, every buffer passes from the receiver to the writer
+ *                     and the slot file ends up equal to the image, which becomes the boot image
+ *     sha_mismatch    X-Image-SHA256 of a different image, the slot is discarded and the boot image kept
+ *     interrupted     the client goes away half way through, the slot is discarded and GET reports it
+ *
+ * Results are one "TEST ok ota/<case>" or "TEST error ota/<case>: ..." line per case.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "esp_log.h"
+#include "mbedtls/sha256.h"
+#include "httpd_shim.h"
+#include "bench_common.h"
+#include "host_test.h"
+
+static const char *TAG = "TEST";
+
+#define OTA_TEST_DIR            "/tmp/ncm_ota"      // OTA_FILE_DIR of ota_update.c
+#define OTA_TEST_SLOT_FILE      OTA_TEST_DIR "/ota_1.bin"
+#define OTA_TEST_BOOT_FILE      OTA_TEST_DIR "/boot"
+#define OTA_TEST_IMAGE_SIZE     (3 * CONFIG_EXAMPLE_OTA_BUF_SIZE + CONFIG_EXAMPLE_OTA_BUF_SIZE / 2 + 1)
+#define OTA_TEST_RESP_BUFSIZE   512
+
+static bool file_exists(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp) {
+        fclose(fp);
+    }
+    return fp != NULL;
+}
+
+/* Whole file into a malloc'ed buffer, NULL when it does not exist */
+static uint8_t *file_read(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    uint8_t *buf = malloc(size > 0 ? size : 1);
+    if (buf) {
+        *len = fread(buf, 1, size, fp);
+    }
+    fclose(fp);
+    return buf;
+}
+
+/* A fresh device: the first slot runs and nothing was uploaded yet */
+static void slots_reset(void)
+{
+    remove(OTA_TEST_SLOT_FILE);
+    remove(OTA_TEST_BOOT_FILE);
+}
+
+static void sha256_hex(const uint8_t *data, size_t len, char *hex)
+{
+    uint8_t sha[32];
+    mbedtls_sha256(data, len, sha, 0);
+    for (int i = 0; i < 32; i++) {
+        sprintf(hex + 2 * i, "%02x", sha[i]);
+    }
+}
+
+static void upload(const uint8_t *image, size_t body_len, size_t content_len, const char *sha_hex,
+                   httpd_shim_response_t *resp)
+{
+    char headers[96] = "";
+    if (sha_hex) {
+        snprintf(headers, sizeof(headers), "X-Image-SHA256: %s\r\n", sha_hex);
+    }
+    resp->body_len = 0;
+    if (httpd_shim_request_ex(HTTP_POST, "/api/v1/ota", headers, (const char *)image, body_len, content_len,
+                              resp) != ESP_OK) {
+        resp->status = 0;
+    }
+    resp->body[resp->body_len < resp->body_size ? resp->body_len : resp->body_size - 1] = '\0';
+}
+
+static void status(httpd_shim_response_t *resp)
+{
+    resp->body_len = 0;
+    httpd_shim_request(HTTP_GET, "/api/v1/ota", NULL, 0, resp);
+    resp->body[resp->body_len < resp->body_size ? resp->body_len : resp->body_size - 1] = '\0';
+}
+
+static void test_handoff(const uint8_t *image, httpd_shim_response_t *resp)
+{
+    bench_case_t c;
+    test_case_begin(&c, "ota/handoff");
+    char sha_hex[65];
+    sha256_hex(image, OTA_TEST_IMAGE_SIZE, sha_hex);
+    slots_reset();
+
+    upload(image, OTA_TEST_IMAGE_SIZE, OTA_TEST_IMAGE_SIZE, sha_hex, resp);
+    bench_case_check(&c, resp->status == 200, "status %d: %s", resp->status, resp->body);
+    bench_case_check(&c, strstr(resp->body, "\"sha256_checked\":true") != NULL, "hash not checked: %s",
+                     resp->body);
+
+    size_t len = 0;
+    uint8_t *slot = file_read(OTA_TEST_SLOT_FILE, &len);
+    bench_case_check(&c, slot && len == OTA_TEST_IMAGE_SIZE, "slot holds %u of %u bytes", (unsigned)len,
+                     (unsigned)OTA_TEST_IMAGE_SIZE);
+    if (slot && len == OTA_TEST_IMAGE_SIZE) {
+        size_t i = 0;
+        while (i < len && slot[i] == image[i]) {
+            i++;
+        }
+        bench_case_check(&c, i == len, "slot differs from the image at offset %u (buffer %u)", (unsigned)i,
+                         (unsigned)(i / CONFIG_EXAMPLE_OTA_BUF_SIZE));
+    }
+    free(slot);
+
+    uint8_t *boot = file_read(OTA_TEST_BOOT_FILE, &len);
+    bench_case_check(&c, boot && len == 6 && memcmp(boot, "ota_1\n", 6) == 0,
+                     "new image not selected for boot");
+    free(boot);
+
+    status(resp);
+    bench_case_check(&c, strstr(resp->body, "\"state\":\"done\"") != NULL, "GET reports %s", resp->body);
+    bench_case_end(&c);
+}
+
+static void test_sha_mismatch(const uint8_t *image, httpd_shim_response_t *resp)
+{
+    bench_case_t c;
+    test_case_begin(&c, "ota/sha_mismatch");
+    char sha_hex[65];
+    sha256_hex(image, OTA_TEST_IMAGE_SIZE - 1, sha_hex);    // the image without its last byte
+    slots_reset();
+
+    upload(image, OTA_TEST_IMAGE_SIZE, OTA_TEST_IMAGE_SIZE, sha_hex, resp);
+    bench_case_check(&c, resp->status == 500 && strcmp(resp->body, "SHA-256 mismatch") == 0, "status %d: %s",
+                     resp->status, resp->body);
+    bench_case_check(&c, !file_exists(OTA_TEST_SLOT_FILE), "slot not discarded");
+    bench_case_check(&c, !file_exists(OTA_TEST_BOOT_FILE), "boot image changed");
+    bench_case_end(&c);
+}
+
+static void test_interrupted(const uint8_t *image, httpd_shim_response_t *resp)
+{
+    bench_case_t c;
+    test_case_begin(&c, "ota/interrupted");
+    slots_reset();
+
+    upload(image, OTA_TEST_IMAGE_SIZE / 2, OTA_TEST_IMAGE_SIZE, NULL, resp);
+    bench_case_check(&c, resp->status == 500 && strcmp(resp->body, "upload interrupted") == 0, "status %d: %s",
+                     resp->status, resp->body);
+    bench_case_check(&c, !file_exists(OTA_TEST_SLOT_FILE), "slot not discarded");
+    bench_case_check(&c, !file_exists(OTA_TEST_BOOT_FILE), "boot image changed");
+
+    status(resp);
+    bench_case_check(&c, strstr(resp->body, "\"state\":\"failed\"") && strstr(resp->body, "upload interrupted"),
+                     "GET reports %s", resp->body);
+    bench_case_end(&c);
+}
+
+void test_ota_update_run(void)
+{
+    uint8_t *image = malloc(OTA_TEST_IMAGE_SIZE);
+    httpd_shim_response_t resp = {
+        .body = malloc(OTA_TEST_RESP_BUFSIZE),
+        .body_size = OTA_TEST_RESP_BUFSIZE,
+    };
+    bench_case_t setup;
+    test_case_begin(&setup, "ota/setup");
+    if (!bench_case_check(&setup, image && resp.body, "no memory for the OTA tests")) {
+        goto out;
+    }
+    // Starts like an application image, the rest differs in every buffer so a reordered one shows
+    image[0] = 0xE9;
+    for (size_t i = 1; i < OTA_TEST_IMAGE_SIZE; i++) {
+        image[i] = (i * 2654435761u) >> 24;
+    }
+    ESP_LOGI(TAG, "Running OTA upload tests");
+
+    test_handoff(image, &resp);
+    test_sha_mismatch(image, &resp);
+    test_interrupted(image, &resp);
+    slots_reset();
+
+out:
+    free(resp.body);
+    free(image);
+}
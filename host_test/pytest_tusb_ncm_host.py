@@ -0,0 +1,37 @@
+# SPDX-FileCopyrightText: 2022-2024 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: CC0-1.0
+import json
+import os
+
+import pytest
+from pytest_embedded import Dut
+
+
+@pytest.mark.linux
+@pytest.mark.host_test
+def test_tusb_ncm_host_benchmark(dut: Dut) -> None:
+    results = []
+    errors = []
+    # The firmware upload and light engine tests run first
+    while True:
+        line = dut.expect(r'TEST (ok .*|error .*|done)\r?\n', timeout=60).group(1).decode('utf-8')
+        if line == 'done':
+            break
+        if line.startswith('error '):
+            errors.append(line[len('error '):])
+    while True:
+        line = dut.expect(r'BENCH (\{.*\}|error .*|done)\r?\n', timeout=300).group(1).decode('utf-8')
+        if line == 'done':
+            break
+        if line.startswith('error '):
+            errors.append(line[len('error '):])
+            continue
+        results.append(json.loads(line))
+    if not results:
+        raise AssertionError('No benchmark results')
+    with open(os.path.join(dut.logdir, 'benchmark.json'), 'w') as f:
+        json.dump({'target': 'linux', 'results': results}, f, indent=2)
+    for r in results:
+        print('{case:<24} {size:>5} {ns_per_op:>10} ns/op {allocs_per_op} allocs/op'.format(**r))
+    if errors:
+        raise AssertionError('Checks failed:\n' + '\n'.join(errors))
@@ -0,0 +1,234 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Case harness and shared cases of benchmark.c and the host build, see bench_common.h. On the device the
+ * allocations are counted through the heap hooks (HEAP_USE_HOOKS), without them allocs_per_op is null. The
+ * host build counts them by wrapping malloc(), calloc() and realloc() at link time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "bench_common.h"
+#if CONFIG_HEAP_USE_HOOKS
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#endif
+
+#define BENCH_RING_ITERATIONS   50000
+#define BENCH_FS_OPEN_ITERATIONS 200
+#define BENCH_FS_RW_ITERATIONS  8
+#define BENCH_FS_FILE_SIZE      (64 * 1024)
+#define BENCH_FS_CHUNK          4096
+#define BENCH_FS_PATTERN        0x5a
+
+#if CONFIG_HEAP_USE_HOOKS || CONFIG_IDF_TARGET_LINUX
+#define BENCH_COUNTS_ALLOCS     1
+#endif
+
+static _Atomic uint32_t s_allocs;
+static atomic_bool s_counting;
+static _Atomic int s_failures;
+
+void bench_count_alloc(void)
+{
+    if (atomic_load_explicit(&s_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+    }
+}
+
+#if CONFIG_HEAP_USE_HOOKS
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps)
+{
+    if (atomic_load_explicit(&s_counting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&s_allocs, 1, memory_order_relaxed);
+    }
+}
+
+void IRAM_ATTR esp_heap_trace_free_hook(void *ptr)
+{
+}
+#endif
+
+void bench_case_begin(bench_case_t *c, const char *name, size_t size, uint32_t iterations)
+{
+    c->name = name;
+    c->size = size;
+    c->iterations = iterations;
+    c->stop_us = 0;
+    c->failed = false;
+    atomic_store(&s_allocs, 0);
+    atomic_store(&s_counting, iterations != 0);
+    c->start_us = esp_timer_get_time();
+}
+
+void test_case_begin(bench_case_t *c, const char *name)
+{
+    bench_case_begin(c, name, 0, 0);
+}
+
+bool bench_case_check(bench_case_t *c, bool ok, const char *fmt, ...)
+{
+    if (ok || c->failed) {
+        return ok;
+    }
+    atomic_store(&s_counting, false);
+    c->failed = true;
+    atomic_fetch_add(&s_failures, 1);
+    if (c->iterations) {
+        printf("BENCH error %s/%u: ", c->name, (unsigned)c->size);
+    } else {
+        printf("TEST error %s: ", c->name);
+    }
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    return false;
+}
+
+void bench_case_stop(bench_case_t *c)
+{
+    if (!c->stop_us) {
+        c->stop_us = esp_timer_get_time();
+        atomic_store(&s_counting, false);
+    }
+}
+
+void bench_case_end(bench_case_t *c)
+{
+    bench_case_stop(c);
+    int64_t elapsed_us = c->stop_us - c->start_us;
+    if (c->failed) {
+        return;
+    }
+    if (!c->iterations) {
+        printf("TEST ok %s\n", c->name);
+        return;
+    }
+    uint64_t ns_per_op = elapsed_us * 1000 / c->iterations;
+#if BENCH_COUNTS_ALLOCS
+    printf("BENCH {\"case\":\"%s\",\"size\":%u,\"iterations\":%lu,\"ns_per_op\":%llu,\"allocs_per_op\":%.2f}\n",
+           c->name, (unsigned)c->size, (unsigned long)c->iterations, (unsigned long long)ns_per_op,
+           (double)atomic_load(&s_allocs) / c->iterations);
+#else
+    printf("BENCH {\"case\":\"%s\",\"size\":%u,\"iterations\":%lu,\"ns_per_op\":%llu,\"allocs_per_op\":null}\n",
+           c->name, (unsigned)c->size, (unsigned long)c->iterations, (unsigned long long)ns_per_op);
+#endif
+}
+
+int bench_case_failures(void)
+{
+    return atomic_load(&s_failures);
+}
+
+/* The CDC-ACM RX ring: a chunk written by the producer, drained span by span by the consumer */
+void bench_cdc_ring(byte_ring_t *ring, const uint8_t *data, size_t len)
+{
+    bench_case_t c;
+    bench_case_begin(&c, "cdc_ring", len, BENCH_RING_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_RING_ITERATIONS; i++) {
+        byte_ring_write(ring, data, len);
+        const uint8_t *span;
+        size_t n;
+        while ((n = byte_ring_read_span(ring, &span)) > 0) {
+            byte_ring_consume(ring, n);
+        }
+    }
+    bench_case_end(&c);
+}
+
+static bool is_pattern(const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != BENCH_FS_PATTERN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bench_fs_cases(const bench_fs_t *fs, const char *asset, const char *scratch)
+{
+    char name[32];
+    uint8_t *out = malloc(BENCH_FS_CHUNK);
+    uint8_t *in = malloc(BENCH_FS_CHUNK);
+    bench_case_t c;
+
+    snprintf(name, sizeof(name), "%s_open", fs->name);
+    bench_case_begin(&c, name, 0, BENCH_FS_OPEN_ITERATIONS);
+    if (!bench_case_check(&c, out && in, "no memory for the file buffers")) {
+        goto out;
+    }
+    for (uint32_t i = 0; i < BENCH_FS_OPEN_ITERATIONS; i++) {
+        int fd = fs->open(fs->ctx, asset, false);
+        if (fd < 0) {
+            bench_case_check(&c, false, "cannot open %s", asset);
+            goto out;
+        }
+        fs->close(fs->ctx, fd);
+    }
+    bench_case_end(&c);
+
+    memset(out, BENCH_FS_PATTERN, BENCH_FS_CHUNK);
+    snprintf(name, sizeof(name), "%s_write", fs->name);
+    bench_case_begin(&c, name, BENCH_FS_FILE_SIZE, BENCH_FS_RW_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_FS_RW_ITERATIONS; i++) {
+        int fd = fs->open(fs->ctx, scratch, true);
+        size_t written = 0;
+        while (fd >= 0 && written < BENCH_FS_FILE_SIZE &&
+                fs->write(fs->ctx, fd, out, BENCH_FS_CHUNK) == BENCH_FS_CHUNK) {
+            written += BENCH_FS_CHUNK;
+        }
+        if (fd >= 0) {
+            fs->close(fs->ctx, fd);
+        }
+        if (written < BENCH_FS_FILE_SIZE) {
+            bench_case_check(&c, false, "cannot write %s", scratch);
+            goto out;
+        }
+    }
+    bench_case_end(&c);
+
+    snprintf(name, sizeof(name), "%s_read", fs->name);
+    bench_case_begin(&c, name, BENCH_FS_FILE_SIZE, BENCH_FS_RW_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_FS_RW_ITERATIONS; i++) {
+        int fd = fs->open(fs->ctx, scratch, false);
+        size_t total = 0;
+        bool same = true;
+        while (fd >= 0) {
+            // Cleared before every read, so a chunk only matches if the filesystem filled it
+            memset(in, 0, BENCH_FS_CHUNK);
+            int n = fs->read(fs->ctx, fd, in, BENCH_FS_CHUNK);
+            if (n <= 0) {
+                break;
+            }
+            same = same && is_pattern(in, n);
+            total += n;
+        }
+        if (fd >= 0) {
+            fs->close(fs->ctx, fd);
+        }
+        if (!bench_case_check(&c, total == BENCH_FS_FILE_SIZE && same, "read %u of %u bytes of %s%s",
+                              (unsigned)total, (unsigned)BENCH_FS_FILE_SIZE, scratch,
+                              same ? "" : ", not the bytes written")) {
+            goto out;
+        }
+    }
+    bench_case_end(&c);
+
+out:
+    fs->remove(fs->ctx, scratch);
+    free(in);
+    free(out);
+}
@@ -0,0 +1,63 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef __BENCH_COMMON_H__
+#define __BENCH_COMMON_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "byte_ring.h"
+
+/*
+ * Case harness shared by the on-device benchmarks, the host build's benchmarks and its tests.
+ *
+ * A benchmark case times a fixed number of iterations and prints one line when it ends:
+ *
+ *     BENCH {"case":"cdc_ring","size":64,"iterations":50000,"ns_per_op":120,"allocs_per_op":0.00}
+ *
+ * A test case only checks, and ends with "TEST ok <name>". A failed check prints "BENCH error <name>/<size>: ..."
+ * or "TEST error <name>: ..." once per case, and the case prints nothing when it ends. bench_case_stop() stops
+ * the clock early, for checks that should not count towards the time. Allocations are counted while a
+ * benchmark case runs, through bench_count_alloc() from the platform's allocation hook.
+ */
+typedef struct {
+    const char *name;
+    size_t size;            // bytes per operation
+    uint32_t iterations;    // 0 for a test case
+    int64_t start_us;
+    int64_t stop_us;        // 0 while the clock runs
+    bool failed;
+} bench_case_t;
+
+void bench_case_begin(bench_case_t *c, const char *name, size_t size, uint32_t iterations);
+void test_case_begin(bench_case_t *c, const char *name);
+/* Returns ok, so a case can stop at the first failed check */
+bool bench_case_check(bench_case_t *c, bool ok, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+void bench_case_stop(bench_case_t *c);
+void bench_case_end(bench_case_t *c);
+/* Failed cases since boot */
+int bench_case_failures(void);
+void bench_count_alloc(void);
+
+/*
+ * Filesystem under test: the VFS on the device, SPIFFS and LittleFS on the emulated flash of the host build.
+ * Handles are >= 0, read returns 0 at the end of a file and every call returns < 0 on errors.
+ */
+typedef struct {
+    const char *name;       // case prefix: spiffs_open, littlefs_read, ...
+    void *ctx;
+    int (*open)(void *ctx, const char *path, bool write);
+    int (*read)(void *ctx, int fd, void *buf, size_t len);
+    int (*write)(void *ctx, int fd, const void *buf, size_t len);
+    void (*close)(void *ctx, int fd);
+    void (*remove)(void *ctx, const char *path);
+} bench_fs_t;
+
+/* Cases that run unchanged on the device and on the host */
+void bench_cdc_ring(byte_ring_t *ring, const uint8_t *data, size_t len);
+/* Open latency of asset, then scratch written and read back in 4 KB chunks; scratch is removed again */
+void bench_fs_cases(const bench_fs_t *fs, const char *asset, const char *scratch);
+#endif
@@ -0,0 +1,236 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Boot-time microbenchmarks for the data paths, built only with EXAMPLE_BENCHMARK. Each case runs a fixed
+ * number of iterations and prints one JSON object per line on the console, prefixed with "BENCH ":
+ *
+ *     BENCH {"case":"ncm_rx_pool","size":1514,"iterations":20000,"ns_per_op":812,"allocs_per_op":0.00}
+ *
+ * followed by "BENCH done". pytest_usb_device_ncm.py collects the lines into a JSON file so CI can compare
+ * runs. The case harness and the cases that also run on the host are in bench_common.c. Allocations are
+ * counted through the heap hooks (HEAP_USE_HOOKS) and cover every task during a case; without the hooks
+ * allocs_per_op is null. The API cases and static_get go through the real httpd over a loopback socket, so
+ * they include the TCP/IP stack and show up in /api/v1/metrics like any other request. static_get fetches
+ * index.html through rest_common_get_handler from whichever asset store the build uses, under the same name
+ * for every store, so runs of a SPIFFS, a LittleFS and a flash image build can be diffed; being a static
+ * file, it also marks first_request in /api/v1/system/boot. The filesystem cases of bench_common.c run on the
+ * web root and are named after its backend (spiffs_open, littlefs_read, ...); host_test runs the same cases
+ * on both filesystems in one binary.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "byte_ring.h"
+#include "bench_common.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "BENCH";
+
+#define BENCH_FRAME_ITERATIONS  20000
+#define BENCH_API_ITERATIONS    200
+#define BENCH_RING_SIZE         4096
+#define BENCH_RESP_BUFSIZE      1024
+
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_LITTLEFS
+#define BENCH_FS_NAME           "littlefs"
+#else
+#define BENCH_FS_NAME           "spiffs"
+#endif
+
+/* What tinyusb_netif_recv_cb does with a frame before lwIP sees it */
+static void bench_ncm_rx(const uint8_t *frame, size_t len)
+{
+    bench_case_t c;
+    bench_case_begin(&c, "ncm_rx_pool", len, BENCH_FRAME_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_FRAME_ITERATIONS; i++) {
+        void *buf = ncm_rx_pool_alloc(len);
+        if (buf) {
+            memcpy(buf, frame, len);
+            pcap_capture_frame(PCAP_DIR_RX, buf, len);
+            ncm_rx_pool_free(buf);
+        }
+    }
+    bench_case_end(&c);
+
+    // The heap path the pool replaced, and still falls back to when it runs dry
+    bench_case_begin(&c, "ncm_rx_heap", len, BENCH_FRAME_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_FRAME_ITERATIONS; i++) {
+        void *buf = malloc(len);
+        if (buf) {
+            memcpy(buf, frame, len);
+            free(buf);
+        }
+    }
+    bench_case_end(&c);
+}
+
+/*
+ * Read one response with a Content-Length, whose head must fit into buf; a longer body is drained through buf.
+ * Returns the status code and the body length, or 0 if the connection broke.
+ */
+static int read_response(int sock, char *buf, size_t *body_len)
+{
+    size_t len = 0;
+    const char *body = NULL;
+    while (!body) {
+        int n = len < BENCH_RESP_BUFSIZE - 1 ? recv(sock, buf + len, BENCH_RESP_BUFSIZE - 1 - len, 0) : 0;
+        if (n <= 0) {
+            return 0;
+        }
+        len += n;
+        buf[len] = '\0';
+        body = strstr(buf, "\r\n\r\n");
+    }
+    const char *cl = strstr(buf, "Content-Length:");   // spelled this way by esp_http_server and send_head()
+    if (strncmp(buf, "HTTP/1.1 ", 9) != 0 || !cl || cl > body) {
+        return 0;
+    }
+    int status = strtol(buf + 9, NULL, 10);
+    *body_len = strtoul(cl + 15, NULL, 10);
+    size_t received = len - (body + 4 - buf);
+    while (received < *body_len) {
+        size_t want = *body_len - received;
+        int n = recv(sock, buf, want < BENCH_RESP_BUFSIZE ? want : BENCH_RESP_BUFSIZE, 0);
+        if (n <= 0) {
+            return 0;
+        }
+        received += n;
+    }
+    return status;
+}
+
+/*
+ * GET uri over one keep-alive connection. With fixed_body every response carries the same body, whose length
+ * becomes the case size and is checked on every request.
+ */
+static void bench_get(const char *name, const char *uri, bool fixed_body)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(80),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    char request[96];
+    int request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", uri);
+    char *resp = malloc(BENCH_RESP_BUFSIZE);
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    // Reported under the case's name until the first response is in
+    bench_case_t c;
+    bench_case_begin(&c, name, 0, 1);
+    if (!bench_case_check(&c, resp && sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0,
+                          "cannot reach the web server on loopback")) {
+        goto out;
+    }
+    size_t body_len = 0;
+    int status = send(sock, request, request_len, 0) == request_len ? read_response(sock, resp, &body_len) : 0;
+    if (!bench_case_check(&c, status == 200, "GET %s: status %d", uri, status)) {
+        goto out;
+    }
+
+    bench_case_begin(&c, name, fixed_body ? body_len : 0, BENCH_API_ITERATIONS);
+    for (uint32_t i = 0; i < BENCH_API_ITERATIONS; i++) {
+        size_t len = 0;
+        if (send(sock, request, request_len, 0) != request_len || read_response(sock, resp, &len) != 200 ||
+                (fixed_body && len != body_len)) {
+            bench_case_check(&c, false, "failed after %lu requests", (unsigned long)i);
+            goto out;
+        }
+    }
+    bench_case_end(&c);
+
+out:
+    if (sock >= 0) {
+        close(sock);
+    }
+    free(resp);
+}
+
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+/* The web root filesystem through the VFS, for bench_fs_cases() */
+static int vfs_open(void *ctx, const char *path, bool write)
+{
+    return write ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+}
+
+static int vfs_read(void *ctx, int fd, void *buf, size_t len)
+{
+    return read(fd, buf, len);
+}
+
+static int vfs_write(void *ctx, int fd, const void *buf, size_t len)
+{
+    return write(fd, buf, len);
+}
+
+static void vfs_close(void *ctx, int fd)
+{
+    close(fd);
+}
+
+static void vfs_remove(void *ctx, const char *path)
+{
+    unlink(path);
+}
+
+static const bench_fs_t s_web_fs = {
+    .name = BENCH_FS_NAME,
+    .open = vfs_open,
+    .read = vfs_read,
+    .write = vfs_write,
+    .close = vfs_close,
+    .remove = vfs_remove,
+};
+#endif
+
+void benchmark_run(void)
+{
+    static const size_t frame_sizes[] = { 64, 512, 1514 };
+    static const size_t chunk_sizes[] = { 16, 64, 512 };
+
+    uint8_t *data = malloc(1514);
+    uint8_t *ring_storage = malloc(BENCH_RING_SIZE);
+    if (!data || !ring_storage) {
+        ESP_LOGE(TAG, "No memory for the benchmarks");
+        goto out;
+    }
+    for (int i = 0; i < 1514; i++) {
+        data[i] = i;
+    }
+    ESP_LOGI(TAG, "Running microbenchmarks");
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+        bench_ncm_rx(data, frame_sizes[i]);
+    }
+    byte_ring_t ring;
+    byte_ring_init(&ring, ring_storage, BENCH_RING_SIZE);
+    for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); i++) {
+        bench_cdc_ring(&ring, data, chunk_sizes[i]);
+    }
+    bench_get("/api/v1/temp/raw", "/api/v1/temp/raw", false);
+    bench_get("/api/v1/system/info", "/api/v1/system/info", false);
+    bench_get("static_get", "/", true);
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    bench_fs_cases(&s_web_fs, CONFIG_EXAMPLE_WEB_MOUNT_POINT "/index.html",
+                   CONFIG_EXAMPLE_WEB_MOUNT_POINT "/bench.tmp");
+#endif
+
+out:
+    printf("BENCH done\n");
+    free(ring_storage);
+    free(data);
+}
@@ -0,0 +1,108 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Boot phase timestamps. app_main and the web init path mark the end of each stage, and the first static
+ * file served marks "first_request", which is what the user waits for after plugging the device in. Every
+ * mark is logged with its time since esp_timer started and since the previous mark. The whole list is
+ * served by GET /api/v1/system/boot, so fast boot and normal boot can be compared from the host.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "BOOT";
+
+#define BOOT_PHASES_MAX     16
+
+typedef struct {
+    const char *name;
+    int64_t us;
+} boot_phase_t;
+
+static boot_phase_t s_phases[BOOT_PHASES_MAX];
+static size_t s_count;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_bool s_first_request_seen;
+
+void boot_phase_mark(const char *name)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t prev = 0;
+    bool stored = false;
+    // Fast boot marks phases from two tasks, possibly on two cores
+    portENTER_CRITICAL(&s_lock);
+    if (s_count) {
+        prev = s_phases[s_count - 1].us;
+    }
+    if (s_count < BOOT_PHASES_MAX) {
+        s_phases[s_count].name = name;
+        s_phases[s_count].us = now;
+        s_count++;
+        stored = true;
+    }
+    portEXIT_CRITICAL(&s_lock);
+    if (stored) {
+        ESP_LOGI(TAG, "%-14s %8lld us (+%lld us)", name, (long long)now, (long long)(now - prev));
+    }
+}
+
+void boot_phase_first_request(void)
+{
+    if (!atomic_load_explicit(&s_first_request_seen, memory_order_relaxed) &&
+            !atomic_exchange(&s_first_request_seen, true)) {
+        boot_phase_mark("first_request");
+    }
+}
+
+static esp_err_t boot_get_handler(httpd_req_t *req)
+{
+    boot_phase_t phases[BOOT_PHASES_MAX];
+    portENTER_CRITICAL(&s_lock);
+    size_t count = s_count;
+    for (size_t i = 0; i < count; i++) {
+        phases[i] = s_phases[i];
+    }
+    portEXIT_CRITICAL(&s_lock);
+
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+#if CONFIG_EXAMPLE_FAST_BOOT
+    json_kv_bool(&w, "fast_boot", true);
+#else
+    json_kv_bool(&w, "fast_boot", false);
+#endif
+    json_key(&w, "phases");
+    json_arr_begin(&w);
+    for (size_t i = 0; i < count; i++) {
+        json_obj_begin(&w);
+        json_kv_str(&w, "name", phases[i].name);
+        json_kv_int(&w, "us", phases[i].us);
+        json_obj_end(&w);
+    }
+    json_arr_end(&w);
+    json_obj_end(&w);
+    return json_writer_finish(&w);
+}
+
+esp_err_t boot_phase_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t boot_get_uri = {
+        .uri = "/api/v1/system/boot",
+        .method = HTTP_GET,
+        .handler = boot_get_handler,
+    };
+    return httpd_register_uri_handler(server, &boot_get_uri);
+}
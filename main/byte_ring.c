@@ -0,0 +1,109 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include "byte_ring.h"
+
+esp_err_t byte_ring_init(byte_ring_t *ring, uint8_t *storage, size_t size)
+{
+    if (!ring || !storage || size == 0 || (size & (size - 1)) != 0 || size > UINT32_MAX / 2) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ring->buf = storage;
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return ESP_OK;
+}
+
+size_t byte_ring_write_span(byte_ring_t *ring, uint8_t **span)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t free = ring->size - (head - tail);
+    uint32_t offset = head & (ring->size - 1);
+    uint32_t to_end = ring->size - offset;
+
+    *span = ring->buf + offset;
+    return free < to_end ? free : to_end;
+}
+
+void byte_ring_commit(byte_ring_t *ring, size_t len)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + len, memory_order_release);
+}
+
+size_t byte_ring_free(byte_ring_t *ring)
+{
+    return ring->size - byte_ring_used(ring);
+}
+
+/* Copying helper for producers that do not fill the ring in place; returns how much fit */
+size_t byte_ring_write(byte_ring_t *ring, const void *data, size_t len)
+{
+    const uint8_t *src = data;
+    size_t written = 0;
+    while (written < len) {
+        uint8_t *span;
+        size_t room = byte_ring_write_span(ring, &span);
+        if (room == 0) {
+            break;
+        }
+        size_t n = len - written < room ? len - written : room;
+        memcpy(span, src + written, n);
+        byte_ring_commit(ring, n);
+        written += n;
+    }
+    return written;
+}
+
+size_t byte_ring_read_span(byte_ring_t *ring, const uint8_t **span)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t used = head - tail;
+    uint32_t offset = tail & (ring->size - 1);
+    uint32_t to_end = ring->size - offset;
+
+    *span = ring->buf + offset;
+    return used < to_end ? used : to_end;
+}
+
+void byte_ring_consume(byte_ring_t *ring, size_t len)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_release);
+}
+
+size_t byte_ring_used(byte_ring_t *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - tail;
+}
+
+/* Copy up to len readable bytes out without consuming them */
+size_t byte_ring_peek(byte_ring_t *ring, void *out, size_t len)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t used = head - tail;
+    size_t n = len < used ? len : used;
+    uint32_t offset = tail & (ring->size - 1);
+    size_t first = ring->size - offset < n ? ring->size - offset : n;
+
+    memcpy(out, ring->buf + offset, first);
+    memcpy((uint8_t *)out + first, ring->buf, n - first);
+    return n;
+}
+
+size_t byte_ring_read(byte_ring_t *ring, void *out, size_t len)
+{
+    size_t n = byte_ring_peek(ring, out, len);
+    byte_ring_consume(ring, n);
+    return n;
+}
@@ -0,0 +1,43 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef __BYTE_RING_H__
+#define __BYTE_RING_H__
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <esp_err.h>
+
+/*
+ * Lock-free single-producer/single-consumer byte ring.
+ *
+ * The producer asks for the largest contiguous free span, fills it in place (e.g. straight from a USB read)
+ * and commits what it wrote; the consumer does the same on the readable side. Head and tail are free-running
+ * counters owned by one side each, so no lock is needed as long as there is exactly one producer and one
+ * consumer. The size must be a power of two.
+ */
+typedef struct {
+    uint8_t *buf;
+    uint32_t size;
+    _Atomic uint32_t head;  // bytes ever written, only advanced by the producer
+    _Atomic uint32_t tail;  // bytes ever read, only advanced by the consumer
+} byte_ring_t;
+
+esp_err_t byte_ring_init(byte_ring_t *ring, uint8_t *storage, size_t size);
+
+/* Producer side */
+size_t byte_ring_write_span(byte_ring_t *ring, uint8_t **span);
+void byte_ring_commit(byte_ring_t *ring, size_t len);
+size_t byte_ring_free(byte_ring_t *ring);
+size_t byte_ring_write(byte_ring_t *ring, const void *data, size_t len);
+
+/* Consumer side */
+size_t byte_ring_read_span(byte_ring_t *ring, const uint8_t **span);
+void byte_ring_consume(byte_ring_t *ring, size_t len);
+size_t byte_ring_used(byte_ring_t *ring);
+size_t byte_ring_peek(byte_ring_t *ring, void *out, size_t len);
+size_t byte_ring_read(byte_ring_t *ring, void *out, size_t len);
+#endif
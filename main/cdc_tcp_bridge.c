@@ -0,0 +1,404 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Bridge between the CDC-ACM stream and TCP clients on the NCM interface. A single task multiplexes the
+ * listening socket, the clients and an eventfd with select(). Data from the CDC RX ring is coalesced until
+ * EXAMPLE_CDC_BRIDGE_COALESCE_BYTES are pending or EXAMPLE_CDC_BRIDGE_FLUSH_MS have passed, then fanned out
+ * into a per-client TX ring. Data from the clients goes through its own ring towards the CDC port.
+ * The fastest client paces the serial stream. A client that falls behind loses the bytes that do not fit
+ * in its ring, so it never stalls the serial port or the other clients.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_vfs_eventfd.h"
+#include "sdkconfig.h"
+#include "byte_ring.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "CDC_BRIDGE";
+
+#define BRIDGE_MAX_CLIENTS      CONFIG_EXAMPLE_CDC_BRIDGE_MAX_CLIENTS
+#define BRIDGE_CLIENT_BUF_SIZE  CONFIG_EXAMPLE_CDC_BRIDGE_CLIENT_BUF_SIZE
+#define BRIDGE_NET_BUF_SIZE     CONFIG_EXAMPLE_CDC_BRIDGE_NET_BUF_SIZE
+#define BRIDGE_COALESCE_BYTES   CONFIG_EXAMPLE_CDC_BRIDGE_COALESCE_BYTES
+#define BRIDGE_FLUSH_US         (CONFIG_EXAMPLE_CDC_BRIDGE_FLUSH_MS * 1000LL)
+#define BRIDGE_TASK_STACK       4096
+#define BRIDGE_TASK_PRIO        CONFIG_EXAMPLE_CDC_TASK_PRIO
+
+_Static_assert((BRIDGE_CLIENT_BUF_SIZE & (BRIDGE_CLIENT_BUF_SIZE - 1)) == 0, "client buffer must be a power of two");
+_Static_assert((BRIDGE_NET_BUF_SIZE & (BRIDGE_NET_BUF_SIZE - 1)) == 0, "network buffer must be a power of two");
+
+/* What the bridge task is waiting for, so the CDC side only signals the eventfd when it matters */
+enum {
+    WAKE_NONE,
+    WAKE_ON_DATA,       // CDC ring was empty: any data starts the flush timer
+    WAKE_ON_THRESHOLD,  // data is pending: only a full coalescing batch is worth waking up for
+};
+
+typedef struct {
+    int fd;
+    byte_ring_t tx;     // CDC -> this client
+    uint32_t drop_bytes;
+} bridge_client_t;
+
+static struct {
+    int listen_fd;
+    int event_fd;
+    _Atomic int wake;
+    bridge_client_t clients[BRIDGE_MAX_CLIENTS];
+    byte_ring_t net_rx; // clients -> CDC
+    int64_t flush_deadline;
+} s_bridge = {
+    .listen_fd = -1,
+    .event_fd = -1,
+};
+
+static uint8_t s_client_storage[BRIDGE_MAX_CLIENTS][BRIDGE_CLIENT_BUF_SIZE];
+static uint8_t s_net_storage[BRIDGE_NET_BUF_SIZE];
+
+void cdc_tcp_bridge_rx_notify(size_t pending)
+{
+    int wake = atomic_load(&s_bridge.wake);
+    if (wake == WAKE_NONE || (wake == WAKE_ON_THRESHOLD && pending < BRIDGE_COALESCE_BYTES)) {
+        return;
+    }
+    if (atomic_compare_exchange_strong(&s_bridge.wake, &wake, WAKE_NONE)) {
+        uint64_t one = 1;
+        write(s_bridge.event_fd, &one, sizeof(one));
+    }
+}
+
+static void close_client(bridge_client_t *client)
+{
+    ESP_LOGI(TAG, "Client %d disconnected, %u bytes dropped", client->fd, (unsigned)client->drop_bytes);
+    close(client->fd);
+    client->fd = -1;
+}
+
+static void accept_client(void)
+{
+    int fd = accept(s_bridge.listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+        bridge_client_t *client = &s_bridge.clients[i];
+        if (client->fd < 0) {
+#if CONFIG_EXAMPLE_CDC_BRIDGE_NODELAY
+            // Batches are already coalesced here, Nagle would only add latency on top
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#endif
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            byte_ring_init(&client->tx, s_client_storage[i], BRIDGE_CLIENT_BUF_SIZE);
+            client->fd = fd;
+            client->drop_bytes = 0;
+            ESP_LOGI(TAG, "Client %d connected", fd);
+            return;
+        }
+    }
+    ESP_LOGW(TAG, "Too many clients, rejecting %d", fd);
+    close(fd);
+}
+
+/* Copy one CDC span into every client ring. Returns how much of it can leave the CDC ring. */
+static size_t fan_out(const uint8_t *span, size_t len)
+{
+    size_t taken = 0;
+    bool any_client = false;
+
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+        bridge_client_t *client = &s_bridge.clients[i];
+        if (client->fd >= 0) {
+            any_client = true;
+            size_t room = byte_ring_free(&client->tx);
+            taken = room > taken ? room : taken;
+        }
+    }
+    if (!any_client) {
+        return len;  // nobody is listening, keep the serial side flowing
+    }
+    taken = taken < len ? taken : len;
+
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+        bridge_client_t *client = &s_bridge.clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        size_t copied = 0;
+        while (copied < taken) {
+            uint8_t *dst;
+            size_t room = byte_ring_write_span(&client->tx, &dst);
+            if (room == 0) {
+                break;
+            }
+            size_t n = taken - copied < room ? taken - copied : room;
+            memcpy(dst, span + copied, n);
+            byte_ring_commit(&client->tx, n);
+            copied += n;
+        }
+        client->drop_bytes += taken - copied;
+    }
+    return taken;
+}
+
+static void cdc_to_clients(void)
+{
+    size_t pending = tusb_cdc_rx_pending(CDC_BRIDGE_CHANNEL);
+    if (pending == 0) {
+        s_bridge.flush_deadline = 0;
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    if (!s_bridge.flush_deadline) {
+        s_bridge.flush_deadline = now + BRIDGE_FLUSH_US;
+    }
+    if (pending < BRIDGE_COALESCE_BYTES && now < s_bridge.flush_deadline) {
+        return;
+    }
+
+    const uint8_t *span;
+    size_t len;
+    while ((len = tusb_cdc_rx_span(CDC_BRIDGE_CHANNEL, &span)) > 0) {
+        size_t taken = fan_out(span, len);
+        if (taken == 0) {
+            break;  // every client ring is full, the serial side waits
+        }
+        tusb_cdc_rx_consume(CDC_BRIDGE_CHANNEL, taken);
+    }
+    metrics_observe_since(METRIC_HIST_CDC_DRAIN, now);
+    s_bridge.flush_deadline = tusb_cdc_rx_pending(CDC_BRIDGE_CHANNEL) ? now + BRIDGE_FLUSH_US : 0;
+}
+
+static void client_send(bridge_client_t *client)
+{
+    const uint8_t *span;
+    size_t len;
+    while ((len = byte_ring_read_span(&client->tx, &span)) > 0) {
+        int sent = send(client->fd, span, len, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_client(client);
+            }
+            return;
+        }
+        byte_ring_consume(&client->tx, sent);
+        if ((size_t)sent < len) {
+            return;
+        }
+    }
+}
+
+static void client_recv(bridge_client_t *client)
+{
+    uint8_t *span;
+    size_t room = byte_ring_write_span(&s_bridge.net_rx, &span);
+    if (room == 0) {
+        return;
+    }
+    int len = recv(client->fd, span, room, MSG_DONTWAIT);
+    if (len > 0) {
+        byte_ring_commit(&s_bridge.net_rx, len);
+    } else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        close_client(client);
+    }
+}
+
+static void net_to_cdc(void)
+{
+    const uint8_t *span;
+    size_t len;
+    while ((len = byte_ring_read_span(&s_bridge.net_rx, &span)) > 0) {
+        size_t queued = tusb_cdc_write(CDC_BRIDGE_CHANNEL, span, len);
+        byte_ring_consume(&s_bridge.net_rx, queued);
+        if (queued < len) {
+            return;  // CDC TX FIFO is full, retry on the next round
+        }
+    }
+}
+
+/* True when fan_out() would take CDC data: nobody is connected, or some client ring has room */
+static bool clients_can_take(void)
+{
+    bool any_client = false;
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+        bridge_client_t *client = &s_bridge.clients[i];
+        if (client->fd >= 0) {
+            if (byte_ring_free(&client->tx)) {
+                return true;
+            }
+            any_client = true;
+        }
+    }
+    return !any_client;
+}
+
+/* Arm the wake-up and work out how long select() may sleep, NULL meaning until something happens */
+static struct timeval *next_timeout(struct timeval *tv)
+{
+    int64_t wait_us = -1;
+    size_t pending = tusb_cdc_rx_pending(CDC_BRIDGE_CHANNEL);
+
+    if (pending && !clients_can_take()) {
+        // Every client ring is full: more CDC data changes nothing, only a writable client (wfds) does
+        atomic_store(&s_bridge.wake, WAKE_NONE);
+        pending = 0;
+    } else {
+        atomic_store(&s_bridge.wake, pending ? WAKE_ON_THRESHOLD : WAKE_ON_DATA);
+        // Look again after arming, data that landed in between would not signal
+        pending = tusb_cdc_rx_pending(CDC_BRIDGE_CHANNEL);
+    }
+    if (pending >= BRIDGE_COALESCE_BYTES) {
+        wait_us = 0;
+    } else if (pending) {
+        if (!s_bridge.flush_deadline) {
+            s_bridge.flush_deadline = esp_timer_get_time() + BRIDGE_FLUSH_US;
+        }
+        wait_us = s_bridge.flush_deadline - esp_timer_get_time();
+        wait_us = wait_us > 0 ? wait_us : 0;
+    }
+    if (byte_ring_used(&s_bridge.net_rx)) {
+        // Waiting on the CDC TX FIFO, which select() cannot watch
+        int64_t retry_us = portTICK_PERIOD_MS * 1000;
+        wait_us = wait_us < 0 || retry_us < wait_us ? retry_us : wait_us;
+    }
+    if (wait_us < 0) {
+        return NULL;
+    }
+    tv->tv_sec = wait_us / 1000000;
+    tv->tv_usec = wait_us % 1000000;
+    return tv;
+}
+
+static void cdc_tcp_bridge_task(void *arg)
+{
+    while (1) {
+        fd_set rfds, wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_SET(s_bridge.listen_fd, &rfds);
+        FD_SET(s_bridge.event_fd, &rfds);
+        int max_fd = s_bridge.listen_fd > s_bridge.event_fd ? s_bridge.listen_fd : s_bridge.event_fd;
+        bool net_room = byte_ring_free(&s_bridge.net_rx) > 0;
+        for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+            bridge_client_t *client = &s_bridge.clients[i];
+            if (client->fd < 0) {
+                continue;
+            }
+            // A full network ring stops reading, so TCP flow control throttles the clients
+            if (net_room) {
+                FD_SET(client->fd, &rfds);
+            }
+            if (byte_ring_used(&client->tx)) {
+                FD_SET(client->fd, &wfds);
+            }
+            max_fd = client->fd > max_fd ? client->fd : max_fd;
+        }
+
+        struct timeval tv;
+        int ret = select(max_fd + 1, &rfds, &wfds, NULL, next_timeout(&tv));
+        atomic_store(&s_bridge.wake, WAKE_NONE);
+        if (ret < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        if (ret > 0 && FD_ISSET(s_bridge.event_fd, &rfds)) {
+            uint64_t count;
+            read(s_bridge.event_fd, &count, sizeof(count));
+        }
+        if (ret > 0 && FD_ISSET(s_bridge.listen_fd, &rfds)) {
+            accept_client();
+        }
+        for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+            bridge_client_t *client = &s_bridge.clients[i];
+            if (ret > 0 && client->fd >= 0 && FD_ISSET(client->fd, &rfds)) {
+                client_recv(client);
+            }
+        }
+
+        net_to_cdc();
+        cdc_to_clients();
+
+        // Send whatever is queued right away instead of waiting for the next writable event
+        for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+            bridge_client_t *client = &s_bridge.clients[i];
+            if (client->fd >= 0 && byte_ring_used(&client->tx)) {
+                client_send(client);
+            }
+        }
+    }
+}
+
+static int create_listen_socket(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(CONFIG_EXAMPLE_CDC_BRIDGE_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+        ESP_LOGE(TAG, "Failed to listen on port %d: errno %d", CONFIG_EXAMPLE_CDC_BRIDGE_PORT, errno);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+esp_err_t cdc_tcp_bridge_start(void)
+{
+    mem_budget_add_static(MEM_CDC_BRIDGE, sizeof(s_client_storage) + sizeof(s_net_storage));
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t ret = esp_vfs_eventfd_register(&eventfd_config);
+    if (ret != ESP_OK && ret != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to register eventfd (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+    s_bridge.event_fd = eventfd(0, 0);
+    if (s_bridge.event_fd < 0) {
+        ESP_LOGE(TAG, "Failed to create eventfd");
+        return ESP_FAIL;
+    }
+    s_bridge.listen_fd = create_listen_socket();
+    if (s_bridge.listen_fd < 0) {
+        close(s_bridge.event_fd);
+        s_bridge.event_fd = -1;
+        return ESP_FAIL;
+    }
+    byte_ring_init(&s_bridge.net_rx, s_net_storage, sizeof(s_net_storage));
+    for (int i = 0; i < BRIDGE_MAX_CLIENTS; i++) {
+        s_bridge.clients[i].fd = -1;
+    }
+
+    if (xTaskCreatePinnedToCore(cdc_tcp_bridge_task, "cdc_bridge", BRIDGE_TASK_STACK, NULL, BRIDGE_TASK_PRIO, NULL,
+                                IO_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create bridge task");
+        close(s_bridge.listen_fd);
+        close(s_bridge.event_fd);
+        s_bridge.listen_fd = -1;
+        s_bridge.event_fd = -1;
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "CDC-ACM bridged to TCP port %d", CONFIG_EXAMPLE_CDC_BRIDGE_PORT);
+    return ESP_OK;
+}
@@ -0,0 +1,669 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Streaming JSON writer and schema-driven pull parser used by the REST API, see json_stream.h.
+ * Both work in place: the writer fills a fixed buffer and hands it to httpd, and the parser walks the request
+ * body once and stores each value directly into its struct member.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "esp_http_server.h"
+#include "json_stream.h"
+
+_Static_assert(JSON_MAX_DEPTH < 16, "container bits must fit has_items");
+
+/* Writer */
+
+static void writer_flush(json_writer_t *w)
+{
+    if (w->len && w->err == ESP_OK) {
+        w->err = httpd_resp_send_chunk(w->req, w->buf, w->len);
+        w->chunked = true;
+    }
+    w->len = 0;
+}
+
+static void put(json_writer_t *w, const char *s, size_t n)
+{
+    while (n && w->err == ESP_OK) {
+        if (w->len == JSON_WRITER_BUFSIZE) {
+            writer_flush(w);
+        }
+        size_t room = JSON_WRITER_BUFSIZE - w->len;
+        size_t part = n < room ? n : room;
+        memcpy(w->buf + w->len, s, part);
+        w->len += part;
+        s += part;
+        n -= part;
+    }
+}
+
+static void put_char(json_writer_t *w, char c)
+{
+    put(w, &c, 1);
+}
+
+/* Separator before a value: nothing after a key, a comma after a sibling */
+static void begin_value(json_writer_t *w)
+{
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+    uint16_t bit = 1u << w->depth;
+    if (w->has_items & bit) {
+        put_char(w, ',');
+    }
+    w->has_items |= bit;
+}
+
+static void put_string(json_writer_t *w, const char *s)
+{
+    put_char(w, '"');
+    const char *run = s;
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        put(w, run, s - run);
+        run = s + 1;
+        char esc[7];
+        switch (c) {
+        case '"':  put(w, "\\\"", 2); break;
+        case '\\': put(w, "\\\\", 2); break;
+        case '\n': put(w, "\\n", 2); break;
+        case '\r': put(w, "\\r", 2); break;
+        case '\t': put(w, "\\t", 2); break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            put(w, esc, 6);
+            break;
+        }
+    }
+    put(w, run, s - run);
+    put_char(w, '"');
+}
+
+static void open_container(json_writer_t *w, char c)
+{
+    begin_value(w);
+    if (w->depth + 1 >= JSON_MAX_DEPTH) {
+        w->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    put_char(w, c);
+    w->depth++;
+    w->has_items &= ~(1u << w->depth);
+}
+
+static void close_container(json_writer_t *w, char c)
+{
+    if (w->depth == 0 || w->after_key) {
+        w->err = ESP_ERR_INVALID_STATE;
+        return;
+    }
+    w->depth--;
+    put_char(w, c);
+}
+
+void json_writer_init(json_writer_t *w, httpd_req_t *req)
+{
+    memset(w, 0, offsetof(json_writer_t, buf));
+    w->req = req;
+    httpd_resp_set_type(req, "application/json");
+}
+
+esp_err_t json_writer_finish(json_writer_t *w)
+{
+    if (w->err == ESP_OK && (w->depth || w->after_key)) {
+        w->err = ESP_ERR_INVALID_STATE;
+    }
+    if (w->err != ESP_OK) {
+        return w->err;
+    }
+    if (!w->chunked) {
+        // The common case: the whole document fits, send it with a Content-Length
+        return httpd_resp_send(w->req, w->buf, w->len);
+    }
+    writer_flush(w);
+    return w->err == ESP_OK ? httpd_resp_send_chunk(w->req, NULL, 0) : w->err;
+}
+
+void json_obj_begin(json_writer_t *w)
+{
+    open_container(w, '{');
+}
+
+void json_obj_end(json_writer_t *w)
+{
+    close_container(w, '}');
+}
+
+void json_arr_begin(json_writer_t *w)
+{
+    open_container(w, '[');
+}
+
+void json_arr_end(json_writer_t *w)
+{
+    close_container(w, ']');
+}
+
+void json_key(json_writer_t *w, const char *key)
+{
+    begin_value(w);
+    put_string(w, key);
+    put_char(w, ':');
+    w->after_key = true;
+}
+
+void json_str(json_writer_t *w, const char *value)
+{
+    begin_value(w);
+    put_string(w, value);
+}
+
+void json_int(json_writer_t *w, int64_t value)
+{
+    char num[24];
+    begin_value(w);
+    put(w, num, snprintf(num, sizeof(num), "%lld", (long long)value));
+}
+
+void json_uint(json_writer_t *w, uint64_t value)
+{
+    char num[24];
+    begin_value(w);
+    put(w, num, snprintf(num, sizeof(num), "%llu", (unsigned long long)value));
+}
+
+void json_double(json_writer_t *w, double value)
+{
+    if (!isfinite(value)) {
+        json_null(w);   // JSON has no NaN or Inf
+        return;
+    }
+    char num[32];
+    begin_value(w);
+    put(w, num, snprintf(num, sizeof(num), "%.10g", value));
+}
+
+void json_bool(json_writer_t *w, bool value)
+{
+    begin_value(w);
+    if (value) {
+        put(w, "true", 4);
+    } else {
+        put(w, "false", 5);
+    }
+}
+
+void json_null(json_writer_t *w)
+{
+    begin_value(w);
+    put(w, "null", 4);
+}
+
+void json_raw(json_writer_t *w, const char *json, size_t len)
+{
+    begin_value(w);
+    put(w, json, len);
+}
+
+/* Reader */
+
+static bool fail(json_reader_t *r, const char *why)
+{
+    if (!r->error) {
+        r->error = why;
+    }
+    r->p = r->end;  // nothing after an error is looked at
+    return false;
+}
+
+static void skip_ws(json_reader_t *r)
+{
+    while (r->p < r->end && (*r->p == ' ' || *r->p == '\t' || *r->p == '\n' || *r->p == '\r')) {
+        r->p++;
+    }
+}
+
+static int peek(json_reader_t *r)
+{
+    skip_ws(r);
+    return r->p < r->end ? (unsigned char)*r->p : -1;
+}
+
+static bool expect(json_reader_t *r, char c, const char *why)
+{
+    if (peek(r) != c) {
+        return fail(r, why);
+    }
+    r->p++;
+    return true;
+}
+
+/* Consume c if it is the next token */
+static bool accept(json_reader_t *r, char c)
+{
+    if (peek(r) != c) {
+        return false;
+    }
+    r->p++;
+    return true;
+}
+
+static bool literal(json_reader_t *r, const char *word)
+{
+    size_t n = strlen(word);
+    if ((size_t)(r->end - r->p) < n || memcmp(r->p, word, n) != 0) {
+        return fail(r, "invalid literal");
+    }
+    r->p += n;
+    return true;
+}
+
+static int hex4(const char *p)
+{
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') {
+            v |= c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            v |= (c | 0x20) - 'a' + 10;
+        } else {
+            return -1;
+        }
+    }
+    return v;
+}
+
+/*
+ * Read a string at the cursor. With out set it is unescaped into out (cap bytes including the NUL), a string
+ * that does not fit sets *truncated, or fails when truncated is NULL. Without out the string is only validated.
+ */
+static bool read_string(json_reader_t *r, char *out, size_t cap, bool *truncated)
+{
+    if (!expect(r, '"', "expected a string")) {
+        return false;
+    }
+    size_t len = 0;
+    while (r->p < r->end && *r->p != '"') {
+        unsigned char c = *r->p++;
+        uint32_t cp = c;
+        if (c < 0x20) {
+            return fail(r, "control character in string");
+        }
+        if (c == '\\') {
+            if (r->p >= r->end) {
+                break;
+            }
+            switch (*r->p++) {
+            case '"':  cp = '"'; break;
+            case '\\': cp = '\\'; break;
+            case '/':  cp = '/'; break;
+            case 'b':  cp = '\b'; break;
+            case 'f':  cp = '\f'; break;
+            case 'n':  cp = '\n'; break;
+            case 'r':  cp = '\r'; break;
+            case 't':  cp = '\t'; break;
+            case 'u': {
+                int v = r->end - r->p >= 4 ? hex4(r->p) : -1;
+                if (v < 0) {
+                    return fail(r, "invalid \\u escape");
+                }
+                r->p += 4;
+                cp = v;
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    int lo = r->end - r->p >= 6 && r->p[0] == '\\' && r->p[1] == 'u' ? hex4(r->p + 2) : -1;
+                    if (lo < 0xdc00 || lo > 0xdfff) {
+                        return fail(r, "unpaired surrogate");
+                    }
+                    r->p += 6;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                    return fail(r, "unpaired surrogate");
+                }
+                break;
+            }
+            default:
+                return fail(r, "invalid escape");
+            }
+        }
+        if (!out) {
+            continue;
+        }
+        // Escapes come out as UTF-8, everything else is copied byte by byte
+        char utf8[4];
+        size_t n;
+        if (c == '\\' && cp >= 0x80) {
+            if (cp < 0x800) {
+                utf8[0] = 0xc0 | (cp >> 6);
+                utf8[1] = 0x80 | (cp & 0x3f);
+                n = 2;
+            } else if (cp < 0x10000) {
+                utf8[0] = 0xe0 | (cp >> 12);
+                utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[2] = 0x80 | (cp & 0x3f);
+                n = 3;
+            } else {
+                utf8[0] = 0xf0 | (cp >> 18);
+                utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+                utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+                utf8[3] = 0x80 | (cp & 0x3f);
+                n = 4;
+            }
+        } else {
+            utf8[0] = cp;
+            n = 1;
+        }
+        if (len + n >= cap) {
+            if (!truncated) {
+                return fail(r, "string too long");
+            }
+            *truncated = true;
+            cap = len + 1;  // keep scanning, store nothing more
+            continue;
+        }
+        memcpy(out + len, utf8, n);
+        len += n;
+    }
+    if (r->p >= r->end) {
+        return fail(r, "unterminated string");
+    }
+    r->p++;
+    if (out) {
+        out[len] = '\0';
+    }
+    return true;
+}
+
+/* Scan a number, integer_only rejects fractions and exponents */
+static bool read_number(json_reader_t *r, bool integer_only, int64_t *value)
+{
+    skip_ws(r);
+    const char *p = r->p;
+    bool negative = p < r->end && *p == '-';
+    p += negative;
+    if (p >= r->end || *p < '0' || *p > '9' || (*p == '0' && p + 1 < r->end && p[1] >= '0' && p[1] <= '9')) {
+        return fail(r, "expected a number");
+    }
+    int64_t v = 0;
+    for (; p < r->end && *p >= '0' && *p <= '9'; p++) {
+        if (v < INT64_MAX / 10) {
+            v = v * 10 + (*p - '0');
+        }
+    }
+    bool fraction = false;
+    if (p < r->end && *p == '.') {
+        fraction = true;
+        if (++p >= r->end || *p < '0' || *p > '9') {
+            return fail(r, "expected a number");
+        }
+        while (p < r->end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (p < r->end && (*p == 'e' || *p == 'E')) {
+        fraction = true;
+        p++;
+        if (p < r->end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+        if (p >= r->end || *p < '0' || *p > '9') {
+            return fail(r, "expected a number");
+        }
+        while (p < r->end && *p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (fraction && integer_only) {
+        return fail(r, "expected an integer");
+    }
+    r->p = p;
+    if (value) {
+        *value = negative ? -v : v;
+    }
+    return true;
+}
+
+static bool skip_value(json_reader_t *r, int depth)
+{
+    if (depth >= JSON_MAX_DEPTH) {
+        return fail(r, "nested too deep");
+    }
+    switch (peek(r)) {
+    case '"':
+        return read_string(r, NULL, 0, NULL);
+    case 't':
+        return literal(r, "true");
+    case 'f':
+        return literal(r, "false");
+    case 'n':
+        return literal(r, "null");
+    case '{':
+        r->p++;
+        if (accept(r, '}')) {
+            return true;
+        }
+        do {
+            if (!read_string(r, NULL, 0, NULL) || !expect(r, ':', "expected ':'") || !skip_value(r, depth + 1)) {
+                return false;
+            }
+        } while (accept(r, ','));
+        return expect(r, '}', "expected ',' or '}'");
+    case '[':
+        r->p++;
+        if (accept(r, ']')) {
+            return true;
+        }
+        do {
+            if (!skip_value(r, depth + 1)) {
+                return false;
+            }
+        } while (accept(r, ','));
+        return expect(r, ']', "expected ',' or ']'");
+    default:
+        return read_number(r, false, NULL);
+    }
+}
+
+static bool read_field(json_reader_t *r, const json_field_t *f, void *out)
+{
+    uint8_t *dst = (uint8_t *)out + f->offset;
+    switch (f->type) {
+    case JSON_FIELD_INT: {
+        int64_t v;
+        if (!read_number(r, true, &v)) {
+            return false;
+        }
+        if (v < f->min || v > f->max) {
+            return fail(r, "number out of range");
+        }
+        if (f->size == 1) {
+            *(uint8_t *)dst = v;
+        } else if (f->size == 2) {
+            *(uint16_t *)dst = v;
+        } else {
+            *(int32_t *)dst = v;
+        }
+        return true;
+    }
+    case JSON_FIELD_BOOL:
+        if (peek(r) == 't' && literal(r, "true")) {
+            *(bool *)dst = true;
+            return true;
+        }
+        if (peek(r) == 'f' && literal(r, "false")) {
+            *(bool *)dst = false;
+            return true;
+        }
+        return fail(r, "expected true or false");
+    case JSON_FIELD_STRING:
+        return read_string(r, (char *)dst, f->size, NULL);
+    case JSON_FIELD_RAW: {
+        json_span_t *span = (json_span_t *)dst;
+        skip_ws(r);
+        span->ptr = r->p;
+        if (!skip_value(r, 1)) {
+            return false;
+        }
+        span->len = r->p - span->ptr;
+        return true;
+    }
+    }
+    return fail(r, "bad schema");
+}
+
+void json_reader_init(json_reader_t *r, const char *text, size_t len)
+{
+    r->p = text;
+    r->end = text + len;
+    r->error = NULL;
+    r->array_start = false;
+}
+
+bool json_read_object(json_reader_t *r, const json_field_t *fields, size_t count, void *out, uint32_t *seen)
+{
+    uint32_t found = 0;
+    if (!expect(r, '{', "expected an object")) {
+        return false;
+    }
+    if (!accept(r, '}')) {
+        do {
+            char key[32];
+            bool truncated = false;
+            if (!read_string(r, key, sizeof(key), &truncated) || !expect(r, ':', "expected ':'")) {
+                return false;
+            }
+            size_t i = 0;
+            while (i < count && (truncated || strcmp(fields[i].key, key) != 0)) {
+                i++;
+            }
+            if (i == count) {
+                if (!skip_value(r, 1)) {
+                    return false;
+                }
+            } else {
+                if (!read_field(r, &fields[i], out)) {
+                    return false;
+                }
+                found |= 1u << i;
+            }
+        } while (accept(r, ','));
+        if (!expect(r, '}', "expected ',' or '}'")) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (fields[i].required && !(found & (1u << i))) {
+            return fail(r, "missing required field");
+        }
+    }
+    if (seen) {
+        *seen = found;
+    }
+    return true;
+}
+
+bool json_read_array_begin(json_reader_t *r)
+{
+    r->array_start = expect(r, '[', "expected an array");
+    return r->array_start;
+}
+
+bool json_read_array_next(json_reader_t *r)
+{
+    bool first = r->array_start;
+    r->array_start = false;
+    if (accept(r, ']')) {
+        return false;
+    }
+    if (first) {
+        return peek(r) >= 0 || fail(r, "unterminated array");
+    }
+    return expect(r, ',', "expected ',' or ']'");
+}
+
+bool json_read_end(json_reader_t *r)
+{
+    if (r->error) {
+        return false;
+    }
+    return peek(r) < 0 || fail(r, "trailing data");
+}
+
+const char *json_decode(const char *text, size_t len, const json_field_t *fields, size_t count, void *out)
+{
+    json_reader_t r;
+    json_reader_init(&r, text, len);
+    if (json_read_object(&r, fields, count, out, NULL)) {
+        json_read_end(&r);
+    }
+    return r.error;
+}
+
+size_t json_value_extent(const char *text, size_t len)
+{
+    int depth = 0;
+    bool started = false;
+    bool in_string = false;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (in_string) {
+            if (c == '\\') {
+                i++;    // the escaped character cannot end the string
+            } else if (c == '"') {
+                in_string = false;
+                if (depth == 0) {
+                    return i + 1;
+                }
+            }
+            continue;
+        }
+        switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\r':
+            if (started && depth == 0) {
+                return i;   // end of a number or literal
+            }
+            break;
+        case '"':
+            in_string = true;
+            started = true;
+            break;
+        case '{':
+        case '[':
+            depth++;
+            started = true;
+            break;
+        case '}':
+        case ']':
+        case ',':
+            if (depth == 0) {
+                return started ? i : i + 1;
+            }
+            if (c != ',' && --depth == 0) {
+                return i + 1;
+            }
+            break;
+        default:
+            started = true;
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#ifndef __JSON_STREAM_H__
+#define __JSON_STREAM_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <esp_err.h>
+#include <esp_http_server.h>
+
+#define JSON_MAX_DEPTH          8
+#define JSON_WRITER_BUFSIZE     256
+
+/*
+ * Streaming JSON writer for HTTP responses.
+ *
+ * Output collects in a small buffer inside the writer, usually on the handler's stack. If the whole document
+ * fits, json_writer_finish() sends it as one response with a Content-Length. Otherwise each full buffer goes
+ * out as a chunk. Commas are inserted automatically and strings are escaped. Nothing is allocated. The first
+ * error sticks and is returned by json_writer_finish(), so callers do not check every call.
+ */
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t err;
+    size_t len;
+    bool chunked;           // part of the document has already been sent
+    bool after_key;         // the next value belongs to the key just written
+    uint8_t depth;
+    uint16_t has_items;     // bit n: the container at depth n already holds a value
+    char buf[JSON_WRITER_BUFSIZE];
+} json_writer_t;
+
+void json_writer_init(json_writer_t *w, httpd_req_t *req);
+esp_err_t json_writer_finish(json_writer_t *w);
+
+void json_obj_begin(json_writer_t *w);
+void json_obj_end(json_writer_t *w);
+void json_arr_begin(json_writer_t *w);
+void json_arr_end(json_writer_t *w);
+void json_key(json_writer_t *w, const char *key);
+void json_str(json_writer_t *w, const char *value);
+void json_int(json_writer_t *w, int64_t value);
+void json_uint(json_writer_t *w, uint64_t value);
+void json_double(json_writer_t *w, double value);
+void json_bool(json_writer_t *w, bool value);
+void json_null(json_writer_t *w);
+/* Copy an already encoded JSON value as-is */
+void json_raw(json_writer_t *w, const char *json, size_t len);
+
+static inline void json_kv_str(json_writer_t *w, const char *key, const char *value)
+{
+    json_key(w, key);
+    json_str(w, value);
+}
+
+static inline void json_kv_int(json_writer_t *w, const char *key, int64_t value)
+{
+    json_key(w, key);
+    json_int(w, value);
+}
+
+static inline void json_kv_uint(json_writer_t *w, const char *key, uint64_t value)
+{
+    json_key(w, key);
+    json_uint(w, value);
+}
+
+static inline void json_kv_double(json_writer_t *w, const char *key, double value)
+{
+    json_key(w, key);
+    json_double(w, value);
+}
+
+static inline void json_kv_bool(json_writer_t *w, const char *key, bool value)
+{
+    json_key(w, key);
+    json_bool(w, value);
+}
+
+/*
+ * Schema-driven pull parser for request bodies.
+ *
+ * An object is decoded straight into a caller's struct, as described by a table of json_field_t. Integers
+ * are range checked, strings are unescaped into fixed arrays, and RAW fields keep a pointer into the source
+ * text for values that are decoded later. Unknown keys are skipped. Missing required fields, wrong types,
+ * out of range numbers, overlong strings and malformed JSON are all rejected, and reader->error says why.
+ * The source text is never modified and nothing is allocated.
+ */
+typedef enum {
+    JSON_FIELD_INT,     // integer member of 1, 2 or 4 bytes, checked against [min, max]
+    JSON_FIELD_BOOL,    // bool member
+    JSON_FIELD_STRING,  // char array member, NUL terminated
+    JSON_FIELD_RAW,     // json_span_t member, any JSON value left encoded
+} json_field_type_t;
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} json_span_t;
+
+typedef struct {
+    const char *key;
+    json_field_type_t type;
+    bool required;
+    uint16_t offset;
+    uint16_t size;
+    int32_t min;
+    int32_t max;
+} json_field_t;
+
+#define JSON_REQUIRED   true
+#define JSON_OPTIONAL   false
+
+#define JSON_FIELD_INT(type, member, lo, hi, req) \
+    { #member, JSON_FIELD_INT, req, offsetof(type, member), sizeof(((type *)0)->member), lo, hi }
+#define JSON_FIELD_BOOL(type, member, req) \
+    { #member, JSON_FIELD_BOOL, req, offsetof(type, member), sizeof(((type *)0)->member), 0, 0 }
+#define JSON_FIELD_STRING(type, member, req) \
+    { #member, JSON_FIELD_STRING, req, offsetof(type, member), sizeof(((type *)0)->member), 0, 0 }
+#define JSON_FIELD_RAW(type, member, req) \
+    { #member, JSON_FIELD_RAW, req, offsetof(type, member), sizeof(((type *)0)->member), 0, 0 }
+
+typedef struct {
+    const char *p;
+    const char *end;
+    const char *error;  // first error, NULL while the input is fine
+    bool array_start;   // json_read_array_begin() was just called
+} json_reader_t;
+
+void json_reader_init(json_reader_t *r, const char *text, size_t len);
+/* Decode the object at the cursor, seen (optional) gets bit n set for every fields[n] present */
+bool json_read_object(json_reader_t *r, const json_field_t *fields, size_t count, void *out, uint32_t *seen);
+/* Step through an array: begin consumes '[', next returns true while another element follows */
+bool json_read_array_begin(json_reader_t *r);
+bool json_read_array_next(json_reader_t *r);
+/* True when only whitespace is left */
+bool json_read_end(json_reader_t *r);
+
+/* Decode a whole document that is a single object, returns NULL or the reason it was rejected */
+const char *json_decode(const char *text, size_t len, const json_field_t *fields, size_t count, void *out);
+
+/*
+ * Length of the JSON value at the start of text, leading whitespace included, or 0 while it is cut off at len.
+ * Only brackets and strings are tracked, so a body received in pieces can be split into values before they
+ * are decoded; a malformed value still gets a length and the reader reports what is wrong with it.
+ */
+size_t json_value_extent(const char *text, size_t len);
+#endif
@@ -0,0 +1,280 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Light engine behind light.set and POST /api/v1/light/brightness. Callers only store the new colour in a
+ * one-slot mailbox and return; a newer colour simply replaces one that has not been applied yet. The engine
+ * task applies the mailbox at most once per EXAMPLE_LIGHT_FRAME_MS, so a slider drag or a colour sweep turns
+ * into one output update per frame instead of one per request. Each update is a hardware fade of
+ * EXAMPLE_LIGHT_FADE_MS from wherever the previous fade got to, so the CPU never steps the duty itself.
+ *
+ * The output goes through a small driver ops table: LEDC on three GPIOs, or a simulated driver that keeps
+ * the last applied states for light.get, to check the coalescing without an LED attached.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+#if CONFIG_EXAMPLE_LIGHT_DRIVER_LEDC
+#include "driver/ledc.h"
+#endif
+
+static const char *TAG = "LIGHT";
+
+#define LIGHT_TASK_STACK    3072
+#define LIGHT_TASK_PRIO     4
+#define LIGHT_FRAME_TICKS   MAX(pdMS_TO_TICKS(CONFIG_EXAMPLE_LIGHT_FRAME_MS), 1)
+#define LIGHT_FADE_MS       CONFIG_EXAMPLE_LIGHT_FADE_MS
+#define LIGHT_PENDING       (1u << 24)  // mailbox holds a colour that has not been applied yet
+
+/* Output seam: the engine only ever asks a driver to fade all three channels to a new colour */
+typedef struct {
+    const char *name;
+    esp_err_t (*init)(void);
+    esp_err_t (*fade_to)(light_rgb_t rgb, uint32_t fade_ms);
+} light_driver_t;
+
+static struct {
+    _Atomic uint32_t mailbox;       // 0x00RRGGBB | LIGHT_PENDING
+    _Atomic uint32_t target;        // last colour posted, 0x00RRGGBB
+    _Atomic uint32_t posted;
+    _Atomic uint32_t coalesced;     // posts replaced before they were applied
+    _Atomic uint32_t applied;
+    _Atomic uint32_t driver_errors;
+    TaskHandle_t task;
+} s_light;
+
+static uint32_t rgb_pack(light_rgb_t rgb)
+{
+    return (uint32_t)rgb.red << 16 | (uint32_t)rgb.green << 8 | rgb.blue;
+}
+
+static light_rgb_t rgb_unpack(uint32_t v)
+{
+    return (light_rgb_t) {
+        .red = (v >> 16) & 0xff, .green = (v >> 8) & 0xff, .blue = v & 0xff
+    };
+}
+
+#if CONFIG_EXAMPLE_LIGHT_DRIVER_LEDC
+#define LEDC_MODE           LEDC_LOW_SPEED_MODE
+#define LEDC_TIMER          LEDC_TIMER_0
+#define LEDC_RESOLUTION     LEDC_TIMER_13_BIT
+#define LEDC_DUTY_MAX       ((1u << 13) - 1)
+#define LEDC_FREQ_HZ        5000
+
+static const struct {
+    ledc_channel_t channel;
+    int gpio;
+} s_ledc_outputs[3] = {
+    { LEDC_CHANNEL_0, CONFIG_EXAMPLE_LIGHT_GPIO_RED },
+    { LEDC_CHANNEL_1, CONFIG_EXAMPLE_LIGHT_GPIO_GREEN },
+    { LEDC_CHANNEL_2, CONFIG_EXAMPLE_LIGHT_GPIO_BLUE },
+};
+
+static esp_err_t ledc_light_init(void)
+{
+    ledc_timer_config_t timer = {
+        .speed_mode = LEDC_MODE,
+        .timer_num = LEDC_TIMER,
+        .duty_resolution = LEDC_RESOLUTION,
+        .freq_hz = LEDC_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    esp_err_t ret = ledc_timer_config(&timer);
+    for (int i = 0; i < 3 && ret == ESP_OK; i++) {
+        ledc_channel_config_t channel = {
+            .gpio_num = s_ledc_outputs[i].gpio,
+            .speed_mode = LEDC_MODE,
+            .channel = s_ledc_outputs[i].channel,
+            .timer_sel = LEDC_TIMER,
+            .duty = 0,
+        };
+        ret = ledc_channel_config(&channel);
+    }
+    if (ret == ESP_OK) {
+        ret = ledc_fade_func_install(0);
+    }
+    return ret;
+}
+
+static esp_err_t ledc_light_fade_to(light_rgb_t rgb, uint32_t fade_ms)
+{
+    const uint8_t levels[3] = { rgb.red, rgb.green, rgb.blue };
+    esp_err_t ret = ESP_OK;
+    for (int i = 0; i < 3; i++) {
+        ledc_channel_t channel = s_ledc_outputs[i].channel;
+        uint32_t duty = levels[i] * LEDC_DUTY_MAX / 255;
+        // Take over from wherever a running fade got to, the new one starts from the current duty
+        ledc_fade_stop(LEDC_MODE, channel);
+        esp_err_t err;
+        if (fade_ms) {
+            err = ledc_set_fade_time_and_start(LEDC_MODE, channel, duty, fade_ms, LEDC_FADE_NO_WAIT);
+        } else {
+            err = ledc_set_duty(LEDC_MODE, channel, duty);
+            if (err == ESP_OK) {
+                err = ledc_update_duty(LEDC_MODE, channel);
+            }
+        }
+        if (err != ESP_OK) {
+            ret = err;
+        }
+    }
+    return ret;
+}
+
+static const light_driver_t s_driver = {
+    .name = "ledc",
+    .init = ledc_light_init,
+    .fade_to = ledc_light_fade_to,
+};
+#else
+#define LIGHT_SIM_HISTORY   16
+
+typedef struct {
+    uint32_t us;
+    uint32_t rgb;
+    uint32_t fade_ms;
+} light_sim_entry_t;
+
+/* Simulated output, keeps the applied sequence so light.get shows what an LED would have done */
+static struct {
+    light_sim_entry_t entries[LIGHT_SIM_HISTORY];
+    uint32_t count;                 // entries ever recorded
+    portMUX_TYPE lock;
+} s_sim = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static esp_err_t sim_light_init(void)
+{
+    return ESP_OK;
+}
+
+static esp_err_t sim_light_fade_to(light_rgb_t rgb, uint32_t fade_ms)
+{
+    portENTER_CRITICAL(&s_sim.lock);
+    uint32_t slot = s_sim.count++ % LIGHT_SIM_HISTORY;
+    s_sim.entries[slot].us = esp_timer_get_time();
+    s_sim.entries[slot].rgb = rgb_pack(rgb);
+    s_sim.entries[slot].fade_ms = fade_ms;
+    portEXIT_CRITICAL(&s_sim.lock);
+    return ESP_OK;
+}
+
+static const light_driver_t s_driver = {
+    .name = "simulated",
+    .init = sim_light_init,
+    .fade_to = sim_light_fade_to,
+};
+#endif
+
+void light_engine_post(light_rgb_t rgb)
+{
+    uint32_t packed = rgb_pack(rgb);
+    atomic_store_explicit(&s_light.target, packed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s_light.posted, 1, memory_order_relaxed);
+    uint32_t prev = atomic_exchange(&s_light.mailbox, packed | LIGHT_PENDING);
+    if (prev & LIGHT_PENDING) {
+        atomic_fetch_add_explicit(&s_light.coalesced, 1, memory_order_relaxed);
+    }
+    if (s_light.task) {
+        xTaskNotifyGive(s_light.task);
+    }
+}
+
+static void light_engine_task(void *arg)
+{
+    TickType_t last_apply = xTaskGetTickCount() - LIGHT_FRAME_TICKS;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // One update per frame, whatever is posted while we wait replaces the mailbox content
+        TickType_t since = xTaskGetTickCount() - last_apply;
+        if (since < LIGHT_FRAME_TICKS) {
+            vTaskDelay(LIGHT_FRAME_TICKS - since);
+        }
+        uint32_t mail = atomic_exchange(&s_light.mailbox, 0);
+        if (!(mail & LIGHT_PENDING)) {
+            continue;   // already applied on the previous wake-up
+        }
+        last_apply = xTaskGetTickCount();
+        light_rgb_t rgb = rgb_unpack(mail);
+        esp_err_t err = s_driver.fade_to(rgb, LIGHT_FADE_MS);
+        if (err != ESP_OK) {
+            atomic_fetch_add_explicit(&s_light.driver_errors, 1, memory_order_relaxed);
+            ESP_LOGW(TAG, "Failed to apply colour (%s)", esp_err_to_name(err));
+            continue;
+        }
+        atomic_fetch_add_explicit(&s_light.applied, 1, memory_order_relaxed);
+        ESP_LOGD(TAG, "Applied red = %d, green = %d, blue = %d", rgb.red, rgb.green, rgb.blue);
+    }
+}
+
+void light_engine_write_state(json_writer_t *w)
+{
+    light_rgb_t target = rgb_unpack(atomic_load_explicit(&s_light.target, memory_order_relaxed));
+    json_obj_begin(w);
+    json_kv_int(w, "red", target.red);
+    json_kv_int(w, "green", target.green);
+    json_kv_int(w, "blue", target.blue);
+    json_kv_str(w, "driver", s_driver.name);
+    json_kv_uint(w, "posted", atomic_load_explicit(&s_light.posted, memory_order_relaxed));
+    json_kv_uint(w, "coalesced", atomic_load_explicit(&s_light.coalesced, memory_order_relaxed));
+    json_kv_uint(w, "applied", atomic_load_explicit(&s_light.applied, memory_order_relaxed));
+    json_kv_uint(w, "driver_errors", atomic_load_explicit(&s_light.driver_errors, memory_order_relaxed));
+#if !CONFIG_EXAMPLE_LIGHT_DRIVER_LEDC
+    light_sim_entry_t entries[LIGHT_SIM_HISTORY];
+    portENTER_CRITICAL(&s_sim.lock);
+    uint32_t count = s_sim.count;
+    memcpy(entries, s_sim.entries, sizeof(entries));
+    portEXIT_CRITICAL(&s_sim.lock);
+
+    // Oldest first
+    uint32_t first = count > LIGHT_SIM_HISTORY ? count - LIGHT_SIM_HISTORY : 0;
+    json_key(w, "history");
+    json_arr_begin(w);
+    for (uint32_t i = first; i < count; i++) {
+        uint32_t slot = i % LIGHT_SIM_HISTORY;
+        light_rgb_t rgb = rgb_unpack(entries[slot].rgb);
+        json_obj_begin(w);
+        json_kv_uint(w, "us", entries[slot].us);
+        json_kv_int(w, "red", rgb.red);
+        json_kv_int(w, "green", rgb.green);
+        json_kv_int(w, "blue", rgb.blue);
+        json_kv_uint(w, "fade_ms", entries[slot].fade_ms);
+        json_obj_end(w);
+    }
+    json_arr_end(w);
+#endif
+    json_obj_end(w);
+}
+
+esp_err_t light_engine_start(void)
+{
+    esp_err_t ret = s_driver.init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to set up %s output (%s)", s_driver.name, esp_err_to_name(ret));
+        return ret;
+    }
+    if (xTaskCreatePinnedToCore(light_engine_task, "light", LIGHT_TASK_STACK, NULL, LIGHT_TASK_PRIO,
+                                &s_light.task, APP_TASK_CORE) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Pick up a colour posted before the task existed
+    xTaskNotifyGive(s_light.task);
+    ESP_LOGI(TAG, "Light engine on %s output, %d ms frames, %d ms fades", s_driver.name,
+             CONFIG_EXAMPLE_LIGHT_FRAME_MS, LIGHT_FADE_MS);
+    return ESP_OK;
+}
@@ -0,0 +1,150 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Memory budget per subsystem. Every module reports its static buffers once at start-up and takes its large
+ * heap buffers through mem_budget_alloc(), which counts live and peak bytes per subsystem. Buffers off the USB
+ * data paths are allocated with MEM_PLACE_ANY and go to PSRAM when EXAMPLE_PSRAM_BUFFERS is enabled, so
+ * internal SRAM stays free for lwIP pbufs and TCP windows. GET /api/v1/system/memory returns:
+ *
+ *     {"internal":{"total":...,"free":...,"min_free":...,"largest_block":...},"psram":{...},
+ *      "subsystems":[{"name":"ncm_rx","static":24576,"heap":0,"heap_peak":1514,"psram":0,"alloc_fails":0},
+ *      ...]}
+ *
+ * heap includes the psram bytes, and "psram" is only present when PSRAM is enabled.
+ */
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "MEM_BUDGET";
+
+typedef struct {
+    _Atomic uint32_t static_bytes;
+    _Atomic uint32_t heap_bytes;
+    _Atomic uint32_t heap_peak;
+    _Atomic uint32_t psram_bytes;
+    _Atomic uint32_t alloc_fails;
+} mem_usage_t;
+
+#define MEM_BUDGET_NAME(id, name) name,
+static const char *const s_names[] = { MEM_BUDGET_SUBSYSTEMS(MEM_BUDGET_NAME) };
+
+static mem_usage_t s_usage[MEM_SUBSYSTEM_MAX];
+
+void mem_budget_add_static(mem_subsystem_t sub, size_t bytes)
+{
+    atomic_fetch_add_explicit(&s_usage[sub].static_bytes, bytes, memory_order_relaxed);
+}
+
+static void note_heap_used(mem_usage_t *u, size_t bytes)
+{
+    uint32_t used = atomic_fetch_add_explicit(&u->heap_bytes, bytes, memory_order_relaxed) + bytes;
+    uint32_t peak = atomic_load_explicit(&u->heap_peak, memory_order_relaxed);
+    while (used > peak &&
+           !atomic_compare_exchange_weak_explicit(&u->heap_peak, &peak, used,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void *mem_budget_alloc(mem_subsystem_t sub, size_t size, mem_place_t place)
+{
+    mem_usage_t *u = &s_usage[sub];
+    void *ptr = NULL;
+#if CONFIG_EXAMPLE_PSRAM_BUFFERS
+    if (place == MEM_PLACE_ANY) {
+        ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+#endif
+    if (!ptr) {
+        // Buffers on the USB data paths must stay in internal RAM, the rest take whatever malloc() would
+        ptr = heap_caps_malloc(size, place == MEM_PLACE_INTERNAL ? MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT
+                                                                 : MALLOC_CAP_DEFAULT);
+    }
+    if (!ptr) {
+        atomic_fetch_add_explicit(&u->alloc_fails, 1, memory_order_relaxed);
+        ESP_LOGD(TAG, "%s: no memory for %u bytes", s_names[sub], (unsigned)size);
+        return NULL;
+    }
+    // Count what the heap really reserved, so alloc and free always add up
+    size_t bytes = heap_caps_get_allocated_size(ptr);
+    note_heap_used(u, bytes);
+    if (esp_ptr_external_ram(ptr)) {
+        atomic_fetch_add_explicit(&u->psram_bytes, bytes, memory_order_relaxed);
+    }
+    return ptr;
+}
+
+void mem_budget_free(mem_subsystem_t sub, void *ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    mem_usage_t *u = &s_usage[sub];
+    size_t bytes = heap_caps_get_allocated_size(ptr);
+    atomic_fetch_sub_explicit(&u->heap_bytes, bytes, memory_order_relaxed);
+    if (esp_ptr_external_ram(ptr)) {
+        atomic_fetch_sub_explicit(&u->psram_bytes, bytes, memory_order_relaxed);
+    }
+    heap_caps_free(ptr);
+}
+
+static void write_heap(json_writer_t *w, const char *key, uint32_t caps)
+{
+    multi_heap_info_t info;
+    heap_caps_get_info(&info, caps);
+    json_key(w, key);
+    json_obj_begin(w);
+    json_kv_uint(w, "total", heap_caps_get_total_size(caps));
+    json_kv_uint(w, "free", info.total_free_bytes);
+    json_kv_uint(w, "min_free", info.minimum_free_bytes);
+    json_kv_uint(w, "largest_block", info.largest_free_block);
+    json_obj_end(w);
+}
+
+static esp_err_t memory_get_handler(httpd_req_t *req)
+{
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    write_heap(&w, "internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+#if CONFIG_SPIRAM
+    write_heap(&w, "psram", MALLOC_CAP_SPIRAM);
+#endif
+    json_key(&w, "subsystems");
+    json_arr_begin(&w);
+    for (int i = 0; i < MEM_SUBSYSTEM_MAX; i++) {
+        mem_usage_t *u = &s_usage[i];
+        json_obj_begin(&w);
+        json_kv_str(&w, "name", s_names[i]);
+        json_kv_uint(&w, "static", atomic_load_explicit(&u->static_bytes, memory_order_relaxed));
+        json_kv_uint(&w, "heap", atomic_load_explicit(&u->heap_bytes, memory_order_relaxed));
+        json_kv_uint(&w, "heap_peak", atomic_load_explicit(&u->heap_peak, memory_order_relaxed));
+        json_kv_uint(&w, "psram", atomic_load_explicit(&u->psram_bytes, memory_order_relaxed));
+        json_kv_uint(&w, "alloc_fails", atomic_load_explicit(&u->alloc_fails, memory_order_relaxed));
+        json_obj_end(&w);
+    }
+    json_arr_end(&w);
+    json_obj_end(&w);
+    return json_writer_finish(&w);
+}
+
+esp_err_t mem_budget_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t memory_get_uri = {
+        .uri = "/api/v1/system/memory",
+        .method = HTTP_GET,
+        .handler = memory_get_handler,
+    };
+    return httpd_register_uri_handler(server, &memory_get_uri);
+}
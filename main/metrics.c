@@ -0,0 +1,220 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Metrics registry for the data paths. Counters and histograms are listed once in tusb_ncm_demo.h. Every
+ * core updates its own copy with interrupts masked for a few instructions, so there are no locks or shared
+ * cache lines on the hot path. The copies are only summed when /api/v1/metrics is scraped.
+ * Histograms use fixed power-of-two buckets from 1 us to 32.768 ms, plus +Inf. The endpoint also reports the
+ * stats the RX pool, TX queue and CDC ring keep themselves, in Prometheus text format.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "METRICS";
+
+#define METRICS_PREFIX          "espnetkit_"
+#define METRICS_HIST_BUCKETS    17      // le = 2^0 .. 2^15 us, then +Inf
+#define METRICS_OUT_BUFSIZE     1024
+
+typedef struct {
+    uint32_t buckets[METRICS_HIST_BUCKETS];
+    uint64_t sum_us;
+} metrics_hist_t;
+
+typedef struct {
+    uint64_t counters[METRIC_COUNTER_MAX];
+    metrics_hist_t hist[METRIC_HIST_MAX];
+} metrics_core_t;
+
+static metrics_core_t s_cores[portNUM_PROCESSORS];
+
+#define METRIC_DESC(id, name, help) { name, help },
+static const struct {
+    const char *name;
+    const char *help;
+} s_counter_desc[] = { METRICS_COUNTERS(METRIC_DESC) }, s_hist_desc[] = { METRICS_HISTOGRAMS(METRIC_DESC) };
+
+void metrics_add(metric_counter_t id, uint32_t n)
+{
+    // Masking interrupts pins us to this core's copy, nobody else writes it
+    UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+    s_cores[xPortGetCoreID()].counters[id] += n;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+void metrics_observe_us(metric_histogram_t id, uint32_t us)
+{
+    uint32_t bucket = us <= 1 ? 0 : 32 - __builtin_clz(us - 1);
+    if (bucket >= METRICS_HIST_BUCKETS) {
+        bucket = METRICS_HIST_BUCKETS - 1;
+    }
+    UBaseType_t state = portSET_INTERRUPT_MASK_FROM_ISR();
+    metrics_hist_t *hist = &s_cores[xPortGetCoreID()].hist[id];
+    hist->buckets[bucket]++;
+    hist->sum_us += us;
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(state);
+}
+
+/* 64-bit values are written as two words, read until two snapshots agree */
+static uint64_t read_u64(const uint64_t *value)
+{
+    const volatile uint64_t *v = value;
+    uint64_t a, b;
+    do {
+        a = *v;
+        b = *v;
+    } while (a != b);
+    return a;
+}
+
+uint64_t metrics_counter_get(metric_counter_t id)
+{
+    uint64_t total = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        total += read_u64(&s_cores[core].counters[id]);
+    }
+    return total;
+}
+
+typedef struct {
+    httpd_req_t *req;
+    char *buf;
+    size_t len;
+    esp_err_t err;
+} metrics_writer_t;
+
+static void writer_flush(metrics_writer_t *w)
+{
+    if (w->len && w->err == ESP_OK) {
+        w->err = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void __attribute__((format(printf, 2, 3))) writer_printf(metrics_writer_t *w, const char *fmt, ...)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(w->buf + w->len, METRICS_OUT_BUFSIZE - w->len, fmt, args);
+        va_end(args);
+        if (n >= 0 && (size_t)n < METRICS_OUT_BUFSIZE - w->len) {
+            w->len += n;
+            return;
+        }
+        writer_flush(w);
+    }
+    ESP_LOGW(TAG, "Metrics line too long, skipped");
+}
+
+static void write_value(metrics_writer_t *w, const char *type, const char *name, const char *help, uint64_t value)
+{
+    writer_printf(w, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n" METRICS_PREFIX "%s %llu\n",
+                  name, help, name, type, name, (unsigned long long)value);
+}
+
+static void write_histogram(metrics_writer_t *w, metric_histogram_t id)
+{
+    const char *name = s_hist_desc[id].name;
+    uint64_t buckets[METRICS_HIST_BUCKETS] = {0};
+    uint64_t sum_us = 0;
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        const metrics_hist_t *hist = &s_cores[core].hist[id];
+        for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+            buckets[i] += hist->buckets[i];
+        }
+        sum_us += read_u64(&hist->sum_us);
+    }
+
+    writer_printf(w, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s histogram\n",
+                  name, s_hist_desc[id].help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+        cumulative += buckets[i];
+        if (i < METRICS_HIST_BUCKETS - 1) {
+            writer_printf(w, METRICS_PREFIX "%s_bucket{le=\"%.6f\"} %llu\n", name, (1u << i) / 1e6,
+                          (unsigned long long)cumulative);
+        } else {
+            writer_printf(w, METRICS_PREFIX "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        }
+    }
+    writer_printf(w, METRICS_PREFIX "%s_sum %.6f\n" METRICS_PREFIX "%s_count %llu\n",
+                  name, sum_us / 1e6, name, (unsigned long long)cumulative);
+}
+
+/* Stats kept by the modules themselves, collected at scrape time */
+static void write_module_stats(metrics_writer_t *w)
+{
+    ncm_rx_pool_stats_t rx;
+    ncm_rx_pool_get_stats(&rx);
+    write_value(w, "gauge", "ncm_rx_pool_in_use", "RX pool slots held by lwIP", rx.in_use);
+    write_value(w, "gauge", "ncm_rx_pool_high_water", "Most RX pool slots ever in use", rx.high_water);
+    write_value(w, "counter", "ncm_rx_pool_exhausted_total", "Frames that found the RX pool empty", rx.exhausted_count);
+    write_value(w, "counter", "ncm_rx_heap_fallback_total", "Received frames stored on the heap", rx.heap_fallback_count);
+    write_value(w, "counter", "ncm_rx_alloc_fail_total", "Received frames dropped for lack of memory", rx.alloc_fail_count);
+
+    ncm_tx_stats_t tx;
+    ncm_tx_get_stats(&tx);
+    write_value(w, "gauge", "ncm_tx_queue_depth", "Frames waiting in the USB TX queue", tx.queue_depth);
+    write_value(w, "gauge", "ncm_tx_queue_high_water", "Most frames ever waiting in the USB TX queue", tx.queue_high_water);
+    write_value(w, "counter", "ncm_tx_frames_total", "Frames sent to the USB host", tx.frames_sent);
+    write_value(w, "counter", "ncm_tx_bytes_total", "Bytes sent to the USB host", tx.bytes_sent);
+    write_value(w, "counter", "ncm_tx_drains_total", "TX queue drain rounds", tx.drains);
+    write_value(w, "counter", "ncm_tx_backpressure_total", "Frames refused on a full TX queue", tx.backpressure_count);
+    write_value(w, "counter", "ncm_tx_drops_total", "Frames that never reached the USB host", tx.drop_count);
+
+    size_t cdc_pending = 0;
+    for (int i = 0; i < CDC_CHANNELS; i++) {
+        cdc_pending += tusb_cdc_rx_pending(i);
+    }
+    write_value(w, "gauge", "cdc_rx_ring_used_bytes", "Bytes waiting in the CDC-ACM RX rings", cdc_pending);
+}
+
+static esp_err_t metrics_get_handler(httpd_req_t *req)
+{
+    metrics_writer_t w = {
+        .req = req,
+        .buf = malloc(METRICS_OUT_BUFSIZE),
+    };
+    if (!w.buf) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+
+    for (int id = 0; id < METRIC_COUNTER_MAX; id++) {
+        write_value(&w, "counter", s_counter_desc[id].name, s_counter_desc[id].help, metrics_counter_get(id));
+    }
+    for (int id = 0; id < METRIC_HIST_MAX; id++) {
+        write_histogram(&w, id);
+    }
+    write_module_stats(&w);
+    writer_flush(&w);
+    free(w.buf);
+
+    if (w.err != ESP_OK) {
+        return w.err;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+esp_err_t metrics_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t metrics_get_uri = {
+        .uri = "/api/v1/metrics",
+        .method = HTTP_GET,
+        .handler = metrics_get_handler,
+    };
+    return httpd_register_uri_handler(server, &metrics_get_uri);
+}
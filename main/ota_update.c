@@ -0,0 +1,567 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Firmware update over the USB network link:
+ *
+ *     curl --data-binary @build/tusb_ncm.bin -H "X-Image-SHA256: $(sha256sum build/tusb_ncm.bin | cut -c1-64)" \
+ *          'http://192.168.4.1/api/v1/ota?reboot=1'
+ *
+ * The upload runs on its own task through an httpd async request, so GET /api/v1/ota can report progress
+ * meanwhile. The body is received into one of two buffers while a writer task hands the other one to
+ * esp_ota_write() and the SHA-256, so the network and the flash work at the same time. The image is written
+ * with sequential erases, so there is no long erase before the first byte is accepted. The new image only
+ * becomes the boot partition if the optional X-Image-SHA256 matches and esp_ota_end() validates it.
+ *
+ * The slots go through a small ops table: the OTA partitions with esp_ota_*, or on the Linux target files
+ * standing in for them, so the upload path can be tested on the host byte for byte.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "mbedtls/sha256.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+#if CONFIG_IDF_TARGET_LINUX
+#include <errno.h>
+#include <sys/stat.h>
+#include "esp_partition.h"
+#else
+#include "esp_system.h"
+#include "esp_ota_ops.h"
+#endif
+
+static const char *TAG = "OTA";
+
+#define OTA_BUF_SIZE        CONFIG_EXAMPLE_OTA_BUF_SIZE
+#define OTA_RECV_RETRIES    5
+#define OTA_REBOOT_DELAY_US (500 * 1000)
+#define OTA_TASK_STACK      4096
+#define OTA_TASK_PRIO       4
+
+typedef enum {
+    OTA_STATE_IDLE,
+    OTA_STATE_RECEIVING,
+    OTA_STATE_VERIFYING,
+    OTA_STATE_DONE,
+    OTA_STATE_FAILED,
+} ota_state_t;
+
+static const char *const s_state_names[] = { "idle", "receiving", "verifying", "done", "failed" };
+
+/* Slot seam: the upload only ever asks a backend to write one image into the next slot and boot from it */
+typedef struct {
+    const char *name;
+    const esp_partition_t *(*running)(void);
+    const esp_partition_t *(*next)(void);
+    esp_err_t (*begin)(const esp_partition_t *slot);
+    esp_err_t (*write)(const void *data, size_t len);
+    esp_err_t (*end)(void);     // validates the image
+    void (*abort)(void);
+    esp_err_t (*set_boot)(const esp_partition_t *slot);
+    void (*confirm)(void);      // keep the running image instead of rolling back
+    void (*restart)(void);
+} ota_slot_ops_t;
+
+#if !CONFIG_IDF_TARGET_LINUX
+static esp_ota_handle_t s_flash_handle;
+
+static const esp_partition_t *flash_slot_running(void)
+{
+    return esp_ota_get_running_partition();
+}
+
+static const esp_partition_t *flash_slot_next(void)
+{
+    return esp_ota_get_next_update_partition(NULL);
+}
+
+static esp_err_t flash_slot_begin(const esp_partition_t *slot)
+{
+    return esp_ota_begin(slot, OTA_WITH_SEQUENTIAL_WRITES, &s_flash_handle);
+}
+
+static esp_err_t flash_slot_write(const void *data, size_t len)
+{
+    return esp_ota_write(s_flash_handle, data, len);
+}
+
+static esp_err_t flash_slot_end(void)
+{
+    return esp_ota_end(s_flash_handle);
+}
+
+static void flash_slot_abort(void)
+{
+    esp_ota_abort(s_flash_handle);
+}
+
+static void flash_slot_confirm(void)
+{
+    esp_ota_img_states_t state;
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    if (esp_ota_get_state_partition(running, &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY) {
+        esp_ota_mark_app_valid_cancel_rollback();
+        ESP_LOGI(TAG, "Running image %s confirmed", running->label);
+    }
+}
+
+static const ota_slot_ops_t s_slots = {
+    .name = "flash",
+    .running = flash_slot_running,
+    .next = flash_slot_next,
+    .begin = flash_slot_begin,
+    .write = flash_slot_write,
+    .end = flash_slot_end,
+    .abort = flash_slot_abort,
+    .set_boot = esp_ota_set_boot_partition,
+    .confirm = flash_slot_confirm,
+    .restart = esp_restart,
+};
+#else
+#define OTA_FILE_DIR        "/tmp/ncm_ota"
+#define OTA_IMAGE_MAGIC     0xE9    // first byte of an ESP application image
+
+/* File-backed slots for the host: OTA_FILE_DIR/<label>.bin per slot, and the boot selection in OTA_FILE_DIR/boot */
+static const esp_partition_t s_file_slots[2] = {
+    {
+        .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_0,
+        .address = 0x10000, .size = 0x140000, .label = "ota_0",
+    },
+    {
+        .type = ESP_PARTITION_TYPE_APP, .subtype = ESP_PARTITION_SUBTYPE_APP_OTA_1,
+        .address = 0x150000, .size = 0x140000, .label = "ota_1",
+    },
+};
+
+static struct {
+    FILE *fp;
+    char path[64];
+    uint8_t first_byte;
+    size_t written;
+} s_file;
+
+static const esp_partition_t *file_slot_running(void)
+{
+    return &s_file_slots[0];
+}
+
+static const esp_partition_t *file_slot_next(void)
+{
+    return &s_file_slots[1];
+}
+
+static esp_err_t file_slot_begin(const esp_partition_t *slot)
+{
+    if (mkdir(OTA_FILE_DIR, 0755) != 0 && errno != EEXIST) {
+        return ESP_FAIL;
+    }
+    snprintf(s_file.path, sizeof(s_file.path), OTA_FILE_DIR "/%s.bin", slot->label);
+    s_file.fp = fopen(s_file.path, "wb");
+    s_file.written = 0;
+    return s_file.fp ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t file_slot_write(const void *data, size_t len)
+{
+    if (!s_file.written && len) {
+        s_file.first_byte = *(const uint8_t *)data;
+    }
+    if (fwrite(data, 1, len, s_file.fp) != len) {
+        return ESP_FAIL;
+    }
+    s_file.written += len;
+    return ESP_OK;
+}
+
+static esp_err_t file_slot_end(void)
+{
+    // What esp_ota_end() checks first: something was written and it starts like an application image
+    esp_err_t ret = s_file.written && s_file.first_byte == OTA_IMAGE_MAGIC ? ESP_OK : ESP_FAIL;
+    if (fclose(s_file.fp) != 0) {
+        ret = ESP_FAIL;
+    }
+    s_file.fp = NULL;
+    return ret;
+}
+
+static void file_slot_abort(void)
+{
+    // Like esp_ota_abort(), nothing of the half-written image survives
+    if (s_file.fp) {
+        fclose(s_file.fp);
+        s_file.fp = NULL;
+    }
+    remove(s_file.path);
+}
+
+static esp_err_t file_slot_set_boot(const esp_partition_t *slot)
+{
+    FILE *fp = fopen(OTA_FILE_DIR "/boot", "w");
+    if (!fp) {
+        return ESP_FAIL;
+    }
+    fprintf(fp, "%s\n", slot->label);
+    return fclose(fp) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static void file_slot_confirm(void)
+{
+}
+
+static void file_slot_restart(void)
+{
+    ESP_LOGI(TAG, "Restart requested, the host build keeps running");
+}
+
+static const ota_slot_ops_t s_slots = {
+    .name = "file",
+    .running = file_slot_running,
+    .next = file_slot_next,
+    .begin = file_slot_begin,
+    .write = file_slot_write,
+    .end = file_slot_end,
+    .abort = file_slot_abort,
+    .set_boot = file_slot_set_boot,
+    .confirm = file_slot_confirm,
+    .restart = file_slot_restart,
+};
+#endif
+
+/* One filled buffer on its way to the writer, len 0 marks the end of the body */
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} ota_chunk_t;
+
+static struct {
+    _Atomic int state;
+    _Atomic uint32_t received;
+    _Atomic uint32_t written;
+    uint32_t total;
+    int64_t start_us;
+    int64_t end_us;
+    const char *error;
+    bool reboot;
+    bool has_expected_sha;
+    uint8_t expected_sha[32];
+    const esp_partition_t *partition;
+    QueueHandle_t free_bufs;    // uint8_t *, empty buffers
+    QueueHandle_t filled;       // ota_chunk_t, receiver -> writer
+    TaskHandle_t receiver;
+    _Atomic bool write_failed;
+    mbedtls_sha256_context sha;
+    esp_timer_handle_t reboot_timer;
+} s_ota;
+
+static double ota_mb_per_s(uint32_t bytes)
+{
+    int64_t end = atomic_load(&s_ota.state) == OTA_STATE_RECEIVING ? esp_timer_get_time() : s_ota.end_us;
+    int64_t elapsed_us = end - s_ota.start_us;
+    return elapsed_us > 0 ? bytes / (double)elapsed_us : 0;    // bytes per us == MB/s
+}
+
+/* Writer task: flash and hash every filled buffer, then hand it back to the receiver */
+static void ota_writer_task(void *arg)
+{
+    ota_chunk_t chunk;
+    while (xQueueReceive(s_ota.filled, &chunk, portMAX_DELAY) == pdTRUE && chunk.len) {
+        if (!atomic_load(&s_ota.write_failed)) {
+            mbedtls_sha256_update(&s_ota.sha, chunk.buf, chunk.len);
+            esp_err_t err = s_slots.write(chunk.buf, chunk.len);
+            if (err == ESP_OK) {
+                atomic_fetch_add(&s_ota.written, chunk.len);
+            } else {
+                ESP_LOGE(TAG, "Writing to %s failed (%s)", s_ota.partition->label, esp_err_to_name(err));
+                atomic_store(&s_ota.write_failed, true);
+            }
+        }
+        xQueueSend(s_ota.free_bufs, &chunk.buf, portMAX_DELAY);
+    }
+    xTaskNotifyGive(s_ota.receiver);
+    vTaskDelete(NULL);
+}
+
+/* Fill buf with up to len bytes of the body, 0 when the client went away */
+static size_t recv_full(httpd_req_t *req, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    int retries = 0;
+    while (got < len) {
+        int n = httpd_req_recv(req, (char *)buf + got, len - got);
+        if (n == HTTPD_SOCK_ERR_TIMEOUT && ++retries <= OTA_RECV_RETRIES) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        got += n;
+        retries = 0;
+    }
+    return got;
+}
+
+static const char *receive_image(httpd_req_t *req)
+{
+    uint32_t remaining = s_ota.total;
+    uint32_t next_report = s_ota.total / 10;
+    while (remaining && !atomic_load(&s_ota.write_failed)) {
+        ota_chunk_t chunk;
+        xQueueReceive(s_ota.free_bufs, &chunk.buf, portMAX_DELAY);
+        chunk.len = recv_full(req, chunk.buf, remaining < OTA_BUF_SIZE ? remaining : OTA_BUF_SIZE);
+        if (!chunk.len) {
+            xQueueSend(s_ota.free_bufs, &chunk.buf, 0);
+            return "upload interrupted";
+        }
+        remaining -= chunk.len;
+        uint32_t received = atomic_fetch_add(&s_ota.received, chunk.len) + chunk.len;
+        xQueueSend(s_ota.filled, &chunk, portMAX_DELAY);
+        if (received >= next_report) {
+            ESP_LOGI(TAG, "%u%% (%u KB), %.2f MB/s", (unsigned)(received * 100ULL / s_ota.total),
+                     (unsigned)(received / 1024), ota_mb_per_s(received));
+            next_report += s_ota.total / 10;
+        }
+    }
+    return NULL;
+}
+
+static void reboot_cb(void *arg)
+{
+    s_slots.restart();
+}
+
+static void finish(httpd_req_t *req)
+{
+    s_ota.end_us = esp_timer_get_time();
+    atomic_store(&s_ota.state, s_ota.error ? OTA_STATE_FAILED : OTA_STATE_DONE);
+
+    if (s_ota.error) {
+        ESP_LOGE(TAG, "Update failed: %s", s_ota.error);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, s_ota.error);
+        return;
+    }
+    ESP_LOGI(TAG, "Image written to %s: %u bytes, %.2f MB/s", s_ota.partition->label, (unsigned)s_ota.total,
+             ota_mb_per_s(s_ota.total));
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_kv_str(&w, "partition", s_ota.partition->label);
+    json_kv_uint(&w, "bytes", s_ota.total);
+    json_kv_double(&w, "seconds", (s_ota.end_us - s_ota.start_us) / 1e6);
+    json_kv_double(&w, "mb_per_s", ota_mb_per_s(s_ota.total));
+    json_kv_bool(&w, "sha256_checked", s_ota.has_expected_sha);
+    json_kv_bool(&w, "rebooting", s_ota.reboot);
+    json_obj_end(&w);
+    json_writer_finish(&w);
+
+    if (s_ota.reboot) {
+        // Give the response time to reach the host
+        const esp_timer_create_args_t args = {
+            .callback = reboot_cb,
+            .name = "ota_reboot",
+        };
+        if (esp_timer_create(&args, &s_ota.reboot_timer) == ESP_OK) {
+            esp_timer_start_once(s_ota.reboot_timer, OTA_REBOOT_DELAY_US);
+        }
+    }
+}
+
+static void ota_receiver_task(void *arg)
+{
+    httpd_req_t *req = arg;
+    uint8_t *bufs[2] = {
+        mem_budget_alloc(MEM_OTA, OTA_BUF_SIZE, MEM_PLACE_ANY),
+        mem_budget_alloc(MEM_OTA, OTA_BUF_SIZE, MEM_PLACE_ANY),
+    };
+    s_ota.free_bufs = xQueueCreate(2, sizeof(uint8_t *));
+    s_ota.filled = xQueueCreate(2, sizeof(ota_chunk_t));
+    s_ota.receiver = xTaskGetCurrentTaskHandle();
+    atomic_store(&s_ota.write_failed, false);
+    mbedtls_sha256_init(&s_ota.sha);
+    mbedtls_sha256_starts(&s_ota.sha, 0);
+
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (bufs[0] && bufs[1] && s_ota.free_bufs && s_ota.filled) {
+        err = s_slots.begin(s_ota.partition);
+    }
+    if (err != ESP_OK) {
+        s_ota.error = "cannot start the update";
+    } else if (xTaskCreatePinnedToCore(ota_writer_task, "ota_writer", OTA_TASK_STACK, NULL, OTA_TASK_PRIO, NULL,
+                                       APP_TASK_CORE) != pdPASS) {
+        s_slots.abort();
+        s_ota.error = "cannot start the writer";
+    } else {
+        xQueueSend(s_ota.free_bufs, &bufs[0], 0);
+        xQueueSend(s_ota.free_bufs, &bufs[1], 0);
+        s_ota.error = receive_image(req);
+
+        // Let the writer drain, it owns both buffers until then
+        ota_chunk_t end = { 0 };
+        xQueueSend(s_ota.filled, &end, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!s_ota.error && atomic_load(&s_ota.write_failed)) {
+            s_ota.error = "flash write failed";
+        }
+
+        atomic_store(&s_ota.state, OTA_STATE_VERIFYING);
+        uint8_t sha[32];
+        mbedtls_sha256_finish(&s_ota.sha, sha);
+        if (!s_ota.error && s_ota.has_expected_sha && memcmp(sha, s_ota.expected_sha, sizeof(sha)) != 0) {
+            s_ota.error = "SHA-256 mismatch";
+        }
+        if (s_ota.error) {
+            s_slots.abort();
+        } else if (s_slots.end() != ESP_OK) {
+            s_ota.error = "image validation failed";
+        } else if (s_slots.set_boot(s_ota.partition) != ESP_OK) {
+            s_ota.error = "cannot select the new image";
+        }
+    }
+    mbedtls_sha256_free(&s_ota.sha);
+    finish(req);
+
+    mem_budget_free(MEM_OTA, bufs[0]);
+    mem_budget_free(MEM_OTA, bufs[1]);
+    if (s_ota.free_bufs) {
+        vQueueDelete(s_ota.free_bufs);
+    }
+    if (s_ota.filled) {
+        vQueueDelete(s_ota.filled);
+    }
+    httpd_req_async_handler_complete(req);
+    vTaskDelete(NULL);
+}
+
+static bool parse_sha256(const char *hex, uint8_t *out)
+{
+    if (strlen(hex) != 64) {
+        return false;
+    }
+    for (int i = 0; i < 32; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+    return true;
+}
+
+static esp_err_t ota_post_handler(httpd_req_t *req)
+{
+    int state = atomic_load(&s_ota.state);
+    if (state == OTA_STATE_RECEIVING || state == OTA_STATE_VERIFYING) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "An update is already running");
+    }
+    const esp_partition_t *partition = s_slots.next();
+    if (!partition) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No OTA partition");
+        return ESP_FAIL;
+    }
+    if (req->content_len == 0 || req->content_len > partition->size) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Image missing or larger than the OTA partition");
+        return ESP_FAIL;
+    }
+
+    char value[72];
+    s_ota.has_expected_sha = false;
+    if (httpd_req_get_hdr_value_str(req, "X-Image-SHA256", value, sizeof(value)) == ESP_OK) {
+        if (!parse_sha256(value, s_ota.expected_sha)) {
+            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "X-Image-SHA256 must be 64 hex digits");
+            return ESP_FAIL;
+        }
+        s_ota.has_expected_sha = true;
+    }
+    char query[32] = "";
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+    s_ota.reboot = httpd_query_key_value(query, "reboot", value, sizeof(value)) == ESP_OK && value[0] == '1';
+
+    s_ota.partition = partition;
+    s_ota.total = req->content_len;
+    s_ota.received = 0;
+    s_ota.written = 0;
+    s_ota.error = NULL;
+    s_ota.start_us = esp_timer_get_time();
+    atomic_store(&s_ota.state, OTA_STATE_RECEIVING);
+
+    httpd_req_t *async_req = NULL;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        atomic_store(&s_ota.state, OTA_STATE_IDLE);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server busy");
+        return ESP_FAIL;
+    }
+    if (xTaskCreatePinnedToCore(ota_receiver_task, "ota_receiver", OTA_TASK_STACK, async_req, OTA_TASK_PRIO, NULL,
+                                APP_TASK_CORE) != pdPASS) {
+        atomic_store(&s_ota.state, OTA_STATE_IDLE);
+        httpd_resp_send_err(async_req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server busy");
+        httpd_req_async_handler_complete(async_req);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "Receiving %u bytes into %s (%s)", (unsigned)s_ota.total, partition->label, s_slots.name);
+    return ESP_OK;
+}
+
+static esp_err_t ota_get_handler(httpd_req_t *req)
+{
+    const esp_partition_t *running = s_slots.running();
+    const esp_partition_t *next = s_slots.next();
+    int state = atomic_load(&s_ota.state);
+    uint32_t received = atomic_load(&s_ota.received);
+
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_kv_str(&w, "state", s_state_names[state]);
+    json_kv_str(&w, "running", running ? running->label : "");
+    json_kv_str(&w, "next", next ? next->label : "");
+    if (state != OTA_STATE_IDLE) {
+        json_kv_uint(&w, "total", s_ota.total);
+        json_kv_uint(&w, "received", received);
+        json_kv_uint(&w, "written", atomic_load(&s_ota.written));
+        json_kv_double(&w, "mb_per_s", ota_mb_per_s(received));
+    }
+    if (state == OTA_STATE_FAILED) {
+        json_kv_str(&w, "error", s_ota.error);
+    }
+    json_obj_end(&w);
+    return json_writer_finish(&w);
+}
+
+esp_err_t ota_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t ota_post_uri = {
+        .uri = "/api/v1/ota",
+        .method = HTTP_POST,
+        .handler = ota_post_handler,
+    };
+    httpd_uri_t ota_get_uri = {
+        .uri = "/api/v1/ota",
+        .method = HTTP_GET,
+        .handler = ota_get_handler,
+    };
+    esp_err_t ret = httpd_register_uri_handler(server, &ota_post_uri);
+    if (ret == ESP_OK) {
+        ret = httpd_register_uri_handler(server, &ota_get_uri);
+    }
+    return ret;
+}
+
+/* Once a freshly updated image got this far, keep it instead of rolling back on the next reset */
+void ota_confirm_running_image(void)
+{
+    s_slots.confirm();
+}
@@ -0,0 +1,354 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Packet capture tap on the USB-NCM interface, streamed as a pcap file from GET /api/v1/pcap:
+ *
+ *     curl -o ncm.pcap 'http://192.168.4.1/api/v1/pcap?seconds=10&port=2323&snaplen=128'
+ *
+ * While no capture runs, the tap costs one relaxed atomic load per frame. A capture allocates its ring
+ * (PSRAM with EXAMPLE_PSRAM_BUFFERS) and copies matching frames into it as ready-made pcap records. A streaming
+ * task then sends the records to the client as HTTP chunks. Producers never wait: a frame is dropped and
+ * counted when the ring is full or another producer holds it. Query parameters act as a small filter:
+ *
+ *     dir=rx|tx   ethertype=0x0806   ip=192.168.4.2   proto=6|17   port=N   snaplen=N   seconds=N
+ *
+ * Frames of the capture's own HTTP connection are always left out.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "byte_ring.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "PCAP";
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_LINKTYPE_ETH   1
+#define PCAP_MAX_SNAPLEN    1518
+#define PCAP_RING_SIZE      (CONFIG_EXAMPLE_PCAP_BUFFER_KB * 1024)
+#define PCAP_CHUNK_SIZE     1460
+#define PCAP_POLL_MS        100
+#define PCAP_TASK_STACK     3072
+#define PCAP_TASK_PRIO      4
+
+#define ETH_HDR_LEN         14
+#define ETHERTYPE_IPV4      0x0800
+#define ETHERTYPE_VLAN      0x8100
+#define IPPROTO_TCP_NUM     6
+#define IPPROTO_UDP_NUM     17
+
+_Static_assert((PCAP_RING_SIZE & (PCAP_RING_SIZE - 1)) == 0, "capture buffer size must be a power of two");
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+} pcap_file_hdr_t;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+} pcap_record_hdr_t;
+
+typedef struct {
+    uint8_t dir_mask;
+    uint16_t ethertype;     // 0: any
+    uint32_t ip;            // network order, 0: any
+    uint8_t ip_proto;       // 0: any
+    uint16_t port;          // TCP/UDP source or destination, 0: any
+    uint16_t exclude_port;  // the client port of the capture connection itself
+    uint16_t snaplen;
+} pcap_filter_t;
+
+static struct {
+    atomic_bool active;     // checked on every frame, everything else only matters while set
+    atomic_bool busy;       // a capture is running or being set up
+    SemaphoreHandle_t lock; // serialises the producers and guards the ring's lifetime
+    byte_ring_t ring;
+    uint8_t *storage;
+    pcap_filter_t filter;
+    TaskHandle_t task;
+    uint32_t seconds;       // stop after this long, 0: when the client goes away
+    uint32_t captured;
+    uint32_t ring_full_drops;
+    uint32_t busy_drops;
+} s_pcap;
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static bool frame_matches(const pcap_filter_t *f, pcap_dir_t dir, const uint8_t *frame, size_t len)
+{
+    if (!(f->dir_mask & dir) || len < ETH_HDR_LEN) {
+        return false;
+    }
+    size_t l3 = ETH_HDR_LEN;
+    uint16_t ethertype = rd16(frame + 12);
+    if (ethertype == ETHERTYPE_VLAN && len >= ETH_HDR_LEN + 4) {
+        ethertype = rd16(frame + 16);
+        l3 += 4;
+    }
+    if (f->ethertype && ethertype != f->ethertype) {
+        return false;
+    }
+    bool need_ip = f->ip || f->ip_proto || f->port || f->exclude_port;
+    if (!need_ip) {
+        return true;
+    }
+    if (ethertype != ETHERTYPE_IPV4 || len < l3 + 20) {
+        // Only the exclusion applies to non-IPv4 traffic
+        return !(f->ip || f->ip_proto || f->port);
+    }
+
+    const uint8_t *ip = frame + l3;
+    uint8_t proto = ip[9];
+    uint32_t src, dst;
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+    if (f->ip && src != f->ip && dst != f->ip) {
+        return false;
+    }
+    if (f->ip_proto && proto != f->ip_proto) {
+        return false;
+    }
+
+    size_t l4 = l3 + (ip[0] & 0x0f) * 4;
+    bool first_fragment = (rd16(ip + 6) & 0x1fff) == 0;
+    bool has_ports = (proto == IPPROTO_TCP_NUM || proto == IPPROTO_UDP_NUM) && first_fragment && len >= l4 + 4;
+    if (!has_ports) {
+        return !f->port;
+    }
+    uint16_t sport = rd16(frame + l4);
+    uint16_t dport = rd16(frame + l4 + 2);
+    if (f->exclude_port && proto == IPPROTO_TCP_NUM && (sport == f->exclude_port || dport == f->exclude_port)) {
+        return false;
+    }
+    return !f->port || sport == f->port || dport == f->port;
+}
+
+void pcap_capture_frame(pcap_dir_t dir, const void *frame, size_t len)
+{
+    if (!atomic_load_explicit(&s_pcap.active, memory_order_relaxed)) {
+        return;
+    }
+    if (xSemaphoreTake(s_pcap.lock, 0) != pdTRUE) {
+        s_pcap.busy_drops++;    // racy on purpose, close enough for a diagnostic counter
+        return;
+    }
+    if (atomic_load(&s_pcap.active) && frame_matches(&s_pcap.filter, dir, frame, len)) {
+        size_t incl = len < s_pcap.filter.snaplen ? len : s_pcap.filter.snaplen;
+        if (byte_ring_free(&s_pcap.ring) >= sizeof(pcap_record_hdr_t) + incl) {
+            int64_t now = esp_timer_get_time();
+            pcap_record_hdr_t rec = {
+                .ts_sec = now / 1000000,
+                .ts_usec = now % 1000000,
+                .incl_len = incl,
+                .orig_len = len,
+            };
+            byte_ring_write(&s_pcap.ring, &rec, sizeof(rec));
+            byte_ring_write(&s_pcap.ring, frame, incl);
+            s_pcap.captured++;
+            xTaskNotifyGive(s_pcap.task);
+        } else {
+            s_pcap.ring_full_drops++;
+        }
+    }
+    xSemaphoreGive(s_pcap.lock);
+}
+
+/* Move complete records from the ring into chunk, returns the number of bytes filled */
+static size_t fill_chunk(uint8_t *chunk)
+{
+    size_t len = 0;
+    pcap_record_hdr_t rec;
+    while (byte_ring_peek(&s_pcap.ring, &rec, sizeof(rec)) == sizeof(rec)) {
+        size_t total = sizeof(rec) + rec.incl_len;
+        if (byte_ring_used(&s_pcap.ring) < total || len + total > PCAP_CHUNK_SIZE + PCAP_MAX_SNAPLEN) {
+            break;
+        }
+        byte_ring_read(&s_pcap.ring, chunk + len, total);
+        len += total;
+        if (len >= PCAP_CHUNK_SIZE) {
+            break;
+        }
+    }
+    return len;
+}
+
+static void pcap_stop(void)
+{
+    atomic_store(&s_pcap.active, false);
+    // Wait for a producer that is still copying, then nobody can touch the ring any more
+    xSemaphoreTake(s_pcap.lock, portMAX_DELAY);
+    xSemaphoreGive(s_pcap.lock);
+    ESP_LOGI(TAG, "Capture done: %u frames, %u dropped on a full ring, %u dropped on contention",
+             (unsigned)s_pcap.captured, (unsigned)s_pcap.ring_full_drops, (unsigned)s_pcap.busy_drops);
+    mem_budget_free(MEM_PCAP, s_pcap.storage);
+    s_pcap.storage = NULL;
+}
+
+/* A capture with no matching traffic never sends, so a client that went away has to be noticed by polling */
+static bool client_gone(int fd)
+{
+    uint8_t byte;
+    int n = recv(fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void pcap_stream_task(void *arg)
+{
+    httpd_req_t *req = arg;
+    int64_t deadline = s_pcap.seconds ? esp_timer_get_time() + s_pcap.seconds * 1000000LL : 0;
+    uint8_t *chunk = malloc(PCAP_CHUNK_SIZE + PCAP_MAX_SNAPLEN + sizeof(pcap_record_hdr_t));
+
+    const pcap_file_hdr_t hdr = {
+        .magic = PCAP_MAGIC,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = s_pcap.filter.snaplen,
+        .network = PCAP_LINKTYPE_ETH,
+    };
+    httpd_resp_set_type(req, "application/vnd.tcpdump.pcap");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"ncm.pcap\"");
+    esp_err_t ret = chunk ? httpd_resp_send_chunk(req, (const char *)&hdr, sizeof(hdr)) : ESP_ERR_NO_MEM;
+
+    while (ret == ESP_OK) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(PCAP_POLL_MS));
+        size_t len;
+        while (ret == ESP_OK && (len = fill_chunk(chunk)) > 0) {
+            ret = httpd_resp_send_chunk(req, (const char *)chunk, len);
+        }
+        if (deadline && esp_timer_get_time() >= deadline) {
+            break;
+        }
+        if (ret == ESP_OK && client_gone(httpd_req_to_sockfd(req))) {
+            ESP_LOGI(TAG, "Client went away");
+            ret = ESP_FAIL;
+        }
+    }
+
+    pcap_stop();
+    if (ret == ESP_OK) {
+        httpd_resp_send_chunk(req, NULL, 0);
+    }
+    free(chunk);
+    httpd_req_async_handler_complete(req);
+    atomic_store(&s_pcap.busy, false);
+    vTaskDelete(NULL);
+}
+
+static uint32_t query_u32(const char *query, const char *key, uint32_t def)
+{
+    char value[16];
+    if (httpd_query_key_value(query, key, value, sizeof(value)) != ESP_OK) {
+        return def;
+    }
+    return strtoul(value, NULL, 0);
+}
+
+static void parse_filter(httpd_req_t *req, pcap_filter_t *f)
+{
+    char query[128] = "";
+    char value[16];
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+
+    f->dir_mask = PCAP_DIR_RX | PCAP_DIR_TX;
+    if (httpd_query_key_value(query, "dir", value, sizeof(value)) == ESP_OK) {
+        f->dir_mask = strcmp(value, "rx") == 0 ? PCAP_DIR_RX : strcmp(value, "tx") == 0 ? PCAP_DIR_TX : f->dir_mask;
+    }
+    f->ethertype = query_u32(query, "ethertype", 0);
+    f->ip = 0;
+    if (httpd_query_key_value(query, "ip", value, sizeof(value)) == ESP_OK) {
+        f->ip = inet_addr(value);
+    }
+    f->ip_proto = query_u32(query, "proto", 0);
+    f->port = query_u32(query, "port", 0);
+    uint32_t snaplen = query_u32(query, "snaplen", CONFIG_EXAMPLE_PCAP_SNAPLEN);
+    f->snaplen = snaplen && snaplen < PCAP_MAX_SNAPLEN ? snaplen : PCAP_MAX_SNAPLEN;
+    s_pcap.seconds = query_u32(query, "seconds", 0);
+
+    // Streaming the capture over NCM must not capture itself
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    f->exclude_port = 0;
+    if (getpeername(httpd_req_to_sockfd(req), (struct sockaddr *)&peer, &peer_len) == 0) {
+        f->exclude_port = ntohs(peer.sin_port);
+    }
+}
+
+static esp_err_t pcap_get_handler(httpd_req_t *req)
+{
+    if (atomic_exchange(&s_pcap.busy, true)) {
+        httpd_resp_set_status(req, "409 Conflict");
+        return httpd_resp_sendstr(req, "A capture is already running");
+    }
+
+    parse_filter(req, &s_pcap.filter);
+    s_pcap.storage = mem_budget_alloc(MEM_PCAP, PCAP_RING_SIZE, MEM_PLACE_ANY);
+    if (!s_pcap.storage) {
+        atomic_store(&s_pcap.busy, false);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory for capture buffer");
+        return ESP_FAIL;
+    }
+    byte_ring_init(&s_pcap.ring, s_pcap.storage, PCAP_RING_SIZE);
+    s_pcap.captured = 0;
+    s_pcap.ring_full_drops = 0;
+    s_pcap.busy_drops = 0;
+
+    httpd_req_t *async_req = NULL;
+    if (httpd_req_async_handler_begin(req, &async_req) != ESP_OK) {
+        goto err;
+    }
+    if (xTaskCreatePinnedToCore(pcap_stream_task, "pcap_stream", PCAP_TASK_STACK, async_req, PCAP_TASK_PRIO,
+                                &s_pcap.task, APP_TASK_CORE) != pdPASS) {
+        httpd_req_async_handler_complete(async_req);
+        goto err;
+    }
+    ESP_LOGI(TAG, "Capture started, snaplen %u", (unsigned)s_pcap.filter.snaplen);
+    atomic_store(&s_pcap.active, true);
+    return ESP_OK;
+
+err:
+    mem_budget_free(MEM_PCAP, s_pcap.storage);
+    s_pcap.storage = NULL;
+    atomic_store(&s_pcap.busy, false);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to start capture");
+    return ESP_FAIL;
+}
+
+esp_err_t pcap_register_handlers(httpd_handle_t server)
+{
+    s_pcap.lock = xSemaphoreCreateMutex();
+    if (!s_pcap.lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    httpd_uri_t pcap_get_uri = {
+        .uri = "/api/v1/pcap",
+        .method = HTTP_GET,
+        .handler = pcap_get_handler,
+    };
+    return httpd_register_uri_handler(server, &pcap_get_uri);
+}
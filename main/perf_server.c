@@ -0,0 +1,229 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Throughput endpoints for tuning the NCM netif, lwIP buffers and NTB counts from the host side:
+ *
+ *     iperf -c 192.168.4.1 -p 5001 -t 10                 TCP, host -> device
+ *     iperf -c 192.168.4.1 -p 5001 -u -b 50M -t 10       UDP, host -> device, lost datagrams are counted
+ *     nc 192.168.4.1 5002 | pv > /dev/null               TCP, device -> host
+ *
+ * The sinks discard everything they receive and the source sends a fixed pattern until the client goes away.
+ * One client per endpoint at a time. Each transfer is logged with its rate when it ends, and the byte and loss
+ * counters are also exported on /api/v1/metrics.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "PERF";
+
+#define PERF_SINK_PORT      CONFIG_EXAMPLE_PERF_SERVER_PORT
+#define PERF_SOURCE_PORT    (CONFIG_EXAMPLE_PERF_SERVER_PORT + 1)
+#define PERF_BUF_SIZE       (4 * 1460)
+#define PERF_UDP_IDLE_MS    1000
+#define PERF_TASK_STACK     3072
+#define PERF_TASK_PRIO      4
+
+/* Start of every iperf2 UDP datagram, a negative id marks the last one */
+typedef struct {
+    int32_t id;
+    uint32_t tv_sec;
+    uint32_t tv_usec;
+} perf_udp_hdr_t;
+
+static void log_transfer(const char *what, uint64_t bytes, int64_t start_us)
+{
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    if (elapsed_us <= 0) {
+        return;
+    }
+    ESP_LOGI(TAG, "%s: %llu bytes in %.2f s, %.2f Mbit/s", what, (unsigned long long)bytes, elapsed_us / 1e6,
+             bytes * 8.0 / elapsed_us);
+}
+
+static int create_socket(int type, uint16_t port)
+{
+    int fd = socket(AF_INET, type, type == SOCK_STREAM ? IPPROTO_TCP : IPPROTO_UDP);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || (type == SOCK_STREAM && listen(fd, 1) != 0)) {
+        ESP_LOGE(TAG, "Cannot bind port %u (errno %d)", port, errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void perf_tcp_sink_task(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    uint8_t *buf = malloc(PERF_BUF_SIZE);
+    while (buf) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        uint64_t bytes = 0;
+        int64_t start = esp_timer_get_time();
+        int n;
+        while ((n = recv(fd, buf, PERF_BUF_SIZE, 0)) > 0) {
+            bytes += n;
+            metrics_add(METRIC_PERF_RX_BYTES, n);
+        }
+        close(fd);
+        log_transfer("TCP sink", bytes, start);
+    }
+    ESP_LOGE(TAG, "No memory for the TCP sink");
+    vTaskDelete(NULL);
+}
+
+static void perf_tcp_source_task(void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+    uint8_t *buf = malloc(PERF_BUF_SIZE);
+    if (buf) {
+        for (int i = 0; i < PERF_BUF_SIZE; i++) {
+            buf[i] = '0' + i % 10;
+        }
+    }
+    while (buf) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        uint64_t bytes = 0;
+        int64_t start = esp_timer_get_time();
+        int n;
+        while ((n = send(fd, buf, PERF_BUF_SIZE, 0)) > 0) {
+            bytes += n;
+            metrics_add(METRIC_PERF_TX_BYTES, n);
+        }
+        close(fd);
+        log_transfer("TCP source", bytes, start);
+    }
+    ESP_LOGE(TAG, "No memory for the TCP source");
+    vTaskDelete(NULL);
+}
+
+/* One iperf2 UDP stream, from its first datagram to its last one or until the sender goes quiet */
+typedef struct {
+    bool active;
+    uint64_t bytes;
+    uint32_t datagrams;
+    uint32_t lost;
+    int32_t next_id;
+    int64_t start;
+} perf_udp_stream_t;
+
+static void udp_stream_end(perf_udp_stream_t *st)
+{
+    log_transfer("UDP sink", st->bytes, st->start);
+    ESP_LOGI(TAG, "UDP sink: %lu datagrams, %lu lost", (unsigned long)st->datagrams, (unsigned long)st->lost);
+    st->active = false;
+}
+
+static void perf_udp_sink_task(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    uint8_t *buf = malloc(PERF_BUF_SIZE);
+    struct timeval idle = {
+        .tv_sec = PERF_UDP_IDLE_MS / 1000,
+        .tv_usec = (PERF_UDP_IDLE_MS % 1000) * 1000,
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+
+    perf_udp_stream_t st = { 0 };
+    while (buf) {
+        int n = recv(fd, buf, PERF_BUF_SIZE, 0);
+        if (n <= 0) {
+            // Idle: the sender went away without a last datagram
+            if (st.active) {
+                udp_stream_end(&st);
+            }
+            continue;
+        }
+        int32_t id = -1;
+        bool last = false;
+        if ((size_t)n >= sizeof(perf_udp_hdr_t)) {
+            perf_udp_hdr_t hdr;
+            memcpy(&hdr, buf, sizeof(hdr));
+            id = ntohl(hdr.id);
+            last = id < 0;
+            id = last ? -id : id;
+        }
+        if (last && !st.active) {
+            continue;   // iperf2 resends the last datagram until it gets a server report, the stream is over
+        }
+        if (!st.active) {
+            st = (perf_udp_stream_t) {
+                .active = true,
+                .start = esp_timer_get_time(),
+            };
+        }
+        st.datagrams++;
+        st.bytes += n;
+        metrics_add(METRIC_PERF_RX_BYTES, n);
+        // A late datagram below next_id was already counted as lost and does not move next_id back
+        if (id > st.next_id) {
+            st.lost += id - st.next_id;
+            metrics_add(METRIC_PERF_UDP_LOST, id - st.next_id);
+        }
+        if (id >= st.next_id) {
+            st.next_id = id + 1;
+        }
+        if (last) {
+            udp_stream_end(&st);
+        }
+    }
+    ESP_LOGE(TAG, "No memory for the UDP sink");
+    vTaskDelete(NULL);
+}
+
+esp_err_t perf_server_start(void)
+{
+    const struct {
+        const char *name;
+        TaskFunction_t task;
+        int type;
+        uint16_t port;
+    } endpoints[] = {
+        { "perf_tcp_sink", perf_tcp_sink_task, SOCK_STREAM, PERF_SINK_PORT },
+        { "perf_tcp_src", perf_tcp_source_task, SOCK_STREAM, PERF_SOURCE_PORT },
+        { "perf_udp_sink", perf_udp_sink_task, SOCK_DGRAM, PERF_SINK_PORT },
+    };
+    for (size_t i = 0; i < sizeof(endpoints) / sizeof(endpoints[0]); i++) {
+        int fd = create_socket(endpoints[i].type, endpoints[i].port);
+        if (fd < 0) {
+            return ESP_FAIL;
+        }
+        if (xTaskCreatePinnedToCore(endpoints[i].task, endpoints[i].name, PERF_TASK_STACK, (void *)(intptr_t)fd,
+                                    PERF_TASK_PRIO, NULL, APP_TASK_CORE) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to create %s task", endpoints[i].name);
+            close(fd);
+            return ESP_FAIL;
+        }
+    }
+    ESP_LOGI(TAG, "Throughput sink on TCP/UDP port %d, source on TCP port %d", PERF_SINK_PORT, PERF_SOURCE_PORT);
+    return ESP_OK;
+}
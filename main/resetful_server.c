@@ -1,16 +1,27 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_vfs.h"
 #include "esp_log.h"
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
-#include "esp_random.h"
+#include "esp_timer.h"
 #include "esp_vfs.h"
-#include "cJSON.h"
+#include "mbedtls/sha256.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
 
 static const char *REST_TAG = "esp-rest";
 #define REST_CHECK(a, str, goto_tag, ...)                                              \
@@ -24,17 +35,87 @@ static const char *REST_TAG = "esp-rest";
     } while (0)
 
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + 128)
-#define SCRATCH_BUFSIZE (10240)
+#define SCRATCH_BUFSIZE (CONFIG_EXAMPLE_HTTPD_SCRATCH_SIZE)
+#define SCRATCH_WAIT_MS (1000)
+#define ASYNC_WORKER_STACK (4096)
+#define ASSET_MANIFEST "/asset-manifest.txt"
+#define ETAG_MAX (24)
+#define CACHE_CONTROL_IMMUTABLE "public, max-age=31536000, immutable"
+#define CACHE_CONTROL_REVALIDATE "no-cache"
+#define RESP_HDRS_MAX (320)
+#define SEND_CHUNK_SIZE (CONFIG_EXAMPLE_HTTPD_SEND_CHUNK_SIZE)
+#define FILE_READER_STACK (3072)
+#define FS_API_PREFIX "/api/v1/fs"
+
+/* Per-asset metadata produced at build time by tools/www_prepare.py */
+typedef struct {
+    char *uri;
+    char etag[17];
+    bool has_gzip;
+    bool immutable;
+} asset_meta_t;
+
+/* A read handed from an async worker to its file reader */
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} read_job_t;
+
+/* Double buffer of an async worker: the reader task fills one half while the worker sends the other */
+typedef struct {
+    char *buf[2];           // SEND_CHUNK_SIZE each
+    QueueHandle_t jobs;     // read_job_t, worker -> reader
+    QueueHandle_t done;     // ssize_t result of the read, reader -> worker
+} file_reader_t;
 
 typedef struct rest_server_context {
     char base_path[ESP_VFS_PATH_MAX + 1];
-    char scratch[SCRATCH_BUFSIZE];
+    QueueHandle_t scratch_pool;         // free SCRATCH_BUFSIZE buffers, one is taken per request
+    QueueHandle_t async_queue;          // requests handed over to the async workers
+    SemaphoreHandle_t worker_ready;     // counts idle async workers
+    SemaphoreHandle_t assets_lock;      // uploads change the asset table while workers read it
+    asset_meta_t *assets;   // sorted by uri
+    size_t asset_count;
 } rest_server_context_t;
 
+typedef struct {
+    rest_server_context_t *rest_context;
+    file_reader_t *reader;  // NULL with the flash image, assets are sent straight from the mapping
+} async_worker_t;
+
+/* Take a per-request buffer from the pool, NULL if none frees up in time */
+static char *scratch_get(rest_server_context_t *rest_context)
+{
+    char *buf = NULL;
+    xQueueReceive(rest_context->scratch_pool, &buf, pdMS_TO_TICKS(SCRATCH_WAIT_MS));
+    return buf;
+}
+
+static void scratch_put(rest_server_context_t *rest_context, char *buf)
+{
+    xQueueSend(rest_context->scratch_pool, &buf, 0);
+}
+
+/* Wrap an API handler so every call is counted and timed in the metrics registry */
+#define API_HANDLER_TIMED(handler)                                                     \
+    static esp_err_t handler##_timed(httpd_req_t *req)                                 \
+    {                                                                                  \
+        int64_t start = esp_timer_get_time();                                          \
+        esp_err_t ret = handler(req);                                                  \
+        metrics_inc(METRIC_HTTP_API_REQUESTS);                                         \
+        if (ret != ESP_OK) {                                                           \
+            metrics_inc(METRIC_HTTP_API_ERRORS);                                       \
+        }                                                                              \
+        metrics_observe_since(METRIC_HIST_HTTP_API, start);                            \
+        return ret;                                                                    \
+    }
+
 #define CHECK_FILE_EXTENSION(filename, ext) (strcasecmp(&filename[strlen(filename) - strlen(ext)], ext) == 0)
 
-/* Set HTTP response content type according to file extension */
-static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filepath)
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+/* HTTP response content type according to file extension */
+static const char *content_type_from_file(const char *filepath)
 {
     const char *type = "text/plain";
     if (CHECK_FILE_EXTENSION(filepath, ".html")) {
@@ -50,140 +131,1158 @@ static esp_err_t set_content_type_from_file(httpd_req_t *req, const char *filepa
     } else if (CHECK_FILE_EXTENSION(filepath, ".svg")) {
         type = "text/xml";
     }
-    return httpd_resp_set_type(req, type);
+    return type;
 }
+#endif
 
-/* Send HTTP response with the contents of the requested file */
-static esp_err_t rest_common_get_handler(httpd_req_t *req)
+/* Check whether a request header contains the given token (e.g. "gzip" in Accept-Encoding) */
+static bool req_hdr_contains(httpd_req_t *req, const char *field, const char *token)
+{
+    char value[128];
+    size_t len = httpd_req_get_hdr_value_len(req, field);
+    if (len == 0) {
+        return false;
+    }
+    /* A truncated value is still good enough for a substring match */
+    httpd_req_get_hdr_value_str(req, field, value, sizeof(value));
+    return strstr(value, token) != NULL;
+}
+
+/*
+ * Static assets write their response head themselves: httpd can only stream a body with chunked encoding,
+ * and a Content-Length is what lets clients show progress and resume with a Range request.
+ */
+typedef struct {
+    char buf[RESP_HDRS_MAX];
+    size_t len;
+} resp_hdrs_t;
+
+static void hdrs_add(resp_hdrs_t *h, const char *field, const char *value)
+{
+    int n = snprintf(h->buf + h->len, sizeof(h->buf) - h->len, "%s: %s\r\n", field, value);
+    if (n > 0 && (size_t)n < sizeof(h->buf) - h->len) {
+        h->len += n;
+    } else {
+        ESP_LOGW(REST_TAG, "Dropped response header %s", field);
+    }
+}
+
+static esp_err_t send_all(httpd_req_t *req, const char *buf, size_t len)
+{
+    while (len) {
+        int sent = httpd_send(req, buf, len);
+        if (sent <= 0) {
+            return ESP_FAIL;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+/* Send status line and headers, content_length < 0 leaves the Content-Length out */
+static esp_err_t send_head(httpd_req_t *req, const char *status, const char *type, ssize_t content_length,
+                           const resp_hdrs_t *h)
+{
+    char head[RESP_HDRS_MAX + 128];
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\n", status);
+    if (type) {
+        n += snprintf(head + n, sizeof(head) - n, "Content-Type: %s\r\n", type);
+    }
+    if (content_length >= 0) {
+        n += snprintf(head + n, sizeof(head) - n, "Content-Length: %ld\r\n", (long)content_length);
+    }
+    n += snprintf(head + n, sizeof(head) - n, "%.*s\r\n", (int)h->len, h->buf);
+    return send_all(req, head, n);
+}
+
+/* Add ETag, Cache-Control and Vary for a known asset. Returns true when a 304 has been sent instead of the body */
+static bool send_cache_headers(httpd_req_t *req, resp_hdrs_t *h, const char *etag_hex, bool has_gzip, bool immutable,
+                               bool send_gzip, char *etag, size_t etag_size)
+{
+    /* Strong ETags must differ between the plain and the gzip representation */
+    snprintf(etag, etag_size, "\"%.16s%s\"", etag_hex, send_gzip ? "-gz" : "");
+    hdrs_add(h, "ETag", etag);
+    hdrs_add(h, "Cache-Control", immutable ? CACHE_CONTROL_IMMUTABLE : CACHE_CONTROL_REVALIDATE);
+    if (has_gzip) {
+        hdrs_add(h, "Vary", "Accept-Encoding");
+    }
+    if (req_hdr_contains(req, "If-None-Match", etag)) {
+        send_head(req, "304 Not Modified", NULL, -1, h);
+        metrics_inc(METRIC_HTTP_NOT_MODIFIED);
+        return true;
+    }
+    return false;
+}
+
+typedef enum {
+    RANGE_NONE,             // send the whole representation
+    RANGE_OK,
+    RANGE_UNSATISFIABLE,
+} range_result_t;
+
+/*
+ * Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range. Multiple ranges, malformed ones
+ * and an If-Range that does not match the current ETag all fall back to the whole representation.
+ */
+static range_result_t parse_range(httpd_req_t *req, size_t size, const char *etag, size_t *start, size_t *len)
+{
+    char value[64];
+    if (httpd_req_get_hdr_value_str(req, "Range", value, sizeof(value)) != ESP_OK) {
+        return RANGE_NONE;
+    }
+    if (httpd_req_get_hdr_value_len(req, "If-Range")) {
+        char if_range[ETAG_MAX];
+        if (!etag || httpd_req_get_hdr_value_str(req, "If-Range", if_range, sizeof(if_range)) != ESP_OK ||
+                strcmp(if_range, etag) != 0) {
+            return RANGE_NONE;
+        }
+    }
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',')) {
+        return RANGE_NONE;
+    }
+
+    const char *p = value + 6;
+    char *end;
+    if (*p == '-') {
+        unsigned long suffix = strtoul(p + 1, &end, 10);
+        if (end == p + 1 || *end) {
+            return RANGE_NONE;
+        }
+        if (suffix == 0 || size == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *len = suffix < size ? suffix : size;
+        *start = size - *len;
+        return RANGE_OK;
+    }
+    unsigned long first = strtoul(p, &end, 10);
+    if (end == p || *end != '-') {
+        return RANGE_NONE;
+    }
+    p = end + 1;
+    unsigned long last = size ? size - 1 : 0;
+    if (*p) {
+        last = strtoul(p, &end, 10);
+        if (*end || last < first) {
+            return RANGE_NONE;
+        }
+    }
+    if (first >= size) {
+        return RANGE_UNSATISFIABLE;
+    }
+    if (last >= size) {
+        last = size - 1;
+    }
+    *start = first;
+    *len = last - first + 1;
+    return RANGE_OK;
+}
+
+/*
+ * Pick the status for a body of size bytes and add Accept-Ranges / Content-Range. Returns NULL after answering
+ * an unsatisfiable range with 416, otherwise the status line, with *start and *len set to the bytes to send.
+ */
+static const char *select_range(httpd_req_t *req, resp_hdrs_t *h, size_t size, const char *etag,
+                                size_t *start, size_t *len)
+{
+    char content_range[48];
+    hdrs_add(h, "Accept-Ranges", "bytes");
+    switch (parse_range(req, size, etag, start, len)) {
+    case RANGE_OK:
+        snprintf(content_range, sizeof(content_range), "bytes %lu-%lu/%lu",
+                 (unsigned long)*start, (unsigned long)(*start + *len - 1), (unsigned long)size);
+        hdrs_add(h, "Content-Range", content_range);
+        metrics_inc(METRIC_HTTP_RANGE_REQUESTS);
+        return "206 Partial Content";
+    case RANGE_UNSATISFIABLE:
+        snprintf(content_range, sizeof(content_range), "bytes */%lu", (unsigned long)size);
+        hdrs_add(h, "Content-Range", content_range);
+        send_head(req, "416 Range Not Satisfiable", NULL, 0, h);
+        return NULL;
+    default:
+        *start = 0;
+        *len = size;
+        return "200 OK";
+    }
+}
+
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+/* Send an asset straight from the memory-mapped www image */
+static esp_err_t send_image_asset(httpd_req_t *req, const char *uri)
+{
+    char etag[ETAG_MAX];
+    resp_hdrs_t hdrs = { .len = 0 };
+    www_image_asset_t asset;
+    if (!www_image_find(uri, &asset)) {
+        ESP_LOGE(REST_TAG, "No such asset : %s", uri);
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+        return ESP_FAIL;
+    }
+
+    bool send_gzip = asset.gz_data && req_hdr_contains(req, "Accept-Encoding", "gzip");
+    if (send_cache_headers(req, &hdrs, asset.etag, asset.gz_data, asset.immutable, send_gzip, etag, sizeof(etag))) {
+        return ESP_OK;
+    }
+    const char *data = asset.data;
+    size_t size = asset.len;
+    if (send_gzip) {
+        hdrs_add(&hdrs, "Content-Encoding", "gzip");
+        data = asset.gz_data;
+        size = asset.gz_len;
+    }
+    size_t start, len;
+    const char *status = select_range(req, &hdrs, size, etag, &start, &len);
+    if (!status) {
+        return ESP_OK;
+    }
+    if (send_head(req, status, asset.content_type, len, &hdrs) != ESP_OK ||
+            send_all(req, data + start, len) != ESP_OK) {
+        ESP_LOGE(REST_TAG, "Sending %s failed", uri);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+#else
+static int asset_meta_cmp(const void *key, const void *elem)
+{
+    return strcmp((const char *)key, ((const asset_meta_t *)elem)->uri);
+}
+
+/* Load the asset manifest written next to the web assets, missing manifest just disables caching */
+static void load_asset_manifest(rest_server_context_t *rest_context)
 {
     char filepath[FILE_PATH_MAX];
+    strlcpy(filepath, rest_context->base_path, sizeof(filepath));
+    strlcat(filepath, ASSET_MANIFEST, sizeof(filepath));
+    FILE *f = fopen(filepath, "r");
+    if (!f) {
+        ESP_LOGW(REST_TAG, "No asset manifest at %s, serving without ETag/Cache-Control", filepath);
+        return;
+    }
 
-    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    char line[FILE_PATH_MAX + 32];
+    size_t count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        count++;
+    }
+    rest_context->assets = calloc(count, sizeof(asset_meta_t));
+    if (!rest_context->assets) {
+        ESP_LOGE(REST_TAG, "No memory for asset manifest");
+        fclose(f);
+        return;
+    }
+
+    rewind(f);
+    char uri[FILE_PATH_MAX];
+    int has_gzip, immutable;
+    while (rest_context->asset_count < count && fgets(line, sizeof(line), f)) {
+        asset_meta_t *meta = &rest_context->assets[rest_context->asset_count];
+        if (sscanf(line, "%127s %16s %d %d", uri, meta->etag, &has_gzip, &immutable) != 4) {
+            continue;
+        }
+        meta->uri = strdup(uri);
+        if (!meta->uri) {
+            break;
+        }
+        meta->has_gzip = has_gzip;
+        meta->immutable = immutable;
+        rest_context->asset_count++;
+    }
+    fclose(f);
+    ESP_LOGI(REST_TAG, "Loaded %u asset entries", (unsigned)rest_context->asset_count);
+}
+
+/* Copy the metadata of uri into out, returns NULL if the asset is unknown. out->uri is not set */
+static const asset_meta_t *find_asset_meta(rest_server_context_t *rest_context, const char *uri, asset_meta_t *out)
+{
+    const asset_meta_t *meta = NULL;
+    xSemaphoreTake(rest_context->assets_lock, portMAX_DELAY);
+    if (rest_context->asset_count) {
+        meta = bsearch(uri, rest_context->assets, rest_context->asset_count, sizeof(asset_meta_t), asset_meta_cmp);
+    }
+    if (meta) {
+        *out = *meta;
+        out->uri = NULL;
+    }
+    xSemaphoreGive(rest_context->assets_lock);
+    return meta ? out : NULL;
+}
+
+/* Write the asset table back to the manifest so uploaded assets keep their ETags, called with assets_lock held */
+static void save_asset_manifest(const rest_server_context_t *rest_context)
+{
+    char filepath[FILE_PATH_MAX];
     strlcpy(filepath, rest_context->base_path, sizeof(filepath));
-    if (req->uri[strlen(req->uri) - 1] == '/') {
-        strlcat(filepath, "/index.html", sizeof(filepath));
+    strlcat(filepath, ASSET_MANIFEST, sizeof(filepath));
+    FILE *f = fopen(filepath, "w");
+    if (!f) {
+        ESP_LOGE(REST_TAG, "Failed to update the asset manifest");
+        return;
+    }
+    for (size_t i = 0; i < rest_context->asset_count; i++) {
+        const asset_meta_t *meta = &rest_context->assets[i];
+        fprintf(f, "%s %s %d %d\n", meta->uri, meta->etag, meta->has_gzip, meta->immutable);
+    }
+    fclose(f);
+}
+
+/* Give uri a new ETag after an upload, or forget it when etag_hex is NULL */
+static void update_asset_meta(rest_server_context_t *rest_context, const char *uri, const char *etag_hex)
+{
+    xSemaphoreTake(rest_context->assets_lock, portMAX_DELAY);
+    size_t lo = 0, hi = rest_context->asset_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (strcmp(rest_context->assets[mid].uri, uri) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    asset_meta_t *meta = &rest_context->assets[lo];
+    bool found = lo < rest_context->asset_count && strcmp(meta->uri, uri) == 0;
+    size_t tail = rest_context->asset_count - lo - found;
+
+    if (!etag_hex) {
+        if (!found) {
+            goto out;
+        }
+        free(meta->uri);
+        memmove(meta, meta + 1, tail * sizeof(asset_meta_t));
+        rest_context->asset_count--;
     } else {
-        strlcat(filepath, req->uri, sizeof(filepath));
+        if (!found) {
+            char *copy = strdup(uri);
+            asset_meta_t *assets = copy ? realloc(rest_context->assets,
+                                                  (rest_context->asset_count + 1) * sizeof(asset_meta_t)) : NULL;
+            if (!assets) {
+                ESP_LOGE(REST_TAG, "No memory for asset entry %s", uri);
+                free(copy);
+                goto out;
+            }
+            rest_context->assets = assets;
+            meta = &assets[lo];
+            memmove(meta + 1, meta, tail * sizeof(asset_meta_t));
+            meta->uri = copy;
+            rest_context->asset_count++;
+        }
+        strlcpy(meta->etag, etag_hex, sizeof(meta->etag));
+        /* The build-time .gz variant is gone and the name no longer promises fixed content */
+        meta->has_gzip = false;
+        meta->immutable = false;
+    }
+    save_asset_manifest(rest_context);
+out:
+    xSemaphoreGive(rest_context->assets_lock);
+}
+
+static void file_reader_task(void *arg)
+{
+    file_reader_t *reader = (file_reader_t *)arg;
+    read_job_t job;
+    while (1) {
+        if (xQueueReceive(reader->jobs, &job, portMAX_DELAY) == pdTRUE) {
+            ssize_t n = read(job.fd, job.buf, job.len);
+            xQueueSend(reader->done, &n, portMAX_DELAY);
+        }
+    }
+}
+
+static void file_reader_submit(file_reader_t *reader, int fd, char *buf, size_t len)
+{
+    read_job_t job = {
+        .fd = fd,
+        .buf = buf,
+        .len = len < SEND_CHUNK_SIZE ? len : SEND_CHUNK_SIZE,
+    };
+    xQueueSend(reader->jobs, &job, portMAX_DELAY);
+}
+
+/* Stream len bytes from fd, reading the next chunk while the current one is being sent */
+static esp_err_t stream_file_double_buffered(httpd_req_t *req, file_reader_t *reader, int fd, size_t len)
+{
+    int cur = 0;
+    file_reader_submit(reader, fd, reader->buf[cur], len);
+    while (len) {
+        ssize_t n;
+        xQueueReceive(reader->done, &n, portMAX_DELAY);
+        if (n <= 0 || (size_t)n > len) {
+            return ESP_FAIL;
+        }
+        len -= n;
+        if (len) {
+            file_reader_submit(reader, fd, reader->buf[cur ^ 1], len);
+        }
+        if (send_all(req, reader->buf[cur], n) != ESP_OK) {
+            if (len) {
+                // The reader still owns the other buffer and the file until its read is done
+                xQueueReceive(reader->done, &n, portMAX_DELAY);
+            }
+            return ESP_FAIL;
+        }
+        cur ^= 1;
+    }
+    return ESP_OK;
+}
+
+/* Stream len bytes from fd through a single scratch buffer, for transfers served on the httpd task */
+static esp_err_t stream_file_inline(httpd_req_t *req, rest_server_context_t *rest_context, int fd, size_t len)
+{
+    char *chunk = scratch_get(rest_context);
+    if (!chunk) {
+        return ESP_FAIL;
+    }
+    esp_err_t ret = ESP_OK;
+    while (len && ret == ESP_OK) {
+        ssize_t n = read(fd, chunk, len < SCRATCH_BUFSIZE ? len : SCRATCH_BUFSIZE);
+        if (n <= 0) {
+            ret = ESP_FAIL;
+            break;
+        }
+        len -= n;
+        ret = send_all(req, chunk, n);
+    }
+    scratch_put(rest_context, chunk);
+    return ret;
+}
+
+/* Send an asset from the filesystem mounted at base_path */
+static esp_err_t send_file_asset(httpd_req_t *req, rest_server_context_t *rest_context, file_reader_t *reader,
+                                 const char *uri)
+{
+    char filepath[FILE_PATH_MAX];
+    char etag[ETAG_MAX];
+    resp_hdrs_t hdrs = { .len = 0 };
+
+    strlcpy(filepath, rest_context->base_path, sizeof(filepath));
+    strlcat(filepath, uri, sizeof(filepath));
+
+    asset_meta_t found;
+    const asset_meta_t *meta = find_asset_meta(rest_context, uri, &found);
+    bool send_gzip = meta && meta->has_gzip && req_hdr_contains(req, "Accept-Encoding", "gzip");
+    if (meta && send_cache_headers(req, &hdrs, meta->etag, meta->has_gzip, meta->immutable, send_gzip, etag, sizeof(etag))) {
+        return ESP_OK;
+    }
+
+    const char *type = content_type_from_file(filepath);
+    if (send_gzip) {
+        strlcat(filepath, ".gz", sizeof(filepath));
+        hdrs_add(&hdrs, "Content-Encoding", "gzip");
     }
+
     int fd = open(filepath, O_RDONLY, 0);
-    if (fd == -1) {
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
         ESP_LOGE(REST_TAG, "Failed to open file : %s", filepath);
+        if (fd != -1) {
+            close(fd);
+        }
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to read existing file");
         return ESP_FAIL;
     }
 
-    set_content_type_from_file(req, filepath);
-
-    char *chunk = rest_context->scratch;
-    ssize_t read_bytes;
-    do {
-        /* Read file in chunks into the scratch buffer */
-        read_bytes = read(fd, chunk, SCRATCH_BUFSIZE);
-        if (read_bytes == -1) {
-            ESP_LOGE(REST_TAG, "Failed to read file : %s", filepath);
-        } else if (read_bytes > 0) {
-            /* Send the buffer contents as HTTP response chunk */
-            if (httpd_resp_send_chunk(req, chunk, read_bytes) != ESP_OK) {
-                close(fd);
-                ESP_LOGE(REST_TAG, "File sending failed!");
-                /* Abort sending file */
-                httpd_resp_sendstr_chunk(req, NULL);
-                /* Respond with 500 Internal Server Error */
-                httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send file");
-                return ESP_FAIL;
-            }
-        }
-    } while (read_bytes > 0);
-    /* Close file after sending complete */
+    size_t start, len;
+    const char *status = select_range(req, &hdrs, st.st_size, meta ? etag : NULL, &start, &len);
+    if (!status) {
+        close(fd);
+        return ESP_OK;
+    }
+    esp_err_t ret = ESP_FAIL;
+    if ((start == 0 || lseek(fd, start, SEEK_SET) == (off_t)start) &&
+            send_head(req, status, type, len, &hdrs) == ESP_OK) {
+        ret = reader ? stream_file_double_buffered(req, reader, fd, len) : stream_file_inline(req, rest_context, fd, len);
+    }
     close(fd);
+    if (ret != ESP_OK) {
+        /* The head may already be out, httpd closes the connection so the client sees a short body */
+        ESP_LOGE(REST_TAG, "File sending failed : %s", filepath);
+        return ESP_FAIL;
+    }
     ESP_LOGI(REST_TAG, "File sending complete");
-    /* Respond with an empty chunk to signal HTTP response completion */
-    httpd_resp_send_chunk(req, NULL, 0);
     return ESP_OK;
 }
+#endif
 
-/* Simple handler for light brightness control */
-static esp_err_t light_brightness_post_handler(httpd_req_t *req)
+/* Send HTTP response with the contents of the requested file, reader is NULL on the httpd task */
+static esp_err_t send_static_asset(httpd_req_t *req, file_reader_t *reader)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    int64_t start = esp_timer_get_time();
+    const char *uri = req->uri;
+    if (uri[strlen(uri) - 1] == '/') {
+        uri = "/index.html";
+    }
+    metrics_inc(METRIC_HTTP_STATIC_REQUESTS);
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    (void)rest_context;
+    (void)reader;
+    esp_err_t ret = send_image_asset(req, uri);
+#else
+    esp_err_t ret = send_file_asset(req, rest_context, reader, uri);
+#endif
+    metrics_observe_since(METRIC_HIST_HTTP_STATIC, start);
+    if (ret == ESP_OK) {
+        boot_phase_first_request();
+    }
+    return ret;
+}
+
+static void rest_async_worker_task(void *arg)
+{
+    async_worker_t *worker = (async_worker_t *)arg;
+    rest_server_context_t *rest_context = worker->rest_context;
+    while (1) {
+        xSemaphoreGive(rest_context->worker_ready);
+        httpd_req_t *req = NULL;
+        if (xQueueReceive(rest_context->async_queue, &req, portMAX_DELAY) == pdTRUE) {
+            metrics_inc(METRIC_HTTP_STATIC_ASYNC);
+            send_static_asset(req, worker->reader);
+            if (httpd_req_async_handler_complete(req) != ESP_OK) {
+                ESP_LOGE(REST_TAG, "Failed to complete async request");
+            }
+        }
+    }
+}
+
+/* Hand file transfers over to an async worker so the httpd task stays free for API calls */
+static esp_err_t rest_common_get_handler(httpd_req_t *req)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    if (xSemaphoreTake(rest_context->worker_ready, 0) == pdTRUE) {
+        httpd_req_t *async_req = NULL;
+        if (httpd_req_async_handler_begin(req, &async_req) == ESP_OK) {
+            if (xQueueSend(rest_context->async_queue, &async_req, 0) == pdTRUE) {
+                return ESP_OK;
+            }
+            httpd_req_async_handler_complete(async_req);
+        }
+        xSemaphoreGive(rest_context->worker_ready);
+    }
+    ESP_LOGD(REST_TAG, "No idle worker, serving %s inline", req->uri);
+    return send_static_asset(req, NULL);
+}
+
+/* Receive the whole request body into a scratch buffer, sends the error response itself on failure */
+static char *recv_body(httpd_req_t *req, rest_server_context_t *rest_context)
 {
     int total_len = req->content_len;
     int cur_len = 0;
-    char *buf = ((rest_server_context_t *)(req->user_ctx))->scratch;
     int received = 0;
     if (total_len >= SCRATCH_BUFSIZE) {
         /* Respond with 500 Internal Server Error */
         httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "content too long");
-        return ESP_FAIL;
+        return NULL;
+    }
+    char *buf = scratch_get(rest_context);
+    if (!buf) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server busy");
+        return NULL;
     }
     while (cur_len < total_len) {
-        received = httpd_req_recv(req, buf + cur_len, total_len);
+        received = httpd_req_recv(req, buf + cur_len, total_len - cur_len);
         if (received <= 0) {
+            scratch_put(rest_context, buf);
             /* Respond with 500 Internal Server Error */
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to post control value");
-            return ESP_FAIL;
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to receive request body");
+            return NULL;
         }
         cur_len += received;
     }
-    buf[total_len] = '\0';
+    return buf;
+}
+
+/*
+ * API operations, shared by the single endpoints and /api/v1/batch. An operation validates its arguments
+ * first and either returns why it failed without writing anything, or writes key (if not NULL) and its result.
+ */
+typedef const char *(*api_op_fn_t)(json_span_t args, json_writer_t *w, const char *key);
+
+static const json_field_t s_light_fields[] = {
+    JSON_FIELD_INT(light_rgb_t, red, 0, 255, JSON_REQUIRED),
+    JSON_FIELD_INT(light_rgb_t, green, 0, 255, JSON_REQUIRED),
+    JSON_FIELD_INT(light_rgb_t, blue, 0, 255, JSON_REQUIRED),
+};
+
+static const char *op_light_set(json_span_t args, json_writer_t *w, const char *key)
+{
+    light_rgb_t cmd;
+    const char *err = json_decode(args.ptr, args.len, s_light_fields, sizeof(s_light_fields) / sizeof(s_light_fields[0]), &cmd);
+    if (err) {
+        return err;
+    }
+    // Only posts to the light engine's mailbox, a newer colour replaces this one if it is not applied yet
+    light_engine_post(cmd);
+    if (key) {
+        json_key(w, key);
+        json_null(w);
+    }
+    return NULL;
+}
+
+static const char *op_light_get(json_span_t args, json_writer_t *w, const char *key)
+{
+    if (key) {
+        json_key(w, key);
+    }
+    light_engine_write_state(w);
+    return NULL;
+}
+
+static const char *op_system_info(json_span_t args, json_writer_t *w, const char *key)
+{
+    esp_chip_info_t chip_info;
+    esp_chip_info(&chip_info);
+    if (key) {
+        json_key(w, key);
+    }
+    json_obj_begin(w);
+    json_kv_str(w, "version", IDF_VER);
+    json_kv_int(w, "cores", chip_info.cores);
+    json_obj_end(w);
+    return NULL;
+}
 
-    cJSON *root = cJSON_Parse(buf);
-    int red = cJSON_GetObjectItem(root, "red")->valueint;
-    int green = cJSON_GetObjectItem(root, "green")->valueint;
-    int blue = cJSON_GetObjectItem(root, "blue")->valueint;
-    ESP_LOGI(REST_TAG, "Light control: red = %d, green = %d, blue = %d", red, green, blue);
-    cJSON_Delete(root);
+static const char *op_temperature(json_span_t args, json_writer_t *w, const char *key)
+{
+    if (key) {
+        json_key(w, key);
+    }
+    json_obj_begin(w);
+    json_kv_double(w, "raw", telemetry_read_temperature());
+    json_obj_end(w);
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    api_op_fn_t fn;
+} s_api_ops[] = {
+    { "light.set", op_light_set },
+    { "light.get", op_light_get },
+    { "system.info", op_system_info },
+    { "temp.read", op_temperature },
+};
+
+/* Simple handler for light brightness control */
+static esp_err_t light_brightness_post_handler(httpd_req_t *req)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    char *buf = recv_body(req, rest_context);
+    if (!buf) {
+        return ESP_FAIL;
+    }
+    const char *err = op_light_set((json_span_t) { buf, req->content_len }, NULL, NULL);
+    scratch_put(rest_context, buf);
+    if (err) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, err);
+        return ESP_FAIL;
+    }
     httpd_resp_sendstr(req, "Post control value successfully");
     return ESP_OK;
 }
+API_HANDLER_TIMED(light_brightness_post_handler)
 
 /* Simple handler for getting system handler */
 static esp_err_t system_info_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "application/json");
-    cJSON *root = cJSON_CreateObject();
-    esp_chip_info_t chip_info;
-    esp_chip_info(&chip_info);
-    cJSON_AddStringToObject(root, "version", IDF_VER);
-    cJSON_AddNumberToObject(root, "cores", chip_info.cores);
-    const char *sys_info = cJSON_Print(root);
-    httpd_resp_sendstr(req, sys_info);
-    free((void *)sys_info);
-    cJSON_Delete(root);
-    return ESP_OK;
+    json_writer_t w;
+    json_writer_init(&w, req);
+    op_system_info((json_span_t) { 0 }, &w, NULL);
+    return json_writer_finish(&w);
 }
+API_HANDLER_TIMED(system_info_get_handler)
 
 /* Simple handler for getting temperature data */
 static esp_err_t temperature_data_get_handler(httpd_req_t *req)
 {
-    httpd_resp_set_type(req, "application/json");
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddNumberToObject(root, "raw", esp_random() % 20);
-    const char *sys_info = cJSON_Print(root);
-    httpd_resp_sendstr(req, sys_info);
-    free((void *)sys_info);
-    cJSON_Delete(root);
+    json_writer_t w;
+    json_writer_init(&w, req);
+    op_temperature((json_span_t) { 0 }, &w, NULL);
+    return json_writer_finish(&w);
+}
+API_HANDLER_TIMED(temperature_data_get_handler)
+
+/* One element of the /api/v1/batch request array */
+typedef struct {
+    json_span_t op;         // still encoded, so a name of any length gets its own "unknown op" result
+    json_span_t args;
+} batch_item_t;
+
+static const json_field_t s_batch_fields[] = {
+    JSON_FIELD_RAW(batch_item_t, op, JSON_REQUIRED),
+    JSON_FIELD_RAW(batch_item_t, args, JSON_OPTIONAL),
+};
+
+static const char *run_batch_item(const batch_item_t *item, json_writer_t *w)
+{
+    if (item->op.len < 2 || item->op.ptr[0] != '"') {
+        return "op must be a string";
+    }
+    // Operation names have nothing to escape, so the text between the quotes is the name
+    const char *name = item->op.ptr + 1;
+    size_t name_len = item->op.len - 2;
+    for (size_t i = 0; i < sizeof(s_api_ops) / sizeof(s_api_ops[0]); i++) {
+        if (strlen(s_api_ops[i].name) == name_len && memcmp(s_api_ops[i].name, name, name_len) == 0) {
+            return s_api_ops[i].fn(item->args, w, "data");
+        }
+    }
+    return "unknown op";
+}
+
+/* Request body parsed while it arrives, the scratch buffer only holds the part that is not parsed yet */
+typedef struct {
+    httpd_req_t *req;
+    char *buf;
+    size_t len;             // bytes in buf
+    size_t pos;             // bytes of buf already parsed
+    size_t remaining;       // body bytes not received yet
+    bool failed;            // receiving the body failed
+} body_window_t;
+
+/* Move the unparsed bytes to the front and receive more behind them, false when nothing more fits or arrives */
+static bool body_window_fill(body_window_t *b)
+{
+    memmove(b->buf, b->buf + b->pos, b->len - b->pos);
+    b->len -= b->pos;
+    b->pos = 0;
+    if (b->failed || b->remaining == 0 || b->len == SCRATCH_BUFSIZE) {
+        return false;
+    }
+    int received = httpd_req_recv(b->req, b->buf + b->len, MIN(b->remaining, SCRATCH_BUFSIZE - b->len));
+    if (received <= 0) {
+        b->failed = true;
+        return false;
+    }
+    b->len += received;
+    b->remaining -= received;
+    return true;
+}
+
+/* Next character that is not whitespace, -1 at the end of the body */
+static int body_window_peek(body_window_t *b)
+{
+    do {
+        while (b->pos < b->len) {
+            char c = b->buf[b->pos];
+            if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+                break;
+            }
+            b->pos++;
+        }
+        if (b->pos < b->len) {
+            return (unsigned char)b->buf[b->pos];
+        }
+    } while (body_window_fill(b));
+    return -1;
+}
+
+/* Have the whole JSON value at the cursor in the buffer, returns its length or 0 if it does not fit */
+static size_t body_window_value(body_window_t *b)
+{
+    size_t n;
+    while ((n = json_value_extent(b->buf + b->pos, b->len - b->pos)) == 0) {
+        if (!body_window_fill(b)) {
+            // At the end of the body whatever is left goes to the parser, which reports how it is broken
+            return b->failed || b->remaining ? 0 : b->len - b->pos;
+        }
+    }
+    return n;
+}
+
+static const char *body_window_error(const body_window_t *b, const char *why)
+{
+    return b->failed ? "failed to receive request body" : why;
+}
+
+/*
+ * Run several operations in one request, in order:
+ *     [{"op":"light.set","args":{"red":1,"green":2,"blue":3}}, {"op":"temp.read"}]
+ * answers with one result per operation, each {"data":...} or {"error":"..."}:
+ *     {"results":[{"data":null},{"data":{"raw":12}}]}
+ * A failed operation does not stop the ones after it. A malformed request is rejected with 400 if no
+ * operation has run yet, otherwise the results end early and "error" says why. The body is parsed while it is
+ * received and each operation runs as soon as it is complete, so only a single operation has to fit in the
+ * scratch buffer, not the whole batch.
+ */
+static esp_err_t batch_post_handler(httpd_req_t *req)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    body_window_t b = {
+        .req = req,
+        .buf = scratch_get(rest_context),
+        .remaining = req->content_len,
+    };
+    if (!b.buf) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server busy");
+        return ESP_FAIL;
+    }
+    if (body_window_peek(&b) != '[') {
+        scratch_put(rest_context, b.buf);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, body_window_error(&b, "expected an array"));
+        return ESP_FAIL;
+    }
+    b.pos++;
+
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_key(&w, "results");
+    json_arr_begin(&w);
+    uint32_t ops = 0;
+    const char *error = NULL;
+    for (bool first = true; ; first = false) {
+        int c = body_window_peek(&b);
+        if (c == ']') {
+            b.pos++;
+            break;
+        }
+        if (!first) {
+            if (c != ',') {
+                error = body_window_error(&b, c < 0 ? "unterminated array" : "expected ',' or ']'");
+                break;
+            }
+            b.pos++;
+        }
+        size_t n = body_window_value(&b);
+        if (n == 0) {
+            error = body_window_error(&b, b.remaining ? "operation too long" : "unterminated array");
+            break;
+        }
+        // The args span points into the scratch buffer, so the operation runs before more is received
+        json_reader_t r;
+        json_reader_init(&r, b.buf + b.pos, n);
+        batch_item_t item = { 0 };
+        if (!json_read_object(&r, s_batch_fields, sizeof(s_batch_fields) / sizeof(s_batch_fields[0]), &item, NULL) ||
+            !json_read_end(&r)) {
+            error = r.error;
+            break;
+        }
+        b.pos += n;
+        json_obj_begin(&w);
+        const char *err = run_batch_item(&item, &w);
+        if (err) {
+            json_kv_str(&w, "error", err);
+        }
+        json_obj_end(&w);
+        ops++;
+    }
+    if (!error && (body_window_peek(&b) >= 0 || b.failed)) {
+        error = body_window_error(&b, "trailing data");
+    }
+    if (error && ops == 0) {
+        // Only the opening of the document is in the writer, nothing has been sent
+        scratch_put(rest_context, b.buf);
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, error);
+        return ESP_FAIL;
+    }
+    json_arr_end(&w);
+    if (error) {
+        json_kv_str(&w, "error", error);
+    }
+    json_obj_end(&w);
+    scratch_put(rest_context, b.buf);
+    metrics_add(METRIC_HTTP_BATCH_OPS, ops);
+    return json_writer_finish(&w);
+}
+API_HANDLER_TIMED(batch_post_handler)
+
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+/* Map /api/v1/fs/<path> to the asset uri /<path>, false for paths outside the web root or managed by the server */
+static bool fs_api_uri(httpd_req_t *req, char *uri, size_t size)
+{
+    const char *path = req->uri + strlen(FS_API_PREFIX);
+    size_t len = strcspn(path, "?");
+    if (len < 2 || len >= size || path[0] != '/' || path[len - 1] == '/') {
+        return false;
+    }
+    memcpy(uri, path, len);
+    uri[len] = '\0';
+    /* The manifest, the .gz variants and in-flight uploads are kept in sync by the server itself */
+    bool managed = strcmp(uri, ASSET_MANIFEST) == 0 || uri[len - 1] == '~' ||
+                   (len > 3 && CHECK_FILE_EXTENSION(uri, ".gz"));
+    return !strstr(uri, "..") && !managed;
+}
+
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_LITTLEFS
+/* LittleFS has real directories, create the ones leading to path below the web root */
+static void make_parent_dirs(char *path, size_t root_len)
+{
+    for (char *p = strchr(path + root_len + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+}
+#endif
+
+/*
+ * Store the request body as a web asset. The body is streamed into <path>~ and only replaces the old file
+ * once it is complete, so readers never see half an upload. LittleFS renames over the old file atomically;
+ * SPIFFS cannot, so there the old file is removed first and readers may briefly get a 404. The ETag is the
+ * SHA-256 prefix www_prepare.py would have produced, computed on the way through.
+ */
+static esp_err_t fs_put_handler(httpd_req_t *req)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    char uri[FILE_PATH_MAX];
+    char filepath[FILE_PATH_MAX];
+    char tmppath[FILE_PATH_MAX];
+    if (!fs_api_uri(req, uri, sizeof(uri))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+        return ESP_FAIL;
+    }
+    strlcpy(filepath, rest_context->base_path, sizeof(filepath));
+    strlcat(filepath, uri, sizeof(filepath));
+    strlcpy(tmppath, filepath, sizeof(tmppath));
+    strlcat(tmppath, "~", sizeof(tmppath));
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_LITTLEFS
+    make_parent_dirs(tmppath, strlen(rest_context->base_path));
+#endif
+
+    char *buf = scratch_get(rest_context);
+    if (!buf) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Server busy");
+        return ESP_FAIL;
+    }
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        scratch_put(rest_context, buf);
+        ESP_LOGE(REST_TAG, "Failed to create file : %s", tmppath);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to create file");
+        return ESP_FAIL;
+    }
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    const char *error = NULL;
+    bool no_space = false;
+    size_t remaining = req->content_len;
+    while (remaining) {
+        int received = httpd_req_recv(req, buf, MIN(remaining, SCRATCH_BUFSIZE));
+        if (received <= 0) {
+            error = "Failed to receive request body";
+            break;
+        }
+        mbedtls_sha256_update(&sha, (const unsigned char *)buf, received);
+        if (write(fd, buf, received) != received) {
+            no_space = errno == ENOSPC;
+            error = "Failed to write file";
+            break;
+        }
+        remaining -= received;
+    }
+    scratch_put(rest_context, buf);
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    if (close(fd) != 0 && !error) {
+        error = "Failed to write file";
+    }
+
+    if (!error) {
+        bool existed = access(filepath, F_OK) == 0;
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_SPIFFS
+        /* SPIFFS cannot rename over an existing file, so readers briefly get a 404 there */
+        unlink(filepath);
+#endif
+        if (rename(tmppath, filepath) != 0) {
+            error = "Failed to replace file";
+        } else {
+            /* A precompressed variant would still hold the old content */
+            strlcpy(tmppath, filepath, sizeof(tmppath));
+            strlcat(tmppath, ".gz", sizeof(tmppath));
+            unlink(tmppath);
+
+            char etag_hex[17];
+            for (int i = 0; i < 8; i++) {
+                snprintf(&etag_hex[i * 2], 3, "%02x", digest[i]);
+            }
+            update_asset_meta(rest_context, uri, etag_hex);
+            ESP_LOGI(REST_TAG, "Stored %s (%u bytes)", uri, (unsigned)req->content_len);
+
+            json_writer_t w;
+            json_writer_init(&w, req);
+            httpd_resp_set_status(req, existed ? HTTPD_200 : "201 Created");
+            json_obj_begin(&w);
+            json_kv_str(&w, "path", uri);
+            json_kv_uint(&w, "size", req->content_len);
+            json_kv_str(&w, "etag", etag_hex);
+            json_obj_end(&w);
+            return json_writer_finish(&w);
+        }
+    }
+    unlink(tmppath);
+    ESP_LOGE(REST_TAG, "Upload of %s failed: %s", uri, error);
+    if (no_space) {
+        httpd_resp_set_status(req, "507 Insufficient Storage");
+        httpd_resp_sendstr(req, "Not enough space for the file");
+    } else {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, error);
+    }
+    return ESP_FAIL;
+}
+API_HANDLER_TIMED(fs_put_handler)
+
+static esp_err_t fs_delete_handler(httpd_req_t *req)
+{
+    rest_server_context_t *rest_context = (rest_server_context_t *)req->user_ctx;
+    char uri[FILE_PATH_MAX];
+    char filepath[FILE_PATH_MAX];
+    if (!fs_api_uri(req, uri, sizeof(uri))) {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid path");
+        return ESP_FAIL;
+    }
+    strlcpy(filepath, rest_context->base_path, sizeof(filepath));
+    strlcat(filepath, uri, sizeof(filepath));
+    if (unlink(filepath) != 0) {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File not found");
+        return ESP_FAIL;
+    }
+    strlcat(filepath, ".gz", sizeof(filepath));
+    unlink(filepath);
+    update_asset_meta(rest_context, uri, NULL);
+    ESP_LOGI(REST_TAG, "Deleted %s", uri);
+
+    httpd_resp_set_status(req, "204 No Content");
+    return httpd_resp_send(req, NULL, 0);
+}
+API_HANDLER_TIMED(fs_delete_handler)
+#endif
+
+static esp_err_t create_scratch_pool(rest_server_context_t *rest_context)
+{
+    rest_context->scratch_pool = xQueueCreate(CONFIG_EXAMPLE_HTTPD_SCRATCH_BUFFERS, sizeof(char *));
+    if (!rest_context->scratch_pool) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (int i = 0; i < CONFIG_EXAMPLE_HTTPD_SCRATCH_BUFFERS; i++) {
+        char *buf = mem_budget_alloc(MEM_HTTPD, SCRATCH_BUFSIZE, MEM_PLACE_ANY);
+        if (!buf) {
+            return ESP_ERR_NO_MEM;
+        }
+        scratch_put(rest_context, buf);
+    }
     return ESP_OK;
 }
 
+/* A worker that fails to start only means more requests get served inline on the httpd task */
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+static file_reader_t *create_file_reader(UBaseType_t priority)
+{
+    file_reader_t *reader = calloc(1, sizeof(file_reader_t));
+    if (!reader) {
+        return NULL;
+    }
+    reader->buf[0] = mem_budget_alloc(MEM_HTTPD, SEND_CHUNK_SIZE, MEM_PLACE_ANY);
+    reader->buf[1] = mem_budget_alloc(MEM_HTTPD, SEND_CHUNK_SIZE, MEM_PLACE_ANY);
+    reader->jobs = xQueueCreate(1, sizeof(read_job_t));
+    reader->done = xQueueCreate(1, sizeof(ssize_t));
+    if (reader->buf[0] && reader->buf[1] && reader->jobs && reader->done &&
+            xTaskCreatePinnedToCore(file_reader_task, "httpd_reader", FILE_READER_STACK, reader, priority, NULL,
+                                    APP_TASK_CORE) == pdPASS) {
+        return reader;
+    }
+    if (reader->jobs) {
+        vQueueDelete(reader->jobs);
+    }
+    if (reader->done) {
+        vQueueDelete(reader->done);
+    }
+    mem_budget_free(MEM_HTTPD, reader->buf[0]);
+    mem_budget_free(MEM_HTTPD, reader->buf[1]);
+    free(reader);
+    return NULL;
+}
+#endif
+
+static void start_async_workers(rest_server_context_t *rest_context, UBaseType_t priority)
+{
+    for (int i = 0; i < CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS; i++) {
+        async_worker_t *worker = calloc(1, sizeof(async_worker_t));
+        if (!worker) {
+            ESP_LOGW(REST_TAG, "Started %d of %d async workers", i, CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS);
+            break;
+        }
+        worker->rest_context = rest_context;
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+        /* Without a reader the worker still works, it just reads and sends in turn */
+        worker->reader = create_file_reader(priority);
+        if (!worker->reader) {
+            ESP_LOGW(REST_TAG, "No double buffering for async worker %d", i);
+        }
+#endif
+        if (xTaskCreatePinnedToCore(rest_async_worker_task, "httpd_worker", ASYNC_WORKER_STACK, worker, priority, NULL,
+                                    APP_TASK_CORE) != pdPASS) {
+            ESP_LOGW(REST_TAG, "Started %d of %d async workers", i, CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS);
+            free(worker);
+            break;
+        }
+    }
+}
+
+static void free_rest_context(rest_server_context_t *rest_context)
+{
+    char *buf = NULL;
+    if (rest_context->scratch_pool) {
+        while (xQueueReceive(rest_context->scratch_pool, &buf, 0) == pdTRUE) {
+            mem_budget_free(MEM_HTTPD, buf);
+        }
+        vQueueDelete(rest_context->scratch_pool);
+    }
+    if (rest_context->async_queue) {
+        vQueueDelete(rest_context->async_queue);
+    }
+    if (rest_context->worker_ready) {
+        vSemaphoreDelete(rest_context->worker_ready);
+    }
+    if (rest_context->assets_lock) {
+        vSemaphoreDelete(rest_context->assets_lock);
+    }
+    for (size_t i = 0; i < rest_context->asset_count; i++) {
+        free(rest_context->assets[i].uri);
+    }
+    free(rest_context->assets);
+    free(rest_context);
+}
+
 esp_err_t resetful_server_start(const char *base_path)
 {
     REST_CHECK(base_path, "wrong base path", err);
     rest_server_context_t *rest_context = calloc(1, sizeof(rest_server_context_t));
     REST_CHECK(rest_context, "No memory for rest context", err);
     strlcpy(rest_context->base_path, base_path, sizeof(rest_context->base_path));
+    REST_CHECK(create_scratch_pool(rest_context) == ESP_OK, "No memory for request buffers", err_start);
+    rest_context->async_queue = xQueueCreate(CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS, sizeof(httpd_req_t *));
+    rest_context->worker_ready = xSemaphoreCreateCounting(CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS, 0);
+    REST_CHECK(rest_context->async_queue && rest_context->worker_ready, "No memory for async workers", err_start);
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    rest_context->assets_lock = xSemaphoreCreateMutex();
+    REST_CHECK(rest_context->assets_lock, "No memory for asset table lock", err_start);
+    load_asset_manifest(rest_context);
+#endif
 
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.uri_match_fn = httpd_uri_match_wildcard;
+    /* Sockets held by async workers must not lock out new API connections */
+    config.lru_purge_enable = true;
+    config.max_uri_handlers = 20;
+    config.core_id = APP_TASK_CORE;
+    config.task_priority = CONFIG_EXAMPLE_HTTPD_TASK_PRIO;
 
     ESP_LOGI(REST_TAG, "Starting HTTP Server");
     REST_CHECK(httpd_start(&server, &config) == ESP_OK, "Start server failed", err_start);
+    /* Workers run just below the httpd task, so API calls win over bulk file transfers */
+    start_async_workers(rest_context, config.task_priority - 1);
 
     /* URI handler for fetching system info */
     httpd_uri_t system_info_get_uri = {
         .uri = "/api/v1/system/info",
         .method = HTTP_GET,
-        .handler = system_info_get_handler,
+        .handler = system_info_get_handler_timed,
         .user_ctx = rest_context
     };
     httpd_register_uri_handler(server, &system_info_get_uri);
@@ -192,20 +1291,97 @@ esp_err_t resetful_server_start(const char *base_path)
     httpd_uri_t temperature_data_get_uri = {
         .uri = "/api/v1/temp/raw",
         .method = HTTP_GET,
-        .handler = temperature_data_get_handler,
+        .handler = temperature_data_get_handler_timed,
         .user_ctx = rest_context
     };
     httpd_register_uri_handler(server, &temperature_data_get_uri);
 
+    /* WebSocket pushing batched temperature samples */
+    if (telemetry_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Telemetry streaming not available");
+    }
+
+    /* Boot phase timestamps */
+    if (boot_phase_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Boot timing endpoint not available");
+    }
+
+    /* Static and heap memory per subsystem */
+    if (mem_budget_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Memory report not available");
+    }
+
+    /* Per-task CPU usage, to check the task placement plan */
+    if (task_stats_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Task report not available");
+    }
+
+    /* Prometheus metrics for the data paths */
+    if (metrics_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Metrics endpoint not available");
+    }
+
+    /* Per-channel CDC-ACM counters */
+    if (tusb_cdc_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "CDC channel stats not available");
+    }
+
+    /* CDC data path trace download and control */
+    if (trace_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Trace endpoint not available");
+    }
+
+#if CONFIG_EXAMPLE_PCAP_CAPTURE
+    /* Packet capture of the USB-NCM interface */
+    if (pcap_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Packet capture not available");
+    }
+#endif
+
+#if CONFIG_EXAMPLE_OTA_UPDATE
+    /* Firmware upload and update status */
+    if (ota_register_handlers(server) != ESP_OK) {
+        ESP_LOGW(REST_TAG, "Firmware update not available");
+    }
+#endif
+
     /* URI handler for light brightness control */
     httpd_uri_t light_brightness_post_uri = {
         .uri = "/api/v1/light/brightness",
         .method = HTTP_POST,
-        .handler = light_brightness_post_handler,
+        .handler = light_brightness_post_handler_timed,
         .user_ctx = rest_context
     };
     httpd_register_uri_handler(server, &light_brightness_post_uri);
 
+    /* URI handler for running several API operations in one request */
+    httpd_uri_t batch_post_uri = {
+        .uri = "/api/v1/batch",
+        .method = HTTP_POST,
+        .handler = batch_post_handler_timed,
+        .user_ctx = rest_context
+    };
+    httpd_register_uri_handler(server, &batch_post_uri);
+
+#if !CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    /* URI handlers for uploading and deleting web assets */
+    httpd_uri_t fs_put_uri = {
+        .uri = FS_API_PREFIX "/*",
+        .method = HTTP_PUT,
+        .handler = fs_put_handler_timed,
+        .user_ctx = rest_context
+    };
+    httpd_register_uri_handler(server, &fs_put_uri);
+
+    httpd_uri_t fs_delete_uri = {
+        .uri = FS_API_PREFIX "/*",
+        .method = HTTP_DELETE,
+        .handler = fs_delete_handler_timed,
+        .user_ctx = rest_context
+    };
+    httpd_register_uri_handler(server, &fs_delete_uri);
+#endif
+
     /* URI handler for getting web server files */
     httpd_uri_t common_get_uri = {
         .uri = "/*",
@@ -217,7 +1393,7 @@ esp_err_t resetful_server_start(const char *base_path)
 
     return ESP_OK;
 err_start:
-    free(rest_context);
+    free_rest_context(rest_context);
 err:
     return ESP_FAIL;
 }
@@ -0,0 +1,143 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Per-task CPU usage at /api/v1/system/tasks, to check the core and priority plan from the "Task placement"
+ * menu under load. Each request reports the CPU time every task used since the previous request, so polling
+ * the endpoint once a second works like top:
+ *
+ *     {"window_us":1000213,"tasks":[{"name":"ncm_tx_task","core":0,"priority":5,"cpu":18.3,"stack_free":1420},
+ *      ...],"core_load":[41.2,12.5]}
+ *
+ * cpu is in percent of one core, core is -1 for unpinned tasks and stack_free is the stack high water mark in
+ * bytes. The first request covers the time since boot. Needs FREERTOS_USE_TRACE_FACILITY and
+ * FREERTOS_GENERATE_RUN_TIME_STATS, which sdkconfig.defaults enables.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_http_server.h"
+#include "esp_idf_version.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+static const char *TAG = "TASKS";
+
+#define TASK_STATS_SPARE    4       // room for tasks created between counting and the snapshot
+
+/* xTaskGetCoreID() only exists from IDF 5.2, older releases call it xTaskGetAffinity() */
+#if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 2, 0)
+#define xTaskGetCoreID(task) xTaskGetAffinity(task)
+#endif
+
+typedef struct {
+    TaskHandle_t handle;
+    configRUN_TIME_COUNTER_TYPE runtime;
+} task_sample_t;
+
+/* Snapshot of the previous request, only touched on the httpd task */
+static struct {
+    task_sample_t *tasks;
+    size_t count;
+    configRUN_TIME_COUNTER_TYPE total;
+} s_prev;
+
+static configRUN_TIME_COUNTER_TYPE prev_runtime(TaskHandle_t handle)
+{
+    for (size_t i = 0; i < s_prev.count; i++) {
+        if (s_prev.tasks[i].handle == handle) {
+            return s_prev.tasks[i].runtime;
+        }
+    }
+    return 0;   // new task, all of its time falls into this window
+}
+
+static esp_err_t tasks_get_handler(httpd_req_t *req)
+{
+    UBaseType_t capacity = uxTaskGetNumberOfTasks() + TASK_STATS_SPARE;
+    TaskStatus_t *status = malloc(capacity * sizeof(TaskStatus_t));
+    task_sample_t *samples = malloc(capacity * sizeof(task_sample_t));
+    if (!status || !samples) {
+        free(status);
+        free(samples);
+        ESP_LOGE(TAG, "No memory for %u task entries", (unsigned)capacity);
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No memory");
+        return ESP_FAIL;
+    }
+    configRUN_TIME_COUNTER_TYPE total;
+    UBaseType_t count = uxTaskGetSystemState(status, capacity, &total);
+    // The run time clock is shared by all cores, so each core had the whole window
+    configRUN_TIME_COUNTER_TYPE window = total - s_prev.total;
+    double core_busy[portNUM_PROCESSORS];
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        core_busy[i] = 100;
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_kv_uint(&w, "window_us", window);
+    json_key(&w, "tasks");
+    json_arr_begin(&w);
+    for (UBaseType_t i = 0; i < count; i++) {
+        const TaskStatus_t *t = &status[i];
+        BaseType_t core = xTaskGetCoreID(t->xHandle);
+        double cpu = window ? (t->ulRunTimeCounter - prev_runtime(t->xHandle)) * 100.0 / window : 0;
+        // Idle tasks are pinned one per core, what they did not get the core spent on real work
+        if (strncmp(t->pcTaskName, "IDLE", 4) == 0 && core >= 0 && core < portNUM_PROCESSORS) {
+            core_busy[core] -= cpu;
+        }
+        samples[i].handle = t->xHandle;
+        samples[i].runtime = t->ulRunTimeCounter;
+
+        json_obj_begin(&w);
+        json_kv_str(&w, "name", t->pcTaskName);
+        json_kv_int(&w, "core", core >= 0 && core < portNUM_PROCESSORS ? core : -1);
+        json_kv_uint(&w, "priority", t->uxCurrentPriority);
+        json_kv_double(&w, "cpu", cpu);
+        json_kv_uint(&w, "stack_free", t->usStackHighWaterMark);
+        json_obj_end(&w);
+    }
+    json_arr_end(&w);
+    json_key(&w, "core_load");
+    json_arr_begin(&w);
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+        json_double(&w, core_busy[i] > 0 ? core_busy[i] : 0);
+    }
+    json_arr_end(&w);
+    json_obj_end(&w);
+
+    free(status);
+    free(s_prev.tasks);
+    s_prev.tasks = samples;
+    s_prev.count = count;
+    s_prev.total = total;
+    return json_writer_finish(&w);
+}
+#else
+static esp_err_t tasks_get_handler(httpd_req_t *req)
+{
+    httpd_resp_send_err(req, HTTPD_501_METHOD_NOT_IMPLEMENTED,
+                        "Enable FREERTOS_USE_TRACE_FACILITY and FREERTOS_GENERATE_RUN_TIME_STATS");
+    return ESP_FAIL;
+}
+#endif
+
+esp_err_t task_stats_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t tasks_get_uri = {
+        .uri = "/api/v1/system/tasks",
+        .method = HTTP_GET,
+        .handler = tasks_get_handler,
+    };
+    return httpd_register_uri_handler(server, &tasks_get_uri);
+}
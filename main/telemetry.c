@@ -0,0 +1,240 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Telemetry sampling and WebSocket push. A periodic esp_timer takes a timestamped sample at
+ * EXAMPLE_TELEMETRY_RATE_HZ and stores it in a ring of the most recent samples. Every EXAMPLE_TELEMETRY_BATCH_MS
+ * worth of samples a push is queued on the httpd task, which sends each subscriber everything it has not seen
+ * yet as one binary frame (little endian):
+ *
+ *     u32 first_seq, u16 count, u16 reserved, then count * { u32 timestamp_ms, f32 value }
+ *
+ * Subscribers live entirely on the httpd task, so they need no locking. A subscriber that falls more than half
+ * the ring behind skips ahead, and the gap shows up in first_seq.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "TELEMETRY";
+
+#define TELEMETRY_RING_SAMPLES  CONFIG_EXAMPLE_TELEMETRY_RING_SAMPLES
+#define TELEMETRY_MAX_CLIENTS   CONFIG_EXAMPLE_TELEMETRY_MAX_CLIENTS
+#define TELEMETRY_PERIOD_US     (1000000 / CONFIG_EXAMPLE_TELEMETRY_RATE_HZ)
+#define TELEMETRY_BATCH_SAMPLES ((CONFIG_EXAMPLE_TELEMETRY_RATE_HZ * CONFIG_EXAMPLE_TELEMETRY_BATCH_MS + 999) / 1000)
+#define TELEMETRY_FRAME_SAMPLES (TELEMETRY_RING_SAMPLES / 2)
+
+_Static_assert((TELEMETRY_RING_SAMPLES & (TELEMETRY_RING_SAMPLES - 1)) == 0, "telemetry ring must be a power of two");
+_Static_assert(TELEMETRY_BATCH_SAMPLES <= TELEMETRY_FRAME_SAMPLES, "a push batch must fit in half the ring");
+
+typedef struct {
+    uint32_t timestamp_ms;
+    float value;
+} telemetry_sample_t;
+
+typedef struct {
+    uint32_t first_seq;
+    uint16_t count;
+    uint16_t reserved;
+} telemetry_frame_hdr_t;
+
+typedef struct {
+    int fd;
+    uint32_t next_seq;
+} telemetry_client_t;
+
+static struct {
+    telemetry_sample_t ring[TELEMETRY_RING_SAMPLES];
+    _Atomic uint32_t head;          // sequence number of the next sample
+    _Atomic bool push_pending;
+    _Atomic uint32_t client_count;
+    httpd_handle_t server;
+    esp_timer_handle_t timer;
+    telemetry_client_t clients[TELEMETRY_MAX_CLIENTS];  // httpd task only
+} s_tm;
+
+/* Push buffer, only used on the httpd task */
+static uint8_t s_frame[sizeof(telemetry_frame_hdr_t) + TELEMETRY_FRAME_SAMPLES * sizeof(telemetry_sample_t)];
+
+float telemetry_read_temperature(void)
+{
+    // No sensor on the board, keep producing the same synthetic reading as /api/v1/temp/raw always did
+    return esp_random() % 20;
+}
+
+static void telemetry_push_work(void *arg);
+
+static void telemetry_sample_cb(void *arg)
+{
+    uint32_t head = atomic_load_explicit(&s_tm.head, memory_order_relaxed);
+    telemetry_sample_t *sample = &s_tm.ring[head & (TELEMETRY_RING_SAMPLES - 1)];
+    sample->timestamp_ms = esp_timer_get_time() / 1000;
+    sample->value = telemetry_read_temperature();
+    atomic_store_explicit(&s_tm.head, head + 1, memory_order_release);
+
+    if ((head + 1) % TELEMETRY_BATCH_SAMPLES == 0 && atomic_load(&s_tm.client_count) &&
+            !atomic_exchange(&s_tm.push_pending, true)) {
+        if (httpd_queue_work(s_tm.server, telemetry_push_work, NULL) != ESP_OK) {
+            atomic_store(&s_tm.push_pending, false);
+        }
+    }
+}
+
+static void remove_client(telemetry_client_t *client)
+{
+    ESP_LOGI(TAG, "Subscriber %d left", client->fd);
+    client->fd = -1;
+    atomic_fetch_sub(&s_tm.client_count, 1);
+}
+
+static esp_err_t push_to_client(telemetry_client_t *client, uint32_t head)
+{
+    uint32_t seq = client->next_seq;
+    if (head - seq > TELEMETRY_FRAME_SAMPLES) {
+        // Too far behind, older samples may already be overwritten
+        seq = head - TELEMETRY_FRAME_SAMPLES;
+    }
+    uint32_t count = head - seq;
+    if (count == 0) {
+        return ESP_OK;
+    }
+
+    telemetry_frame_hdr_t hdr = {
+        .first_seq = seq,
+        .count = count,
+    };
+    memcpy(s_frame, &hdr, sizeof(hdr));
+    telemetry_sample_t *out = (telemetry_sample_t *)(s_frame + sizeof(hdr));
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = s_tm.ring[(seq + i) & (TELEMETRY_RING_SAMPLES - 1)];
+    }
+
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_BINARY,
+        .payload = s_frame,
+        .len = sizeof(hdr) + count * sizeof(telemetry_sample_t),
+    };
+    esp_err_t ret = httpd_ws_send_frame_async(s_tm.server, client->fd, &frame);
+    if (ret == ESP_OK) {
+        client->next_seq = head;
+    }
+    return ret;
+}
+
+static void telemetry_push_work(void *arg)
+{
+    atomic_store(&s_tm.push_pending, false);
+    uint32_t head = atomic_load_explicit(&s_tm.head, memory_order_acquire);
+
+    for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+        telemetry_client_t *client = &s_tm.clients[i];
+        if (client->fd < 0) {
+            continue;
+        }
+        if (httpd_ws_get_fd_info(s_tm.server, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET ||
+                push_to_client(client, head) != ESP_OK) {
+            remove_client(client);
+        }
+    }
+}
+
+static esp_err_t add_client(int fd)
+{
+    telemetry_client_t *free_slot = NULL;
+    for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+        telemetry_client_t *client = &s_tm.clients[i];
+        if (client->fd >= 0 && httpd_ws_get_fd_info(s_tm.server, client->fd) != HTTPD_WS_CLIENT_WEBSOCKET) {
+            remove_client(client);  // closed without us noticing yet
+        }
+        if (client->fd < 0 && !free_slot) {
+            free_slot = client;
+        }
+    }
+    if (!free_slot) {
+        return ESP_ERR_NO_MEM;
+    }
+    // Start with the most recent batch so the chart has something to draw right away, or with the first
+    // sample if there is not a full batch yet
+    uint32_t head = atomic_load_explicit(&s_tm.head, memory_order_acquire);
+    free_slot->fd = fd;
+    free_slot->next_seq = head > TELEMETRY_BATCH_SAMPLES ? head - TELEMETRY_BATCH_SAMPLES : 0;
+    atomic_fetch_add(&s_tm.client_count, 1);
+    ESP_LOGI(TAG, "Subscriber %d joined", fd);
+    return ESP_OK;
+}
+
+static esp_err_t telemetry_ws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        // Handshake done, the socket is a WebSocket from now on
+        if (add_client(httpd_req_to_sockfd(req)) != ESP_OK) {
+            ESP_LOGW(TAG, "Too many subscribers");
+            return ESP_FAIL;
+        }
+        return ESP_OK;
+    }
+
+    // Subscribers have nothing to say, drain and ignore whatever they send
+    uint8_t buf[32];
+    httpd_ws_frame_t frame = {
+        .payload = buf,
+    };
+    esp_err_t ret = httpd_ws_recv_frame(req, &frame, 0);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    size_t len = frame.len;
+    if (len > sizeof(buf)) {
+        ESP_LOGW(TAG, "Dropping %u byte message", (unsigned)len);
+        return ESP_FAIL;
+    }
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+
+esp_err_t telemetry_register_handlers(httpd_handle_t server)
+{
+    s_tm.server = server;
+    mem_budget_add_static(MEM_TELEMETRY, sizeof(s_tm.ring) + sizeof(s_frame));
+    for (int i = 0; i < TELEMETRY_MAX_CLIENTS; i++) {
+        s_tm.clients[i].fd = -1;
+    }
+
+    httpd_uri_t telemetry_ws_uri = {
+        .uri = "/api/v1/telemetry/ws",
+        .method = HTTP_GET,
+        .handler = telemetry_ws_handler,
+        .is_websocket = true,
+    };
+    esp_err_t ret = httpd_register_uri_handler(server, &telemetry_ws_uri);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = telemetry_sample_cb,
+        .name = "telemetry",
+        .skip_unhandled_events = true,
+    };
+    ret = esp_timer_create(&timer_args, &s_tm.timer);
+    if (ret == ESP_OK) {
+        ret = esp_timer_start_periodic(s_tm.timer, TELEMETRY_PERIOD_US);
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start sampling (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+    ESP_LOGI(TAG, "Sampling at %d Hz, pushing every %d samples", CONFIG_EXAMPLE_TELEMETRY_RATE_HZ,
+             TELEMETRY_BATCH_SAMPLES);
+    return ESP_OK;
+}
@@ -0,0 +1,194 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Binary trace ring for data path events. Each event is a fixed-size record: timestamp, event type, channel,
+ * full length and the first EXAMPLE_TRACE_CAPTURE_BYTES of the data. Writers claim a slot with one atomic
+ * increment and publish the record by storing its sequence number last. A reader skips any slot whose sequence
+ * number changed while it was copying, so tracing never blocks the data path.
+ *
+ * GET /api/v1/trace downloads the ring, oldest record first, for tools/trace_decode.py:
+ *
+ *     header   magic "TRC1", u16 version, u16 record_size, u16 capture_bytes, u16 reserved, u32 lost_records
+ *     records  u32 seq, u32 timestamp_us, u8 event, u8 channel, u16 len, u8 data[capture_bytes]
+ *
+ * POST /api/v1/trace?enable=1|0&clear=1 switches tracing on or off and empties the ring.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "sdkconfig.h"
+#include "json_stream.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "TRACE";
+
+#define TRACE_RECORDS       CONFIG_EXAMPLE_TRACE_RECORDS
+#define TRACE_CAPTURE_BYTES CONFIG_EXAMPLE_TRACE_CAPTURE_BYTES
+#define TRACE_MAGIC         "TRC1"
+#define TRACE_VERSION       1
+#define TRACE_CHUNK_RECORDS 16
+
+#if CONFIG_EXAMPLE_TRACE_ENABLE_AT_BOOT
+#define TRACE_ENABLED_AT_BOOT true
+#else
+#define TRACE_ENABLED_AT_BOOT false
+#endif
+
+_Static_assert((TRACE_RECORDS & (TRACE_RECORDS - 1)) == 0, "trace ring size must be a power of two");
+_Static_assert(TRACE_CAPTURE_BYTES % 4 == 0, "trace capture size must be a multiple of 4");
+
+typedef struct {
+    _Atomic uint32_t seq;   // slot index + 1 once the record is complete, 0 while it is being written
+    uint32_t timestamp_us;
+    uint8_t event;
+    uint8_t channel;
+    uint16_t len;           // full length of the data, only the first TRACE_CAPTURE_BYTES are kept
+    uint8_t data[TRACE_CAPTURE_BYTES];
+} trace_record_t;
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t capture_bytes;
+    uint16_t reserved;
+    uint32_t lost_records;  // overwritten since the last clear, before the download started
+} trace_file_hdr_t;
+
+_Static_assert(sizeof(trace_record_t) == 12 + TRACE_CAPTURE_BYTES, "trace record layout must match tools/trace_decode.py");
+_Static_assert(sizeof(trace_file_hdr_t) == 16, "trace header layout must match tools/trace_decode.py");
+
+static struct {
+    trace_record_t ring[TRACE_RECORDS];
+    _Atomic uint32_t head;  // records ever claimed
+    _Atomic uint32_t base;  // head at the last clear, records before it are not reported
+    atomic_bool enabled;
+} s_trace = {
+    .enabled = TRACE_ENABLED_AT_BOOT,
+};
+
+void trace_record(trace_event_t event, uint8_t channel, const void *data, size_t len)
+{
+    if (!atomic_load_explicit(&s_trace.enabled, memory_order_relaxed)) {
+        return;
+    }
+    uint32_t idx = atomic_fetch_add_explicit(&s_trace.head, 1, memory_order_relaxed);
+    trace_record_t *rec = &s_trace.ring[idx & (TRACE_RECORDS - 1)];
+
+    atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    rec->timestamp_us = esp_timer_get_time();
+    rec->event = event;
+    rec->channel = channel;
+    rec->len = len > UINT16_MAX ? UINT16_MAX : len;
+    size_t captured = len < TRACE_CAPTURE_BYTES ? len : TRACE_CAPTURE_BYTES;
+    if (captured) {
+        memcpy(rec->data, data, captured);
+    }
+    atomic_store_explicit(&rec->seq, idx + 1, memory_order_release);
+}
+
+/* Copy a slot if it still holds record idx, false when it is being rewritten or already overwritten */
+static bool copy_record(uint32_t idx, trace_record_t *out)
+{
+    const trace_record_t *rec = &s_trace.ring[idx & (TRACE_RECORDS - 1)];
+    if (atomic_load_explicit(&rec->seq, memory_order_acquire) != idx + 1) {
+        return false;
+    }
+    memcpy(out, rec, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&rec->seq, memory_order_relaxed) == idx + 1;
+}
+
+static esp_err_t trace_get_handler(httpd_req_t *req)
+{
+    uint32_t base = atomic_load_explicit(&s_trace.base, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&s_trace.head, memory_order_acquire);
+    uint32_t first = head - base > TRACE_RECORDS ? head - TRACE_RECORDS : base;
+
+    trace_file_hdr_t hdr = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(trace_record_t),
+        .capture_bytes = TRACE_CAPTURE_BYTES,
+        .lost_records = first - base,
+    };
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"cdc.trace\"");
+    esp_err_t ret = httpd_resp_send_chunk(req, (const char *)&hdr, sizeof(hdr));
+
+    trace_record_t chunk[TRACE_CHUNK_RECORDS];
+    size_t count = 0;
+    for (uint32_t idx = first; idx != head && ret == ESP_OK; idx++) {
+        if (copy_record(idx, &chunk[count])) {
+            count++;
+        }
+        if (count == TRACE_CHUNK_RECORDS) {
+            ret = httpd_resp_send_chunk(req, (const char *)chunk, sizeof(chunk));
+            count = 0;
+        }
+    }
+    if (ret == ESP_OK && count) {
+        ret = httpd_resp_send_chunk(req, (const char *)chunk, count * sizeof(trace_record_t));
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Trace download aborted");
+        return ret;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+static esp_err_t trace_post_handler(httpd_req_t *req)
+{
+    char query[32] = "";
+    char value[4];
+    httpd_req_get_url_query_str(req, query, sizeof(query));
+
+    if (httpd_query_key_value(query, "enable", value, sizeof(value)) == ESP_OK) {
+        atomic_store(&s_trace.enabled, value[0] == '1');
+        ESP_LOGI(TAG, "Tracing %s", value[0] == '1' ? "enabled" : "disabled");
+    }
+    if (httpd_query_key_value(query, "clear", value, sizeof(value)) == ESP_OK && value[0] == '1') {
+        // Invalidate every slot so a download right after only sees new events, and count from here on
+        atomic_store(&s_trace.base, atomic_load(&s_trace.head));
+        for (int i = 0; i < TRACE_RECORDS; i++) {
+            atomic_store(&s_trace.ring[i].seq, 0);
+        }
+    }
+
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_kv_bool(&w, "enabled", atomic_load(&s_trace.enabled));
+    json_kv_uint(&w, "records", atomic_load(&s_trace.head) - atomic_load(&s_trace.base));
+    json_obj_end(&w);
+    return json_writer_finish(&w);
+}
+
+esp_err_t trace_register_handlers(httpd_handle_t server)
+{
+    mem_budget_add_static(MEM_TRACE, sizeof(s_trace.ring));
+    httpd_uri_t trace_get_uri = {
+        .uri = "/api/v1/trace",
+        .method = HTTP_GET,
+        .handler = trace_get_handler,
+    };
+    httpd_uri_t trace_post_uri = {
+        .uri = "/api/v1/trace",
+        .method = HTTP_POST,
+        .handler = trace_post_handler,
+    };
+    esp_err_t ret = httpd_register_uri_handler(server, &trace_get_uri);
+    if (ret == ESP_OK) {
+        ret = httpd_register_uri_handler(server, &trace_post_uri);
+    }
+    return ret;
+}
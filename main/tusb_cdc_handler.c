@@ -1,59 +1,207 @@
 #include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/param.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <tinyusb.h>
 #include <tusb_cdc_acm.h>
 #include <freertos/task.h>
-#include <freertos/queue.h>
 #include <sdkconfig.h>
+#include "byte_ring.h"
+#include "json_stream.h"
 #include "tusb_ncm_demo.h"
 
 static const char *TAG = "CDC_Handler";
 
+_Static_assert((CONFIG_EXAMPLE_CDC_RX_RING_SIZE & (CONFIG_EXAMPLE_CDC_RX_RING_SIZE - 1)) == 0,
+               "CDC RX ring size must be a power of two");
+_Static_assert(CDC_CHANNELS <= CONFIG_TINYUSB_CDC_COUNT, "TINYUSB_CDC_COUNT is lower than CDC_CHANNELS");
+
+#define CDC_DUMP_INTERVAL_MS    10000
+#define CDC_QUANTUM             512     // bytes of echo per channel and round
+#define CDC_DRAIN_SLICE_US      5000    // longest drain_channels() call before the handler task looks around
+
+/* Per-channel counters for /api/v1/cdc, the totals also go to the metrics registry (METRIC_CDC_*) */
 typedef struct {
-    uint32_t frame_count;
-    uint32_t total_bytes;
-    uint32_t queue_fail_count;
-    uint32_t queue_fail_bytes;
-} cdc_stats_t;
+    _Atomic uint64_t rx_bytes;
+    _Atomic uint32_t rx_reads;
+    _Atomic uint32_t rx_drops;
+    _Atomic uint32_t rx_drop_bytes;
+    _Atomic uint32_t rx_stalls;
+    _Atomic uint64_t tx_bytes;
+    _Atomic uint32_t tx_short_writes;
+} cdc_channel_stats_t;
 
 typedef struct {
-    cdc_stats_t stats;
-    uint8_t rx_buf[CONFIG_TINYUSB_CDC_RX_BUFSIZE + 1];
-    QueueHandle_t app_queue;
-} cdc_context_t;
+    byte_ring_t rx_ring;            // written by whoever holds `pulling`, drained by the handler task or bridge
+    tinyusb_cdcacm_itf_t itf;
+    atomic_bool pulling;            // one task at a time reads from TinyUSB into the ring
+    atomic_bool pull_requested;     // more data may be waiting, set by anyone, cleared by the puller
+    atomic_bool stalled;            // ring was full and data was left in TinyUSB (lossless mode)
+    int64_t stall_start_us;         // only touched by the puller
+    uint32_t max_stall_us;
+    cdc_channel_stats_t stats;
+} cdc_channel_t;
 
-static cdc_context_t s_cdc_ctx = {0};
+static struct {
+    TaskHandle_t task;
+    cdc_channel_t ch[CDC_CHANNELS];     // ch[n] is TINYUSB_CDC_ACM_n
+} s_cdc_ctx = {0};
 
-typedef struct {
-    uint8_t buf[CONFIG_TINYUSB_CDC_RX_BUFSIZE + 1];
-    size_t buf_len;
-    uint8_t itf;
-} app_message_t;
+static uint8_t s_cdc_rx_storage[CDC_CHANNELS][CONFIG_EXAMPLE_CDC_RX_RING_SIZE];
 
-static void tinyusb_cdc_rx_callback(int itf, cdcacm_event_t *event)
+/* Channels the handler task echoes, the bridge channel is drained by the bridge task instead */
+static bool cdc_is_echoed(const cdc_channel_t *c)
+{
+#if CONFIG_EXAMPLE_CDC_TCP_BRIDGE
+    return c->itf != CDC_BRIDGE_CHANNEL;
+#else
+    return true;
+#endif
+}
+
+#if CONFIG_EXAMPLE_CDC_FLOW_LOSSY
+static void cdc_discard_pending(cdc_channel_t *c)
 {
+    uint8_t discard[64];
     size_t rx_size = 0;
-    esp_err_t ret = tinyusb_cdcacm_read(itf, s_cdc_ctx.rx_buf, CONFIG_TINYUSB_CDC_RX_BUFSIZE, &rx_size);
-    if (ret == ESP_OK) {
-        app_message_t tx_msg;
-        tx_msg.buf_len = rx_size;
-        tx_msg.itf = itf;
-        memcpy(tx_msg.buf, s_cdc_ctx.rx_buf, rx_size);
-        BaseType_t xStatus = xQueueSend(s_cdc_ctx.app_queue, &tx_msg, 0);
-        if (xStatus == pdTRUE) {
-            s_cdc_ctx.stats.frame_count++;
-            s_cdc_ctx.stats.total_bytes += tx_msg.buf_len;
-            ESP_LOGV(TAG, "Frame count: %lu, Byte count: %lu",
-                     s_cdc_ctx.stats.frame_count, s_cdc_ctx.stats.total_bytes);
-        } else {
-            s_cdc_ctx.stats.queue_fail_count++;
-            s_cdc_ctx.stats.queue_fail_bytes += tx_msg.buf_len;
-            ESP_LOGV(TAG, "Failed to send to queue, fail count: %lu, fail bytes: %lu",
-                     s_cdc_ctx.stats.queue_fail_count, s_cdc_ctx.stats.queue_fail_bytes);
-        }
-    } else {
-        ESP_LOGE(TAG, "Read Error");
+    size_t dropped = 0;
+
+    // Ring is full: drain TinyUSB anyway so the host is not stalled, and account for the loss
+    do {
+        if (tinyusb_cdcacm_read(c->itf, discard, sizeof(discard), &rx_size) != ESP_OK) {
+            break;
+        }
+        dropped += rx_size;
+    } while (rx_size == sizeof(discard));
+    metrics_inc(METRIC_CDC_RX_DROPS);
+    metrics_add(METRIC_CDC_RX_DROP_BYTES, dropped);
+    atomic_fetch_add(&c->stats.rx_drops, 1);
+    atomic_fetch_add(&c->stats.rx_drop_bytes, dropped);
+    trace_record(TRACE_EVT_CDC_DROP, c->itf, NULL, dropped);
+    ESP_LOGV(TAG, "RX ring %d full, dropped %u bytes", c->itf, (unsigned)dropped);
+}
+#else
+static void cdc_stall_begin(cdc_channel_t *c)
+{
+    if (!c->stall_start_us) {
+        c->stall_start_us = esp_timer_get_time();
+        metrics_inc(METRIC_CDC_RX_STALLS);
+        atomic_fetch_add(&c->stats.rx_stalls, 1);
+        trace_record(TRACE_EVT_CDC_STALL, c->itf, NULL, 0);
+    }
+    atomic_store(&c->stalled, true);
+}
+
+static void cdc_stall_end(cdc_channel_t *c)
+{
+    atomic_store(&c->stalled, false);
+    if (c->stall_start_us) {
+        uint32_t stall_us = esp_timer_get_time() - c->stall_start_us;
+        metrics_observe_us(METRIC_HIST_CDC_RX_STALL, stall_us);
+        if (stall_us > c->max_stall_us) {
+            c->max_stall_us = stall_us;
+        }
+        c->stall_start_us = 0;
+    }
+}
+#endif
+
+static size_t cdc_read_into_ring(cdc_channel_t *c)
+{
+    size_t received = 0;
+
+    while (1) {
+        uint8_t *span;
+        size_t room = byte_ring_write_span(&c->rx_ring, &span);
+        if (room == 0) {
+#if CONFIG_EXAMPLE_CDC_FLOW_LOSSY
+            cdc_discard_pending(c);
+            break;
+#else
+            // Leave the data in TinyUSB: once its FIFO fills up the OUT endpoint NAKs and throttles the host.
+            // Publish the stall first, then look again, so space freed meanwhile is never missed. The fence
+            // pairs with the one in tusb_cdc_rx_consume(): either we see the new tail or it sees `stalled`.
+            cdc_stall_begin(c);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (byte_ring_free(&c->rx_ring) == 0) {
+                break;
+            }
+            cdc_stall_end(c);
+            continue;
+#endif
+        }
+        // Read straight into the ring, at most up to the wrap point; a second pass picks up the rest
+        size_t rx_size = 0;
+        if (tinyusb_cdcacm_read(c->itf, span, room, &rx_size) != ESP_OK) {
+            ESP_LOGE(TAG, "Read Error");
+            break;
+        }
+#if !CONFIG_EXAMPLE_CDC_FLOW_LOSSY
+        cdc_stall_end(c);
+#endif
+        if (rx_size) {
+            trace_record(TRACE_EVT_CDC_RX, c->itf, span, rx_size);
+        }
+        byte_ring_commit(&c->rx_ring, rx_size);
+        received += rx_size;
+        if (rx_size < room) {
+            break;
+        }
+    }
+    return received;
+}
+
+/*
+ * Move pending data from TinyUSB into the ring. Called from the RX callback and, in lossless mode, from the
+ * handler task once it has freed space after a stall. Only one caller reads at a time so the ring keeps a
+ * single producer; a caller that loses the race leaves a request behind for the current puller to pick up.
+ */
+static void cdc_pull(cdc_channel_t *c)
+{
+    bool received = false;
+
+    atomic_store(&c->pull_requested, true);
+    while (!atomic_exchange(&c->pulling, true)) {
+        while (atomic_exchange(&c->pull_requested, false)) {
+            size_t rx_size = cdc_read_into_ring(c);
+            if (rx_size) {
+                metrics_inc(METRIC_CDC_RX_READS);
+                metrics_add(METRIC_CDC_RX_BYTES, rx_size);
+                atomic_fetch_add(&c->stats.rx_reads, 1);
+                atomic_fetch_add(&c->stats.rx_bytes, rx_size);
+                ESP_LOGV(TAG, "Received %u bytes on channel %d", (unsigned)rx_size, c->itf);
+                received = true;
+            }
+        }
+        atomic_store(&c->pulling, false);
+        if (!atomic_load(&c->pull_requested)) {
+            break;
+        }
+    }
+
+    if (received) {
+#if CONFIG_EXAMPLE_CDC_TCP_BRIDGE
+        if (!cdc_is_echoed(c)) {
+            cdc_tcp_bridge_rx_notify(byte_ring_used(&c->rx_ring));
+            return;
+        }
+#endif
+        if (s_cdc_ctx.task) {
+            xTaskNotifyGive(s_cdc_ctx.task);
+        }
+    }
+}
+
+static void tinyusb_cdc_rx_callback(int itf, cdcacm_event_t *event)
+{
+    if (itf < 0 || itf >= CDC_CHANNELS) {
+        return;
     }
+    int64_t start = esp_timer_get_time();
+    cdc_pull(&s_cdc_ctx.ch[itf]);
+    metrics_observe_since(METRIC_HIST_CDC_RX_CALLBACK, start);
 }
 
 static void tinyusb_cdc_line_state_changed_callback(int itf, cdcacm_event_t *event)
@@ -65,57 +213,160 @@ static void tinyusb_cdc_line_state_changed_callback(int itf, cdcacm_event_t *eve
 
 static void dump_cdc_stats(void)
 {
-    ESP_LOGI(TAG, "Frame count: %lu, Byte count: %lu, Fail count: %lu, Fail bytes: %lu",
-             (unsigned long)s_cdc_ctx.stats.frame_count,
-             (unsigned long)s_cdc_ctx.stats.total_bytes,
-             (unsigned long)s_cdc_ctx.stats.queue_fail_count,
-             (unsigned long)s_cdc_ctx.stats.queue_fail_bytes);
+    for (int i = 0; i < CDC_CHANNELS; i++) {
+        cdc_channel_t *c = &s_cdc_ctx.ch[i];
+        ESP_LOGI(TAG, "Channel %d: Frame count: %lu, Byte count: %llu, Fail count: %lu, Fail bytes: %lu, "
+                 "Ring used: %u", i, (unsigned long)atomic_load(&c->stats.rx_reads),
+                 (unsigned long long)atomic_load(&c->stats.rx_bytes),
+                 (unsigned long)atomic_load(&c->stats.rx_drops),
+                 (unsigned long)atomic_load(&c->stats.rx_drop_bytes),
+                 (unsigned)byte_ring_used(&c->rx_ring));
+#if !CONFIG_EXAMPLE_CDC_FLOW_LOSSY
+        ESP_LOGI(TAG, "Channel %d: Stalls: %lu, longest %lu ms", i, (unsigned long)atomic_load(&c->stats.rx_stalls),
+                 (unsigned long)(c->max_stall_us / 1000));
+#endif
+    }
 }
 
 static void init_usb_serial(void)
 {
-    s_cdc_ctx.app_queue = xQueueCreate(5, sizeof(app_message_t));
-    ESP_ERROR_CHECK(s_cdc_ctx.app_queue != NULL ? ESP_OK : ESP_FAIL);
+    ESP_LOGI(TAG, "USB ACM initialization, %d channel(s)", CDC_CHANNELS);
+    mem_budget_add_static(MEM_CDC, sizeof(s_cdc_rx_storage));
 
-    ESP_LOGI(TAG, "USB ACM initialization");
+    for (int i = 0; i < CDC_CHANNELS; i++) {
+        cdc_channel_t *c = &s_cdc_ctx.ch[i];
+        ESP_ERROR_CHECK(byte_ring_init(&c->rx_ring, s_cdc_rx_storage[i], sizeof(s_cdc_rx_storage[i])));
+        c->itf = TINYUSB_CDC_ACM_0 + i;
 
-    tinyusb_config_cdcacm_t acm_cfg = {
-        .usb_dev = TINYUSB_USBDEV_0,
-        .cdc_port = TINYUSB_CDC_ACM_0,
-        .callback_rx = &tinyusb_cdc_rx_callback,
-        .callback_rx_wanted_char = NULL,
-        .callback_line_state_changed = &tinyusb_cdc_line_state_changed_callback,
-        .callback_line_coding_changed = NULL
-    };
+        tinyusb_config_cdcacm_t acm_cfg = {
+            .usb_dev = TINYUSB_USBDEV_0,
+            .cdc_port = c->itf,
+            .callback_rx = &tinyusb_cdc_rx_callback,
+            .callback_rx_wanted_char = NULL,
+            .callback_line_state_changed = &tinyusb_cdc_line_state_changed_callback,
+            .callback_line_coding_changed = NULL
+        };
 
-    ESP_ERROR_CHECK(tusb_cdc_acm_init(&acm_cfg));
-    ESP_ERROR_CHECK(tinyusb_cdcacm_register_callback(
-                        TINYUSB_CDC_ACM_0,
-                        CDC_EVENT_LINE_STATE_CHANGED,
-                        &tinyusb_cdc_line_state_changed_callback));
+        ESP_ERROR_CHECK(tusb_cdc_acm_init(&acm_cfg));
+        ESP_ERROR_CHECK(tinyusb_cdcacm_register_callback(
+                            c->itf,
+                            CDC_EVENT_LINE_STATE_CHANGED,
+                            &tinyusb_cdc_line_state_changed_callback));
+    }
 
     ESP_LOGI(TAG, "USB ACM initialization DONE");
 }
 
-static void tusb_cdc_handler_task(void *pvParameters)
+size_t tusb_cdc_rx_span(int channel, const uint8_t **span)
 {
-    app_message_t msg;
-    TickType_t last_wake_time = xTaskGetTickCount();
-    const TickType_t dump_interval = pdMS_TO_TICKS(10000); // 10 seconds
+    return byte_ring_read_span(&s_cdc_ctx.ch[channel].rx_ring, span);
+}
+
+size_t tusb_cdc_rx_pending(int channel)
+{
+    return byte_ring_used(&s_cdc_ctx.ch[channel].rx_ring);
+}
+
+void tusb_cdc_rx_consume(int channel, size_t len)
+{
+    cdc_channel_t *c = &s_cdc_ctx.ch[channel];
+    byte_ring_consume(&c->rx_ring, len);
+#if !CONFIG_EXAMPLE_CDC_FLOW_LOSSY
+    // Publish the tail before looking at `stalled`, see cdc_read_into_ring()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (len && atomic_load(&c->stalled)) {
+        // The RX callback will not fire again while TinyUSB holds on to the data, so resume reading here
+        cdc_pull(c);
+    }
+#endif
+}
+
+size_t tusb_cdc_write(int channel, const uint8_t *data, size_t len)
+{
+    cdc_channel_t *c = &s_cdc_ctx.ch[channel];
+    size_t queued = tinyusb_cdcacm_write_queue(c->itf, data, len);
+    esp_err_t err = tinyusb_cdcacm_write_flush(c->itf, 0);
+    if (err != ESP_OK) {
+        ESP_LOGD(TAG, "CDC ACM write flush error: %s", esp_err_to_name(err));
+    }
+    metrics_add(METRIC_CDC_TX_BYTES, queued);
+    atomic_fetch_add(&c->stats.tx_bytes, queued);
+    if (queued) {
+        trace_record(TRACE_EVT_CDC_TX, c->itf, data, queued);
+    }
+    if (queued < len) {
+        metrics_inc(METRIC_CDC_TX_SHORT_WRITES);
+        atomic_fetch_add(&c->stats.tx_short_writes, 1);
+    }
+    return queued;
+}
+
+/* Echo up to budget bytes of a channel in place, only what TinyUSB accepted leaves the ring */
+static size_t echo_channel(int channel, size_t budget)
+{
+    const uint8_t *span;
+    size_t len;
+    size_t sent = 0;
+
+    while (sent < budget && (len = tusb_cdc_rx_span(channel, &span)) > 0) {
+        len = MIN(len, budget - sent);
+        // Payloads go to the trace ring (GET /api/v1/trace), logging them here would cap the echo rate
+        ESP_LOGV(TAG, "Echo %u bytes on channel %d", (unsigned)len, channel);
+
+        size_t queued = tusb_cdc_write(channel, span, len);
+        tusb_cdc_rx_consume(channel, queued);
+        sent += queued;
+        if (queued < len) {
+            break;      // TX FIFO full, let the other channels have their turn
+        }
+    }
+    return sent;
+}
+
+/*
+ * Round robin over the echoed channels, CDC_QUANTUM bytes per channel and round, so a channel whose TX FIFO
+ * is full does not hold up the others. Rounds stop once nothing moves or CDC_DRAIN_SLICE_US is used up, and
+ * the return value tells the handler task how long to wait before the next call, so a host that stops
+ * reading cannot pin the task here.
+ */
+static TickType_t drain_channels(void)
+{
+    int64_t deadline = esp_timer_get_time() + CDC_DRAIN_SLICE_US;
 
     while (1) {
-        if (xQueueReceive(s_cdc_ctx.app_queue, &msg, portMAX_DELAY)) {
-            if (msg.buf_len) {
-                ESP_LOGI(TAG, "Data from channel %d:", msg.itf);
-                ESP_LOG_BUFFER_HEXDUMP(TAG, msg.buf, msg.buf_len, ESP_LOG_INFO);
-
-                tinyusb_cdcacm_write_queue(msg.itf, msg.buf, msg.buf_len);
-                esp_err_t err = tinyusb_cdcacm_write_flush(msg.itf, 0);
-                if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "CDC ACM write flush error: %s", esp_err_to_name(err));
-                }
+        bool pending = false;
+        bool progress = false;
+        for (int i = 0; i < CDC_CHANNELS; i++) {
+            cdc_channel_t *c = &s_cdc_ctx.ch[i];
+            if (!cdc_is_echoed(c) || !byte_ring_used(&c->rx_ring)) {
+                continue;
             }
+            progress |= echo_channel(i, CDC_QUANTUM) > 0;
+            pending |= byte_ring_used(&c->rx_ring) > 0;
         }
+        if (!pending) {
+            return portMAX_DELAY;
+        }
+        if (!progress) {
+            return 1;   // every TX FIFO with data behind it is full, give the host a tick to read
+        }
+        if (esp_timer_get_time() >= deadline) {
+            return 0;   // still moving, carry on after the stats check
+        }
+    }
+}
+
+static void tusb_cdc_handler_task(void *pvParameters)
+{
+    TickType_t last_wake_time = xTaskGetTickCount();
+    const TickType_t dump_interval = pdMS_TO_TICKS(CDC_DUMP_INTERVAL_MS);
+    TickType_t wait = dump_interval;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        int64_t start = esp_timer_get_time();
+        wait = MIN(drain_channels(), dump_interval);
+        metrics_observe_since(METRIC_HIST_CDC_DRAIN, start);
 
         // Dump statistics at the specified interval
         if (xTaskGetTickCount() - last_wake_time >= dump_interval) {
@@ -125,16 +376,61 @@ static void tusb_cdc_handler_task(void *pvParameters)
     }
 }
 
-static void start_cdc_handler_task()
+static esp_err_t cdc_stats_get_handler(httpd_req_t *req)
 {
-    s_cdc_ctx.app_queue = xQueueCreate(10, sizeof(app_message_t));
-    xTaskCreate(tusb_cdc_handler_task, "cdc_handler_task", 4096, NULL, 5, NULL);
+    json_writer_t w;
+    json_writer_init(&w, req);
+    json_obj_begin(&w);
+    json_key(&w, "channels");
+    json_arr_begin(&w);
+    for (int i = 0; i < CDC_CHANNELS; i++) {
+        cdc_channel_t *c = &s_cdc_ctx.ch[i];
+        json_obj_begin(&w);
+        json_kv_int(&w, "channel", i);
+        json_kv_str(&w, "mode", cdc_is_echoed(c) ? "echo" : "bridge");
+        json_kv_uint(&w, "rx_reads", atomic_load(&c->stats.rx_reads));
+        json_kv_uint(&w, "rx_bytes", atomic_load(&c->stats.rx_bytes));
+        json_kv_uint(&w, "rx_drops", atomic_load(&c->stats.rx_drops));
+        json_kv_uint(&w, "rx_drop_bytes", atomic_load(&c->stats.rx_drop_bytes));
+        json_kv_uint(&w, "rx_stalls", atomic_load(&c->stats.rx_stalls));
+        json_kv_uint(&w, "max_stall_us", c->max_stall_us);
+        json_kv_uint(&w, "tx_bytes", atomic_load(&c->stats.tx_bytes));
+        json_kv_uint(&w, "tx_short_writes", atomic_load(&c->stats.tx_short_writes));
+        json_kv_uint(&w, "ring_used", byte_ring_used(&c->rx_ring));
+        json_kv_uint(&w, "ring_size", sizeof(s_cdc_rx_storage[i]));
+        json_obj_end(&w);
+    }
+    json_arr_end(&w);
+    json_obj_end(&w);
+    return json_writer_finish(&w);
+}
+
+esp_err_t tusb_cdc_register_handlers(httpd_handle_t server)
+{
+    httpd_uri_t cdc_stats_get_uri = {
+        .uri = "/api/v1/cdc",
+        .method = HTTP_GET,
+        .handler = cdc_stats_get_handler,
+    };
+    return httpd_register_uri_handler(server, &cdc_stats_get_uri);
+}
+
+static void start_cdc_handler_task(void)
+{
+    xTaskCreatePinnedToCore(tusb_cdc_handler_task, "cdc_handler_task", 4096, NULL, CONFIG_EXAMPLE_CDC_TASK_PRIO,
+                            &s_cdc_ctx.task, IO_TASK_CORE);
 }
 
 int tusb_cdc_handler_init(void)
 {
+    // The consumer must exist before the first RX callback can notify it
+    start_cdc_handler_task();
+#if CONFIG_EXAMPLE_CDC_TCP_BRIDGE
+    if (cdc_tcp_bridge_start() != ESP_OK) {
+        ESP_LOGE(TAG, "CDC to TCP bridge not available");
+    }
+#endif
     // Initialize USB serial
     init_usb_serial();
-    start_cdc_handler_task();
     return ESP_OK;
-}
\ No newline at end of file
+}
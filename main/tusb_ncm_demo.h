@@ -1,7 +1,222 @@
 #ifndef __TUSB_NCM_DEMO_H__
 #define __TUSB_NCM_DEMO_H__
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <esp_err.h>
+#include <esp_http_server.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+#include "freertos/FreeRTOS.h"
+#include "json_stream.h"
+
+/* Scheduling plan from the "Task placement" menu: USB and CDC-ACM I/O on one core, HTTP and the rest on the other */
+#define TASK_PLAN_CORE(core) ((core) >= 0 && (core) < portNUM_PROCESSORS ? (core) : tskNO_AFFINITY)
+#define IO_TASK_CORE TASK_PLAN_CORE(CONFIG_EXAMPLE_IO_TASK_CORE)
+#define APP_TASK_CORE TASK_PLAN_CORE(CONFIG_EXAMPLE_APP_TASK_CORE)
+
 esp_err_t resetful_server_start(const char *base_path);
 int tusb_cdc_handler_init(void);
+
+/*
+ * CDC-ACM channels: channel n is TINYUSB_CDC_ACM_n, the TCP bridge takes over the last one. Fixed at one: the
+ * ESP32-S2/S3 USB controller has four IN endpoints besides EP0, USB-NCM needs two and every CDC-ACM port two.
+ */
+#define CDC_CHANNELS            1
+#if CONFIG_EXAMPLE_CDC_TCP_BRIDGE
+#define CDC_BRIDGE_CHANNEL      (CDC_CHANNELS - 1)
+#endif
+
+/* CDC-ACM data path: RX ring consumer side and TX of one channel, used by the TCP bridge */
+size_t tusb_cdc_rx_span(int channel, const uint8_t **span);
+size_t tusb_cdc_rx_pending(int channel);
+void tusb_cdc_rx_consume(int channel, size_t len);
+size_t tusb_cdc_write(int channel, const uint8_t *data, size_t len);
+esp_err_t tusb_cdc_register_handlers(httpd_handle_t server);
+
+/* CDC-ACM <-> TCP bridge */
+esp_err_t cdc_tcp_bridge_start(void);
+void cdc_tcp_bridge_rx_notify(size_t pending);
+
+/* USB-NCM RX frame pool */
+typedef struct {
+    uint32_t slots;
+    uint32_t in_use;
+    uint32_t high_water;
+    uint32_t exhausted_count;       // pool was empty when a frame arrived
+    uint32_t heap_fallback_count;   // frames served from the heap instead of a slot
+    uint32_t alloc_fail_count;      // frames dropped because the heap was exhausted too
+} ncm_rx_pool_stats_t;
+
+void ncm_rx_pool_init(void);
+void *ncm_rx_pool_alloc(size_t len);
+void ncm_rx_pool_free(void *buffer);
+void ncm_rx_pool_get_stats(ncm_rx_pool_stats_t *stats);
+
+/* USB-NCM asynchronous TX path */
+typedef struct {
+    uint32_t queue_depth;
+    uint32_t queue_high_water;
+    uint32_t frames_sent;
+    uint32_t bytes_sent;
+    uint32_t drains;                // rounds of the TX task, each takes up to CFG_TUD_NCM_IN_NTB_N frames
+    uint32_t last_drain;            // frames taken in the last round
+    uint32_t max_drain;
+    uint32_t backpressure_count;    // frames refused with ESP_ERR_NO_MEM because the queue was full
+    uint32_t drop_count;            // frames accepted or offered but never delivered to the host
+} ncm_tx_stats_t;
+
+esp_err_t ncm_tx_start(void);
+esp_err_t ncm_tx_enqueue(void *buffer, size_t len, void *netstack_buf);
+void ncm_tx_get_stats(ncm_tx_stats_t *stats);
+
+/* Memory-mapped web asset image */
+typedef struct {
+    const char *content_type;
+    const char *data;
+    size_t len;
+    const char *gz_data;    // NULL when the asset has no gzip variant
+    size_t gz_len;
+    const char *etag;       // 16 hex characters, not NUL-terminated
+    bool immutable;
+} www_image_asset_t;
+
+esp_err_t www_image_init(const char *partition_label);
+bool www_image_find(const char *uri, www_image_asset_t *asset);
+
+/* Metrics registry: counters and latency histograms served at /api/v1/metrics */
+#define METRICS_COUNTERS(X) \
+    X(NCM_RX_FRAMES,        "ncm_rx_frames_total",          "Frames received from the USB host") \
+    X(NCM_RX_BYTES,         "ncm_rx_bytes_total",           "Bytes received from the USB host") \
+    X(NCM_RX_NETIF_ERRORS,  "ncm_rx_netif_errors_total",    "Received frames rejected by esp_netif") \
+    X(NCM_TX_OFFERED,       "ncm_tx_offered_total",         "Frames handed to the USB TX path by lwIP") \
+    X(NCM_TX_REFUSED,       "ncm_tx_refused_total",         "Frames lwIP has to retry because the TX path refused them") \
+    X(CDC_RX_READS,         "cdc_rx_reads_total",           "Reads from TinyUSB that returned data") \
+    X(CDC_RX_BYTES,         "cdc_rx_bytes_total",           "Bytes received on the CDC-ACM port") \
+    X(CDC_RX_DROPS,         "cdc_rx_drops_total",           "Times received data was dropped on a full RX ring") \
+    X(CDC_RX_DROP_BYTES,    "cdc_rx_drop_bytes_total",      "Bytes dropped on a full RX ring") \
+    X(CDC_RX_STALLS,        "cdc_rx_stalls_total",          "Times reading from TinyUSB was paused on a full RX ring") \
+    X(CDC_TX_BYTES,         "cdc_tx_bytes_total",           "Bytes queued for the host on the CDC-ACM port") \
+    X(CDC_TX_SHORT_WRITES,  "cdc_tx_short_writes_total",    "CDC-ACM writes cut short by a full TX FIFO") \
+    X(HTTP_API_REQUESTS,    "http_api_requests_total",      "REST API requests") \
+    X(HTTP_API_ERRORS,      "http_api_errors_total",        "REST API requests whose handler failed") \
+    X(HTTP_STATIC_REQUESTS, "http_static_requests_total",   "Static asset requests") \
+    X(HTTP_STATIC_ASYNC,    "http_static_async_total",      "Static asset requests served by an async worker") \
+    X(HTTP_NOT_MODIFIED,    "http_not_modified_total",      "Static asset requests answered with 304") \
+    X(HTTP_RANGE_REQUESTS,  "http_range_requests_total",    "Static asset requests answered with 206") \
+    X(HTTP_BATCH_OPS,       "http_batch_ops_total",         "Operations run through /api/v1/batch") \
+    X(PERF_RX_BYTES,        "perf_rx_bytes_total",          "Bytes received by the throughput sinks") \
+    X(PERF_TX_BYTES,        "perf_tx_bytes_total",          "Bytes sent by the throughput source") \
+    X(PERF_UDP_LOST,        "perf_udp_lost_total",          "Datagrams missing from UDP throughput runs")
+
+#define METRICS_HISTOGRAMS(X) \
+    X(NCM_RX_HANDOFF,       "ncm_rx_handoff_seconds",       "Time to copy a received frame and hand it to lwIP") \
+    X(NCM_TX_QUEUE_WAIT,    "ncm_tx_queue_wait_seconds",    "Time a frame waits in the USB TX queue") \
+    X(NCM_TX_SEND,          "ncm_tx_send_seconds",          "Time TinyUSB takes to accept a frame") \
+    X(CDC_RX_CALLBACK,      "cdc_rx_callback_seconds",      "Time spent moving data from TinyUSB into the RX ring") \
+    X(CDC_RX_STALL,         "cdc_rx_stall_seconds",         "Duration of paused CDC-ACM reads") \
+    X(CDC_DRAIN,            "cdc_drain_seconds",            "Time the CDC handler takes to drain the RX ring") \
+    X(HTTP_API,             "http_api_seconds",             "REST API handler duration") \
+    X(HTTP_STATIC,          "http_static_seconds",          "Static asset transfer duration")
+
+#define METRIC_COUNTER_ENUM(id, name, help) METRIC_##id,
+#define METRIC_HIST_ENUM(id, name, help) METRIC_HIST_##id,
+typedef enum { METRICS_COUNTERS(METRIC_COUNTER_ENUM) METRIC_COUNTER_MAX } metric_counter_t;
+typedef enum { METRICS_HISTOGRAMS(METRIC_HIST_ENUM) METRIC_HIST_MAX } metric_histogram_t;
+
+void metrics_add(metric_counter_t id, uint32_t n);
+#define metrics_inc(id) metrics_add(id, 1)
+void metrics_observe_us(metric_histogram_t id, uint32_t us);
+#define metrics_observe_since(id, start_us) metrics_observe_us(id, esp_timer_get_time() - (start_us))
+uint64_t metrics_counter_get(metric_counter_t id);
+esp_err_t metrics_register_handlers(httpd_handle_t server);
+
+/* Binary trace ring for data path events */
+typedef enum {
+    TRACE_EVT_CDC_RX = 1,
+    TRACE_EVT_CDC_TX = 2,
+    TRACE_EVT_CDC_DROP = 3,     // data discarded on a full RX ring, len is the number of bytes lost
+    TRACE_EVT_CDC_STALL = 4,    // reading paused on a full RX ring
+} trace_event_t;
+
+void trace_record(trace_event_t event, uint8_t channel, const void *data, size_t len);
+esp_err_t trace_register_handlers(httpd_handle_t server);
+
+/* USB-NCM packet capture, streamed as pcap from /api/v1/pcap */
+typedef enum {
+    PCAP_DIR_RX = 1,    // host -> device
+    PCAP_DIR_TX = 2,    // device -> host
+} pcap_dir_t;
+
+#if CONFIG_EXAMPLE_PCAP_CAPTURE
+void pcap_capture_frame(pcap_dir_t dir, const void *frame, size_t len);
+esp_err_t pcap_register_handlers(httpd_handle_t server);
+#else
+static inline void pcap_capture_frame(pcap_dir_t dir, const void *frame, size_t len) {}
+#endif
+
+#if CONFIG_EXAMPLE_OTA_UPDATE
+/* Pipelined firmware upload to the next OTA slot, POST /api/v1/ota */
+esp_err_t ota_register_handlers(httpd_handle_t server);
+void ota_confirm_running_image(void);
+#endif
+
+/* Boot phase timestamps, served at /api/v1/system/boot */
+void boot_phase_mark(const char *name);
+void boot_phase_first_request(void);
+esp_err_t boot_phase_register_handlers(httpd_handle_t server);
+
+/* Per-task CPU usage since the previous request, served at /api/v1/system/tasks */
+esp_err_t task_stats_register_handlers(httpd_handle_t server);
+
+/* Memory budget: static buffers and live/peak heap per subsystem, served at /api/v1/system/memory */
+#define MEM_BUDGET_SUBSYSTEMS(X) \
+    X(NCM_RX,       "ncm_rx") \
+    X(NCM_TX,       "ncm_tx") \
+    X(CDC,          "cdc") \
+    X(CDC_BRIDGE,   "cdc_bridge") \
+    X(HTTPD,        "httpd") \
+    X(TELEMETRY,    "telemetry") \
+    X(TRACE,        "trace") \
+    X(PCAP,         "pcap") \
+    X(OTA,          "ota")
+
+#define MEM_BUDGET_ENUM(id, name) MEM_##id,
+typedef enum { MEM_BUDGET_SUBSYSTEMS(MEM_BUDGET_ENUM) MEM_SUBSYSTEM_MAX } mem_subsystem_t;
+
+typedef enum {
+    MEM_PLACE_INTERNAL,     // USB data paths: internal RAM only
+    MEM_PLACE_ANY,          // PSRAM first when EXAMPLE_PSRAM_BUFFERS is enabled
+} mem_place_t;
+
+void mem_budget_add_static(mem_subsystem_t sub, size_t bytes);
+void *mem_budget_alloc(mem_subsystem_t sub, size_t size, mem_place_t place);
+void mem_budget_free(mem_subsystem_t sub, void *ptr);
+esp_err_t mem_budget_register_handlers(httpd_handle_t server);
+
+/* RGB light engine: latest-value-wins mailbox applied once per frame as a hardware fade */
+typedef struct {
+    uint8_t red;
+    uint8_t green;
+    uint8_t blue;
+} light_rgb_t;
+
+esp_err_t light_engine_start(void);
+void light_engine_post(light_rgb_t rgb);
+void light_engine_write_state(json_writer_t *w);
+
+/* Telemetry sampling and WebSocket push */
+esp_err_t telemetry_register_handlers(httpd_handle_t server);
+float telemetry_read_temperature(void);
+
+#if CONFIG_EXAMPLE_PERF_SERVER
+/* iperf-style TCP/UDP sinks and a TCP source on the NCM interface */
+esp_err_t perf_server_start(void);
+#endif
+
+#if CONFIG_EXAMPLE_BENCHMARK
+/* Boot-time microbenchmarks, results are printed as JSON lines */
+void benchmark_run(void);
+#endif
 #endif
@@ -15,7 +15,12 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_spiffs.h"
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_LITTLEFS
+#include "esp_littlefs.h"
+#endif
 #include "tinyusb.h"
 #include "tinyusb_net.h"
 #include "esp_err.h"
@@ -24,31 +29,39 @@
 #include "esp_mac.h"
 #include "esp_netif.h"
 #include "esp_netif_ip_addr.h"
+#include "esp_timer.h"
 #include "lwip/esp_netif_net_stack.h"
 #include "tusb_ncm_demo.h"
 
 static const char *TAG = "NCM/RNDIS";
 #define DEF_IP "192.168.4.1"
-static void tinyusb_netif_free_buffer_cb(void *buffer, void *ctx)
-{
-    //TODO use slot instead of buffer from heap
-    free(buffer);
-}
-
+#define INIT_WEB_STACK 4096
+#define INIT_WEB_PRIO 2
 static esp_err_t tinyusb_netif_recv_cb(void *buffer, uint16_t len, void *ctx)
 {
     esp_netif_t *s_netif=ctx;
     if (s_netif) {
-        void *buf_copy = malloc(len);
-        if (!buf_copy) {
+        int64_t start = esp_timer_get_time();
+        // TinyUSB recycles its NTB as soon as we return, so the frame is copied into a pool slot
+        // which lwIP owns until netif_l2_free_cb hands it back
+        void *frame = ncm_rx_pool_alloc(len);
+        if (!frame) {
             ESP_LOGE(TAG,"No Memory for size: %d",len);
             return ESP_ERR_NO_MEM;            
         } else {
             ESP_LOGD(TAG, "received bytes from ethernet %d ",len);
         }
 
-        memcpy(buf_copy, buffer, len);
-        return esp_netif_receive(s_netif, buf_copy, len, NULL);      
+        memcpy(frame, buffer, len);
+        pcap_capture_frame(PCAP_DIR_RX, frame, len);
+        esp_err_t ret = esp_netif_receive(s_netif, frame, len, NULL);
+        metrics_inc(METRIC_NCM_RX_FRAMES);
+        metrics_add(METRIC_NCM_RX_BYTES, len);
+        if (ret != ESP_OK) {
+            metrics_inc(METRIC_NCM_RX_NETIF_ERRORS);
+        }
+        metrics_observe_since(METRIC_HIST_NCM_RX_HANDOFF, start);
+        return ret;
     } else {
         //Shall we assert here? 
     }
@@ -69,9 +82,10 @@ static esp_err_t create_usb_eth_if(esp_netif_t *s_netif,tusb_net_rx_cb_t tusb_ne
         // locally administrated address for the ncm device as it's going to be used internally        
        .mac_addr ={0},                   
        .on_recv_callback = tusb_net_rx_cb, // tinyusb_netif_recv_cb,
-       .free_tx_buffer = tusb_net_free_tx_cb, //wifi_netif_free_buffer_cb, // tinyusb_netif_free_buffer_cb,
+       .free_tx_buffer = tusb_net_free_tx_cb, // NULL: TX frames are owned and released by the TX task
        .user_context=s_netif               
     };
+    ncm_rx_pool_init();
     ESP_ERROR_CHECK(esp_read_mac(net_config.mac_addr,  ESP_MAC_ETH));
     ESP_ERROR_CHECK(tinyusb_net_init(TINYUSB_USBDEV_0, &net_config));
               
@@ -81,23 +95,23 @@ static esp_err_t create_usb_eth_if(esp_netif_t *s_netif,tusb_net_rx_cb_t tusb_ne
 
 static void netif_l2_free_cb(void *h, void *buffer)
 { 
-    free(buffer);
+    ncm_rx_pool_free(buffer);
 }
 
-static esp_err_t ether2usb_transmit_cb (void *h, void *buffer, size_t len)
+static esp_err_t ether2usb_transmit_wrap_cb (void *h, void *buffer, size_t len, void *netstack_buf)
 {
-#define TUSB_SEND_TO 100
-    esp_err_t esp_err = tinyusb_net_send_sync(buffer, len, NULL, pdMS_TO_TICKS(TUSB_SEND_TO));
-    if (esp_err != ESP_OK){
-        ESP_LOGE("Ethernet->USB", "Failed to send, retrying, error %d: %s", esp_err, esp_err_to_name(esp_err));
-        esp_err = tinyusb_net_send_sync(buffer, len, NULL, pdMS_TO_TICKS(TUSB_SEND_TO) * 3);
-    }
-    if (esp_err != ESP_OK) {
-        ESP_LOGE("Ethernet->USB", "Failed to send buffer to USB! %d: %s", esp_err, esp_err_to_name(esp_err));
-    } else {
-        ESP_LOGD("Ethernet->USB", "Sent to USB %zu ", len);
+    metrics_inc(METRIC_NCM_TX_OFFERED);
+    pcap_capture_frame(PCAP_DIR_TX, buffer, len);
+    esp_err_t ret = ncm_tx_enqueue(buffer, len, netstack_buf);
+    if (ret != ESP_OK) {
+        metrics_inc(METRIC_NCM_TX_REFUSED);
     }
-    return ESP_OK;
+    return ret;
+}
+
+static esp_err_t ether2usb_transmit_cb (void *h, void *buffer, size_t len)
+{
+    return ether2usb_transmit_wrap_cb(h, buffer, len, NULL);
 }
 
 static esp_netif_recv_ret_t ethernetif_receieve_cb(void *h, void *buffer, size_t len, void *l2_buff)
@@ -135,6 +149,7 @@ static esp_err_t create_virtual_net_if(esp_netif_t **res_s_netif)
     esp_netif_driver_ifconfig_t driver_cfg = {
         .handle = (void *)1,                // not using an instance, USB-NCM is a static singleton (must be != NULL)                
         .transmit = ether2usb_transmit_cb,         // point to static Tx function        
+        .transmit_wrap = ether2usb_transmit_wrap_cb, // Tx function that keeps a reference on the lwIP buffer
         .driver_free_rx_buffer = netif_l2_free_cb    // point to Free Rx buffer function
     };
 
@@ -174,17 +189,45 @@ static esp_err_t create_virtual_net_if(esp_netif_t **res_s_netif)
 static esp_err_t init_wired_netif(void)
 {
     static esp_netif_t *g_s_netif = NULL;    
+    ESP_ERROR_CHECK(ncm_tx_start());
     ESP_ERROR_CHECK(create_virtual_net_if(&g_s_netif));  
-    ESP_ERROR_CHECK(create_usb_eth_if(g_s_netif,tinyusb_netif_recv_cb,tinyusb_netif_free_buffer_cb));           
+    ESP_ERROR_CHECK(create_usb_eth_if(g_s_netif,tinyusb_netif_recv_cb,NULL));           
+    return ESP_OK;
+}
+
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_LITTLEFS
+static esp_err_t init_fs(void)
+{
+    esp_vfs_littlefs_conf_t conf = {
+        .base_path = CONFIG_EXAMPLE_WEB_MOUNT_POINT,
+        .partition_label = "www",
+        .format_if_mount_failed = false
+    };
+    esp_err_t ret = esp_vfs_littlefs_register(&conf);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to mount LittleFS (%s)", esp_err_to_name(ret));
+        return ESP_FAIL;
+    }
+
+    size_t total = 0, used = 0;
+    ret = esp_littlefs_info(conf.partition_label, &total, &used);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to get LittleFS partition information (%s)", esp_err_to_name(ret));
+    } else {
+        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+    }
     return ESP_OK;
 }
+#elif CONFIG_EXAMPLE_WEB_ASSET_STORE_SPIFFS
+/* One file per async worker and one for inline transfers, plus an upload and the asset manifest */
+#define WEB_FS_MAX_FILES (CONFIG_EXAMPLE_HTTPD_ASYNC_WORKERS + 3)
 
 static esp_err_t init_fs(void)
 {
     esp_vfs_spiffs_conf_t conf = {
         .base_path = CONFIG_EXAMPLE_WEB_MOUNT_POINT,
         .partition_label = NULL,
-        .max_files = 5,
+        .max_files = WEB_FS_MAX_FILES,
         .format_if_mount_failed = false
     };
     esp_err_t ret = esp_vfs_spiffs_register(&conf);
@@ -205,29 +248,85 @@ static esp_err_t init_fs(void)
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
     } else {
-        ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+        ESP_LOGI(TAG, "Partition size: total: %u, used: %u", (unsigned)total, (unsigned)used);
     }
     return ESP_OK;
 }
+#endif
+
+/* Everything the web UI needs: the asset store and the HTTP server */
+static void init_web(void)
+{
+#if CONFIG_EXAMPLE_WEB_ASSET_STORE_FLASH_IMAGE
+    // Map the web asset image
+    ESP_ERROR_CHECK_WITHOUT_ABORT(www_image_init("www"));
+#else
+    // Mount the web asset filesystem
+    init_fs();
+#endif
+    boot_phase_mark("web_assets");
+
+    ESP_ERROR_CHECK(resetful_server_start(CONFIG_EXAMPLE_WEB_MOUNT_POINT));
+    boot_phase_mark("http_server");
+
+#if CONFIG_EXAMPLE_OTA_UPDATE
+    // The network and the web server came up, so an updated image is good enough to keep
+    ota_confirm_running_image();
+#endif
+}
+
+#if CONFIG_EXAMPLE_FAST_BOOT
+static void init_web_task(void *arg)
+{
+    init_web();
+#if CONFIG_EXAMPLE_BENCHMARK
+    // The benchmarks talk to the web server, so they wait for it here
+    benchmark_run();
+#endif
+    vTaskDelete(NULL);
+}
+#endif
 
 void app_main(void)
 {
     ESP_LOGI(TAG, "starting app for RNDIS and webusb");
 
+    boot_phase_mark("app_main");
+
     // Initialize the TCP/IP stack
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
     // Install TinyUSB driver
     ESP_ERROR_CHECK(install_tinyusb_driver());
+    boot_phase_mark("usb");
 
-    // Initialize the wired network interface
+    // Initialize the wired network interface, the DHCP server answers from here on
     init_wired_netif();
+    boot_phase_mark("netif");
 
-    // Initialize SPIFFS
-    init_fs();
-    
-    ESP_ERROR_CHECK(resetful_server_start(CONFIG_EXAMPLE_WEB_MOUNT_POINT));
+    // The light API only posts to the engine, so it has to run before the web server takes requests
+    ESP_ERROR_CHECK_WITHOUT_ABORT(light_engine_start());
+
+#if CONFIG_EXAMPLE_FAST_BOOT
+    // The host can get its address while the web side comes up on the other core
+    if (xTaskCreatePinnedToCore(init_web_task, "init_web", INIT_WEB_STACK, NULL, INIT_WEB_PRIO, NULL,
+                                APP_TASK_CORE) != pdPASS) {
+        ESP_LOGW(TAG, "Starting the web server inline");
+        init_web();
+    }
+#else
+    init_web();
+#endif
 
     tusb_cdc_handler_init();
+    boot_phase_mark("cdc");
+
+#if CONFIG_EXAMPLE_PERF_SERVER
+    ESP_ERROR_CHECK_WITHOUT_ABORT(perf_server_start());
+#endif
+
+#if CONFIG_EXAMPLE_BENCHMARK && !CONFIG_EXAMPLE_FAST_BOOT
+    benchmark_run();
+#endif
 }
@@ -0,0 +1,114 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Fixed-size pool of frame slots for the USB-NCM receive path. Frames coming from the host are placed in a
+ * slot and handed to lwIP as-is; the slot goes back to the pool when lwIP frees the RX buffer.
+ * Slots are tracked by a single atomic bitmap, so alloc (TinyUSB task) and free (tcpip thread) never take a lock.
+ * When every slot is busy (or the frame does not fit), the frame falls back to internal heap, which is counted
+ * in the memory budget.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "esp_log.h"
+#include "sdkconfig.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "NCM_RX_POOL";
+
+/* Large enough for a full Ethernet frame (1514) plus a VLAN tag, rounded up to keep slots word aligned */
+#define NCM_RX_SLOT_SIZE    1536
+#define NCM_RX_POOL_SLOTS   CONFIG_EXAMPLE_NCM_RX_POOL_SLOTS
+#define NCM_RX_POOL_ALL_FREE ((uint32_t)((1ULL << NCM_RX_POOL_SLOTS) - 1))
+
+_Static_assert(NCM_RX_POOL_SLOTS >= 1 && NCM_RX_POOL_SLOTS <= 32, "RX pool bitmap holds at most 32 slots");
+
+static uint8_t s_rx_slots[NCM_RX_POOL_SLOTS][NCM_RX_SLOT_SIZE] __attribute__((aligned(4)));
+
+static struct {
+    _Atomic uint32_t free_mask;     // bit n set => slot n is free
+    _Atomic uint32_t in_use;
+    _Atomic uint32_t high_water;
+    _Atomic uint32_t exhausted_count;
+    _Atomic uint32_t heap_fallback_count;
+    _Atomic uint32_t alloc_fail_count;
+} s_pool = {
+    .free_mask = NCM_RX_POOL_ALL_FREE,
+};
+
+static void note_slot_taken(void)
+{
+    uint32_t in_use = atomic_fetch_add_explicit(&s_pool.in_use, 1, memory_order_relaxed) + 1;
+    uint32_t high = atomic_load_explicit(&s_pool.high_water, memory_order_relaxed);
+    while (in_use > high &&
+           !atomic_compare_exchange_weak_explicit(&s_pool.high_water, &high, in_use,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void *take_slot(void)
+{
+    uint32_t mask = atomic_load_explicit(&s_pool.free_mask, memory_order_relaxed);
+    while (mask) {
+        uint32_t bit = mask & (~mask + 1);  // lowest free slot
+        if (atomic_compare_exchange_weak_explicit(&s_pool.free_mask, &mask, mask & ~bit,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            note_slot_taken();
+            return s_rx_slots[__builtin_ctz(bit)];
+        }
+    }
+    return NULL;
+}
+
+void ncm_rx_pool_init(void)
+{
+    mem_budget_add_static(MEM_NCM_RX, sizeof(s_rx_slots));
+}
+
+void *ncm_rx_pool_alloc(size_t len)
+{
+    if (len <= NCM_RX_SLOT_SIZE) {
+        void *slot = take_slot();
+        if (slot) {
+            return slot;
+        }
+        atomic_fetch_add_explicit(&s_pool.exhausted_count, 1, memory_order_relaxed);
+        ESP_LOGD(TAG, "Pool exhausted, falling back to heap for %u bytes", (unsigned)len);
+    }
+
+    void *buf = mem_budget_alloc(MEM_NCM_RX, len, MEM_PLACE_INTERNAL);
+    if (buf) {
+        atomic_fetch_add_explicit(&s_pool.heap_fallback_count, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&s_pool.alloc_fail_count, 1, memory_order_relaxed);
+    }
+    return buf;
+}
+
+void ncm_rx_pool_free(void *buffer)
+{
+    uintptr_t addr = (uintptr_t)buffer;
+    uintptr_t base = (uintptr_t)s_rx_slots;
+    if (addr >= base && addr < base + sizeof(s_rx_slots)) {
+        uint32_t slot = (addr - base) / NCM_RX_SLOT_SIZE;
+        atomic_fetch_sub_explicit(&s_pool.in_use, 1, memory_order_relaxed);
+        atomic_fetch_or_explicit(&s_pool.free_mask, 1u << slot, memory_order_release);
+    } else {
+        mem_budget_free(MEM_NCM_RX, buffer);
+    }
+}
+
+void ncm_rx_pool_get_stats(ncm_rx_pool_stats_t *stats)
+{
+    stats->slots = NCM_RX_POOL_SLOTS;
+    stats->in_use = atomic_load_explicit(&s_pool.in_use, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&s_pool.high_water, memory_order_relaxed);
+    stats->exhausted_count = atomic_load_explicit(&s_pool.exhausted_count, memory_order_relaxed);
+    stats->heap_fallback_count = atomic_load_explicit(&s_pool.heap_fallback_count, memory_order_relaxed);
+    stats->alloc_fail_count = atomic_load_explicit(&s_pool.alloc_fail_count, memory_order_relaxed);
+}
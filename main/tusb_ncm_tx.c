@@ -0,0 +1,198 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Asynchronous transmit path from lwIP to the USB host. The netif transmit callbacks only take a reference
+ * on the outgoing frame and post it to a bounded queue, so the tcpip thread never waits on USB.
+ * A dedicated task takes up to CFG_TUD_NCM_IN_NTB_N frames off the queue per round and hands them to
+ * tinyusb_net_send_sync() one at a time; the per-round counts show how deep the queue runs, they are not
+ * NTB packing (TinyUSB decides that). A full queue is reported to lwIP as ESP_ERR_NO_MEM (ERR_MEM), and every
+ * frame that does not make it to the host is counted as a drop.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "tusb.h"
+#include "tinyusb.h"
+#include "tinyusb_net.h"
+#include "esp_log.h"
+#include "esp_netif_net_stack.h"
+#include "esp_timer.h"
+#include "sdkconfig.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "Ethernet->USB";
+
+#ifndef CFG_TUD_NCM_IN_NTB_N
+#define CFG_TUD_NCM_IN_NTB_N 1
+#endif
+
+#define NCM_TX_MAX_DRAIN    CFG_TUD_NCM_IN_NTB_N
+#define NCM_TX_TASK_STACK   3072
+#define NCM_TX_TASK_PRIO    CONFIG_EXAMPLE_NCM_TX_TASK_PRIO
+
+typedef struct {
+    void *buffer;
+    void *netstack_buf;     // lwIP pbuf we hold a reference on, NULL if buffer is our own heap copy
+    uint16_t len;
+    uint32_t queued_us;     // low bits of esp_timer_get_time(), for the queue wait histogram
+} ncm_tx_frame_t;
+
+static struct {
+    QueueHandle_t queue;
+    _Atomic uint32_t queue_high_water;
+    _Atomic uint32_t frames_sent;
+    _Atomic uint32_t bytes_sent;
+    _Atomic uint32_t drains;
+    _Atomic uint32_t last_drain;
+    _Atomic uint32_t max_drain;
+    _Atomic uint32_t backpressure_count;
+    _Atomic uint32_t drop_count;
+} s_tx;
+
+static void release_frame(ncm_tx_frame_t *frame)
+{
+    if (frame->netstack_buf) {
+        esp_netif_netstack_buf_free(frame->netstack_buf);
+    } else {
+        mem_budget_free(MEM_NCM_TX, frame->buffer);
+    }
+}
+
+static void note_queue_depth(void)
+{
+    uint32_t depth = uxQueueMessagesWaiting(s_tx.queue);
+    uint32_t high = atomic_load_explicit(&s_tx.queue_high_water, memory_order_relaxed);
+    while (depth > high &&
+           !atomic_compare_exchange_weak_explicit(&s_tx.queue_high_water, &high, depth,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static esp_err_t post_frame(ncm_tx_frame_t *frame)
+{
+    if (xQueueSend(s_tx.queue, frame, 0) != pdTRUE) {
+        // Let lwIP see ERR_MEM so TCP backs off and retransmits instead of us blocking the tcpip thread
+        atomic_fetch_add_explicit(&s_tx.backpressure_count, 1, memory_order_relaxed);
+        return ESP_ERR_NO_MEM;
+    }
+    note_queue_depth();
+    return ESP_OK;
+}
+
+esp_err_t ncm_tx_enqueue(void *buffer, size_t len, void *netstack_buf)
+{
+    if (!s_tx.queue || len > UINT16_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!tud_ready()) {
+        atomic_fetch_add_explicit(&s_tx.drop_count, 1, memory_order_relaxed);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    ncm_tx_frame_t frame = {
+        .buffer = buffer,
+        .netstack_buf = netstack_buf,
+        .len = len,
+        .queued_us = esp_timer_get_time(),
+    };
+    if (netstack_buf) {
+        esp_netif_netstack_buf_ref(netstack_buf);
+    } else {
+        // No stack buffer to hold on to, the caller's memory is only valid during this call
+        frame.buffer = mem_budget_alloc(MEM_NCM_TX, len, MEM_PLACE_INTERNAL);
+        if (!frame.buffer) {
+            atomic_fetch_add_explicit(&s_tx.drop_count, 1, memory_order_relaxed);
+            return ESP_ERR_NO_MEM;
+        }
+        memcpy(frame.buffer, buffer, len);
+    }
+
+    esp_err_t ret = post_frame(&frame);
+    if (ret != ESP_OK) {
+        release_frame(&frame);
+    }
+    return ret;
+}
+
+static void send_frame(ncm_tx_frame_t *frame)
+{
+    int64_t start = esp_timer_get_time();
+    metrics_observe_us(METRIC_HIST_NCM_TX_QUEUE_WAIT, (uint32_t)start - frame->queued_us);
+    esp_err_t err = tinyusb_net_send_sync(frame->buffer, frame->len, NULL,
+                                          pdMS_TO_TICKS(CONFIG_EXAMPLE_NCM_TX_TIMEOUT_MS));
+    metrics_observe_since(METRIC_HIST_NCM_TX_SEND, start);
+    if (err == ESP_OK) {
+        atomic_fetch_add_explicit(&s_tx.frames_sent, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s_tx.bytes_sent, frame->len, memory_order_relaxed);
+        ESP_LOGD(TAG, "Sent to USB %u ", frame->len);
+    } else {
+        atomic_fetch_add_explicit(&s_tx.drop_count, 1, memory_order_relaxed);
+        ESP_LOGE(TAG, "Failed to send buffer to USB! %d: %s", err, esp_err_to_name(err));
+    }
+    // tinyusb_net_send_sync() has copied the frame into an NTB (or given up on it) by the time it returns
+    release_frame(frame);
+}
+
+static void ncm_tx_task(void *arg)
+{
+    ncm_tx_frame_t round[NCM_TX_MAX_DRAIN];
+
+    while (1) {
+        if (xQueueReceive(s_tx.queue, &round[0], portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        uint32_t count = 1;
+        while (count < NCM_TX_MAX_DRAIN && xQueueReceive(s_tx.queue, &round[count], 0) == pdTRUE) {
+            count++;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            send_frame(&round[i]);
+        }
+
+        atomic_fetch_add_explicit(&s_tx.drains, 1, memory_order_relaxed);
+        atomic_store_explicit(&s_tx.last_drain, count, memory_order_relaxed);
+        if (count > atomic_load_explicit(&s_tx.max_drain, memory_order_relaxed)) {
+            atomic_store_explicit(&s_tx.max_drain, count, memory_order_relaxed);
+        }
+    }
+}
+
+esp_err_t ncm_tx_start(void)
+{
+    s_tx.queue = xQueueCreate(CONFIG_EXAMPLE_NCM_TX_QUEUE_LEN, sizeof(ncm_tx_frame_t));
+    if (!s_tx.queue) {
+        ESP_LOGE(TAG, "No memory for TX queue");
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreatePinnedToCore(ncm_tx_task, "ncm_tx_task", NCM_TX_TASK_STACK, NULL, NCM_TX_TASK_PRIO, NULL,
+                                IO_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create TX task");
+        vQueueDelete(s_tx.queue);
+        s_tx.queue = NULL;
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+void ncm_tx_get_stats(ncm_tx_stats_t *stats)
+{
+    stats->queue_depth = s_tx.queue ? uxQueueMessagesWaiting(s_tx.queue) : 0;
+    stats->queue_high_water = atomic_load_explicit(&s_tx.queue_high_water, memory_order_relaxed);
+    stats->frames_sent = atomic_load_explicit(&s_tx.frames_sent, memory_order_relaxed);
+    stats->bytes_sent = atomic_load_explicit(&s_tx.bytes_sent, memory_order_relaxed);
+    stats->drains = atomic_load_explicit(&s_tx.drains, memory_order_relaxed);
+    stats->last_drain = atomic_load_explicit(&s_tx.last_drain, memory_order_relaxed);
+    stats->max_drain = atomic_load_explicit(&s_tx.max_drain, memory_order_relaxed);
+    stats->backpressure_count = atomic_load_explicit(&s_tx.backpressure_count, memory_order_relaxed);
+    stats->drop_count = atomic_load_explicit(&s_tx.drop_count, memory_order_relaxed);
+}
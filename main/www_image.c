@@ -0,0 +1,186 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/* DESCRIPTION:
+ * Read-only web asset store backed by a flat image in the www partition (built by tools/www_prepare.py).
+ * The whole image is memory-mapped once at start-up (read into the heap on the Linux target); lookups are a binary search over the sorted index and
+ * responses point straight into mapped flash, so no file descriptors or intermediate buffers are involved.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "tusb_ncm_demo.h"
+
+static const char *TAG = "WWW_IMAGE";
+
+#define WWW_IMAGE_MAGIC     0x31575757  // "WWW1"
+#define WWW_IMAGE_VERSION   1
+#define WWW_FLAG_IMMUTABLE  (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t entry_count;
+    uint32_t image_size;
+    uint32_t index_offset;
+    uint32_t strings_offset;
+    uint8_t reserved2[8];
+} www_image_header_t;
+
+typedef struct {
+    uint32_t path_offset;
+    uint32_t type_offset;
+    uint32_t data_offset;
+    uint32_t data_len;
+    uint32_t gz_offset;
+    uint32_t gz_len;
+    char etag[16];
+    uint32_t flags;
+} www_image_entry_t;
+
+_Static_assert(sizeof(www_image_header_t) == 32, "image header layout must match tools/www_prepare.py");
+_Static_assert(sizeof(www_image_entry_t) == 44, "image entry layout must match tools/www_prepare.py");
+
+static struct {
+    const uint8_t *base;
+    const www_image_entry_t *index;
+    uint32_t count;
+    uint32_t size;
+    esp_partition_mmap_handle_t handle;
+} s_image;
+
+static bool string_in_image(const uint8_t *base, uint32_t size, uint32_t offset)
+{
+    return offset < size && memchr(base + offset, '\0', size - offset) != NULL;
+}
+
+static bool blob_in_image(uint32_t size, uint32_t offset, uint32_t len)
+{
+    return offset <= size && len <= size - offset;
+}
+
+#if CONFIG_IDF_TARGET_LINUX
+/* The Linux target has no flash cache to map the partition through, so the image is read into the heap */
+static esp_err_t image_map(const esp_partition_t *part, size_t size, const void **ptr)
+{
+    void *copy = malloc(size);
+    if (!copy) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = esp_partition_read(part, 0, copy, size);
+    if (ret != ESP_OK) {
+        free(copy);
+        return ret;
+    }
+    *ptr = copy;
+    return ESP_OK;
+}
+
+static void image_unmap(const void *ptr)
+{
+    free((void *)ptr);
+}
+#else
+static esp_err_t image_map(const esp_partition_t *part, size_t size, const void **ptr)
+{
+    return esp_partition_mmap(part, 0, size, ESP_PARTITION_MMAP_DATA, ptr, &s_image.handle);
+}
+
+static void image_unmap(const void *ptr)
+{
+    esp_partition_munmap(s_image.handle);
+}
+#endif
+
+static esp_err_t validate_index(const uint8_t *base, const www_image_header_t *hdr)
+{
+    const www_image_entry_t *index = (const www_image_entry_t *)(base + hdr->index_offset);
+    for (uint32_t i = 0; i < hdr->entry_count; i++) {
+        const www_image_entry_t *e = &index[i];
+        if (!string_in_image(base, hdr->image_size, e->path_offset) ||
+                !string_in_image(base, hdr->image_size, e->type_offset) ||
+                !blob_in_image(hdr->image_size, e->data_offset, e->data_len) ||
+                !blob_in_image(hdr->image_size, e->gz_offset, e->gz_len)) {
+            ESP_LOGE(TAG, "Corrupted index entry %u", (unsigned)i);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t www_image_init(const char *partition_label)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                           partition_label);
+    if (!part) {
+        ESP_LOGE(TAG, "Failed to find partition %s", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    www_image_header_t hdr;
+    esp_err_t ret = esp_partition_read(part, 0, &hdr, sizeof(hdr));
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    if (hdr.magic != WWW_IMAGE_MAGIC || hdr.version != WWW_IMAGE_VERSION) {
+        ESP_LOGE(TAG, "No asset image in partition %s (magic 0x%08x)", partition_label, (unsigned)hdr.magic);
+        return ESP_ERR_INVALID_VERSION;
+    }
+    if (hdr.image_size > part->size || hdr.index_offset < sizeof(hdr) ||
+            !blob_in_image(hdr.image_size, hdr.index_offset, hdr.entry_count * sizeof(www_image_entry_t))) {
+        ESP_LOGE(TAG, "Asset image header out of bounds");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    const void *ptr = NULL;
+    ret = image_map(part, hdr.image_size, &ptr);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map asset image (%s)", esp_err_to_name(ret));
+        return ret;
+    }
+    ret = validate_index(ptr, &hdr);
+    if (ret != ESP_OK) {
+        image_unmap(ptr);
+        return ret;
+    }
+
+    s_image.base = ptr;
+    s_image.index = (const www_image_entry_t *)(s_image.base + hdr.index_offset);
+    s_image.count = hdr.entry_count;
+    s_image.size = hdr.image_size;
+    ESP_LOGI(TAG, "Mapped %u assets, %u bytes", (unsigned)s_image.count, (unsigned)s_image.size);
+    return ESP_OK;
+}
+
+static int entry_cmp(const void *key, const void *elem)
+{
+    const www_image_entry_t *e = elem;
+    return strcmp((const char *)key, (const char *)s_image.base + e->path_offset);
+}
+
+bool www_image_find(const char *uri, www_image_asset_t *asset)
+{
+    if (!s_image.base) {
+        return false;
+    }
+    const www_image_entry_t *e = bsearch(uri, s_image.index, s_image.count, sizeof(www_image_entry_t), entry_cmp);
+    if (!e) {
+        return false;
+    }
+    asset->content_type = (const char *)s_image.base + e->type_offset;
+    asset->data = (const char *)s_image.base + e->data_offset;
+    asset->len = e->data_len;
+    asset->gz_data = e->gz_len ? (const char *)s_image.base + e->gz_offset : NULL;
+    asset->gz_len = e->gz_len;
+    asset->etag = e->etag;
+    asset->immutable = e->flags & WWW_FLAG_IMMUTABLE;
+    return true;
+}
@@ -1,5 +1,7 @@
 # SPDX-FileCopyrightText: 2022-2024 Espressif Systems (Shanghai) CO LTD
 # SPDX-License-Identifier: CC0-1.0
+import json
+import os
 import subprocess
 import time
 
@@ -25,3 +27,29 @@ def test_usb_device_ncm_example(dut: Dut) -> None:
         print("NCM device's MAC address {} was found in system network interfaces".format(netif_mac))
     else:
         raise AssertionError('NCM device not found in network interface list')
+
+
+@pytest.mark.esp32s2
+@pytest.mark.esp32s3
+@pytest.mark.temp_skip_ci(targets=['esp32s3'], reason='lack of runners with usb_device tag')
+@pytest.mark.usb_device
+@pytest.mark.parametrize('config', ['bench'], indirect=True)
+def test_usb_device_ncm_benchmark(dut: Dut) -> None:
+    results = []
+    errors = []
+    while True:
+        line = dut.expect(r'BENCH (\{.*\}|error .*|done)\r?\n', timeout=120).group(1).decode('utf-8')
+        if line == 'done':
+            break
+        if line.startswith('error '):
+            errors.append(line[len('error '):])
+            continue
+        results.append(json.loads(line))
+    if not results:
+        raise AssertionError('No benchmark results')
+    with open(os.path.join(dut.logdir, 'benchmark.json'), 'w') as f:
+        json.dump({'target': dut.target, 'results': results}, f, indent=2)
+    for r in results:
+        print('{case:<24} {size:>5} {ns_per_op:>10} ns/op {allocs_per_op} allocs/op'.format(**r))
+    if errors:
+        raise AssertionError('Checks failed:\n' + '\n'.join(errors))
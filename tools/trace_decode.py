@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+"""
+Decode a CDC data path trace downloaded from the device, e.g.
+
+    curl -X POST 'http://192.168.4.1/api/v1/trace?enable=1&clear=1'
+    curl -o cdc.trace http://192.168.4.1/api/v1/trace
+    tools/trace_decode.py cdc.trace
+
+The file layout is described in main/trace.c.
+"""
+import argparse
+import struct
+import sys
+
+HEADER = struct.Struct('<4sHHHHI')
+RECORD_HEAD = struct.Struct('<IIBBH')
+MAGIC = b'TRC1'
+VERSION = 1
+
+EVENTS = {
+    1: 'RX',
+    2: 'TX',
+    3: 'DROP',
+    4: 'STALL',
+}
+
+
+def printable(data: bytes) -> str:
+    return ''.join(chr(b) if 0x20 <= b < 0x7f else '.' for b in data)
+
+
+def decode(blob: bytes, out) -> None:
+    if len(blob) < HEADER.size:
+        sys.exit('trace file is truncated')
+    magic, version, record_size, capture_bytes, _, lost = HEADER.unpack_from(blob)
+    if magic != MAGIC or version != VERSION:
+        sys.exit('not a version {} trace file'.format(VERSION))
+    if record_size != RECORD_HEAD.size + capture_bytes:
+        sys.exit('record size {} does not match {} captured bytes'.format(record_size, capture_bytes))
+    if lost:
+        out.write('# {} older records were overwritten before the download\n'.format(lost))
+
+    prev_ts = None
+    offset = HEADER.size
+    while offset + record_size <= len(blob):
+        seq, ts, event, channel, length = RECORD_HEAD.unpack_from(blob, offset)
+        data = blob[offset + RECORD_HEAD.size:offset + RECORD_HEAD.size + min(length, capture_bytes)]
+        offset += record_size
+
+        delta = '' if prev_ts is None else '+{}'.format((ts - prev_ts) & 0xffffffff)
+        prev_ts = ts
+        name = EVENTS.get(event, 'EVT{}'.format(event))
+        line = '{:>8} {:>12} {:>10} {:<5} ch{} len={:<5}'.format(seq - 1, ts, delta, name, channel, length)
+        if data:
+            line += ' {} |{}|'.format(data.hex(' '), printable(data))
+            if length > len(data):
+                line += ' ...'
+        out.write(line + '\n')
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('trace', help='File downloaded from /api/v1/trace')
+    args = parser.parse_args()
+    with open(args.trace, 'rb') as f:
+        decode(f.read(), sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
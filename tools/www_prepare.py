@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+"""
+Prepare the web front-end for the www partition.
+
+Every asset of the built front-end (front/web-demo/dist) gets a gzip-compressed variant when that saves
+space, a strong ETag derived from its content and an "immutable" flag when its file name carries a content
+hash (e.g. js/app.3f2a1b9c.js), so the browser can cache it forever. Two output formats are supported:
+
+dir (default)
+    A staging directory packed into SPIFFS or LittleFS: the assets, their .gz variants and an asset
+    manifest whose lines are ``<uri> <etag> <has_gzip> <immutable>``.
+
+image
+    A flat image read by main/www_image.c straight from memory-mapped flash. Layout (little endian):
+
+    header   magic "WWW1", u16 version, u16 reserved, u32 entry_count, u32 image_size,
+             u32 index_offset, u32 strings_offset, 8 reserved bytes
+    index    entry_count entries sorted by uri: u32 path_offset, u32 type_offset, u32 data_offset,
+             u32 data_len, u32 gz_offset, u32 gz_len, char etag[16], u32 flags (bit0: immutable)
+    strings  NUL-terminated uris and content types
+    data     asset contents, 4-byte aligned
+"""
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import struct
+import sys
+
+MANIFEST_NAME = 'asset-manifest.txt'
+COMPRESSIBLE = ('.html', '.js', '.css', '.svg', '.json', '.map', '.txt', '.ico')
+MIN_GZIP_SIZE = 256
+HASHED_NAME = re.compile(r'\.[0-9a-f]{8,}\.[a-z0-9]+$')
+
+# Keep in sync with content_type_from_file() in main/resetful_server.c
+CONTENT_TYPES = {
+    '.html': 'text/html',
+    '.js': 'application/javascript',
+    '.css': 'text/css',
+    '.png': 'image/png',
+    '.ico': 'image/x-icon',
+    '.svg': 'text/xml',
+}
+DEFAULT_CONTENT_TYPE = 'text/plain'
+
+IMAGE_MAGIC = b'WWW1'
+IMAGE_VERSION = 1
+IMAGE_HEADER = struct.Struct('<4sHHIIII8x')
+IMAGE_ENTRY = struct.Struct('<IIIIII16sI')
+IMAGE_FLAG_IMMUTABLE = 1
+
+
+class Asset:
+    def __init__(self, uri: str, data: bytes) -> None:
+        self.uri = uri
+        self.data = data
+        self.gz = None
+        name = uri.rsplit('/', 1)[-1]
+        if name.lower().endswith(COMPRESSIBLE) and len(data) >= MIN_GZIP_SIZE:
+            # mtime=0 keeps the image reproducible between builds
+            packed = gzip.compress(data, compresslevel=9, mtime=0)
+            if len(packed) < len(data):
+                self.gz = packed
+        self.etag = hashlib.sha256(data).hexdigest()[:16]
+        self.immutable = HASHED_NAME.search(name) is not None
+        self.content_type = CONTENT_TYPES.get(os.path.splitext(name)[1].lower(), DEFAULT_CONTENT_TYPE)
+
+
+def collect(src_dir: str) -> list:
+    assets = []
+    for root, _, files in os.walk(src_dir):
+        for name in files:
+            if name.endswith('.gz') or name == MANIFEST_NAME:
+                continue
+            path = os.path.join(root, name)
+            with open(path, 'rb') as f:
+                data = f.read()
+            assets.append(Asset('/' + os.path.relpath(path, src_dir).replace(os.sep, '/'), data))
+    assets.sort(key=lambda a: a.uri.encode())
+    return assets
+
+
+def write_dir(assets: list, out_dir: str) -> None:
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+    os.makedirs(out_dir)
+    with open(os.path.join(out_dir, MANIFEST_NAME), 'w') as manifest:
+        for asset in assets:
+            dst = os.path.join(out_dir, asset.uri.lstrip('/'))
+            os.makedirs(os.path.dirname(dst), exist_ok=True)
+            with open(dst, 'wb') as f:
+                f.write(asset.data)
+            if asset.gz:
+                with open(dst + '.gz', 'wb') as f:
+                    f.write(asset.gz)
+            manifest.write('{} {} {} {}\n'.format(asset.uri, asset.etag, int(asset.gz is not None), int(asset.immutable)))
+
+
+def align4(n: int) -> int:
+    return (n + 3) & ~3
+
+
+def write_image(assets: list, out_file: str, max_size: int) -> None:
+    index_offset = IMAGE_HEADER.size
+    strings_offset = index_offset + IMAGE_ENTRY.size * len(assets)
+
+    strings = bytearray()
+    string_offsets = {}
+
+    def add_string(s: str) -> int:
+        if s not in string_offsets:
+            string_offsets[s] = strings_offset + len(strings)
+            strings.extend(s.encode() + b'\0')
+        return string_offsets[s]
+
+    for asset in assets:
+        add_string(asset.uri)
+        add_string(asset.content_type)
+
+    data = bytearray()
+    data_offset = align4(strings_offset + len(strings))
+
+    def add_blob(blob: bytes) -> int:
+        offset = data_offset + len(data)
+        data.extend(blob)
+        data.extend(b'\0' * (align4(len(data)) - len(data)))
+        return offset
+
+    index = bytearray()
+    for asset in assets:
+        offset = add_blob(asset.data)
+        gz_offset = add_blob(asset.gz) if asset.gz else 0
+        index.extend(IMAGE_ENTRY.pack(string_offsets[asset.uri], string_offsets[asset.content_type],
+                                      offset, len(asset.data), gz_offset, len(asset.gz) if asset.gz else 0,
+                                      asset.etag.encode(), IMAGE_FLAG_IMMUTABLE if asset.immutable else 0))
+
+    padding = b'\0' * (data_offset - strings_offset - len(strings))
+    image_size = data_offset + len(data)
+    if max_size and image_size > max_size:
+        sys.exit('www image is {} bytes, partition only holds {}'.format(image_size, max_size))
+
+    header = IMAGE_HEADER.pack(IMAGE_MAGIC, IMAGE_VERSION, 0, len(assets), image_size, index_offset, strings_offset)
+    with open(out_file, 'wb') as f:
+        f.write(header + index + strings + padding + data)
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('src_dir', help='Built front-end directory (dist)')
+    parser.add_argument('output', help='Staging directory (dir format) or image file (image format)')
+    parser.add_argument('--format', choices=('dir', 'image'), default='dir')
+    parser.add_argument('--max-size', type=lambda s: int(s, 0), default=0, help='Size of the www partition')
+    args = parser.parse_args()
+
+    assets = collect(args.src_dir)
+    if args.format == 'image':
+        write_image(assets, args.output, args.max_size)
+    else:
+        write_dir(assets, args.output)
+
+
+if __name__ == '__main__':
+    main()